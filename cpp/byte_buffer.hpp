@@ -20,6 +20,137 @@ namespace think { namespace byte_buffer {
 	Long,
 	Float,
 	Double,
+	//Packed booleans, eight to a byte; offsets and counts are in bits.
+	Bit,
+      };
+    };
+
+    struct AllocationPolicy {
+      enum Enum {
+	Local = 0,
+	Interleave,
+	Bind,
+      };
+    };
+
+    struct MapMode {
+      enum Enum {
+	ReadOnly = 0,
+	ReadWrite,
+	CopyOnWrite,
+      };
+    };
+
+    struct AccessAdvice {
+      enum Enum {
+	Normal = 0,
+	Sequential,
+	Random,
+	WillNeed,
+	DontNeed,
+      };
+    };
+
+    struct BitOp {
+      enum Enum {
+	And = 0,
+	Or,
+	Xor,
+	AndNot,
+	Not,
+      };
+    };
+
+    struct IntegerCodec {
+      enum Enum {
+	DeltaVarint = 0,
+	FrameOfReference,
+	DeltaFrameOfReference,
+      };
+    };
+
+    struct ChecksumType {
+      enum Enum {
+	Crc32c = 0,
+	XxHash64,
+      };
+    };
+
+    struct NormType {
+      enum Enum {
+	L1 = 0,
+	L2,
+	LInf,
+      };
+    };
+
+    struct NanPolicy {
+      enum Enum {
+	Zero = 0,
+	Replace,
+	Throw,
+      };
+    };
+
+    struct QuantScheme {
+      enum Enum {
+	Symmetric = 0,
+	Asymmetric,
+      };
+    };
+
+    struct ReduceOp {
+      enum Enum {
+	Sum = 0,
+	Min,
+	Max,
+	Mean,
+      };
+    };
+
+    struct BinaryOp {
+      enum Enum {
+	Add = 0,
+	Sub,
+	Mul,
+	Div,
+	Min,
+	Max,
+      };
+    };
+
+    struct UnaryOp {
+      enum Enum {
+	Abs = 0,
+	Sqrt,
+	Exp,
+	Negate,
+      };
+    };
+
+    //Stages of a fused element-wise expression.  Each stage has two operands
+    //a and b: the scalar for the scalar ops, scale and bias for MulAdd, the
+    //bounds for Clamp, the datatype to round through for Cast and the index
+    //of the input buffer for the *Input ops.
+    struct ExprOp {
+      enum Enum {
+	Add = 0,
+	Sub,
+	Mul,
+	Div,
+	Min,
+	Max,
+	MulAdd,
+	Clamp,
+	Abs,
+	Sqrt,
+	Exp,
+	Negate,
+	Cast,
+	AddInput,
+	SubInput,
+	MulInput,
+	DivInput,
       };
     };
 
@@ -28,7 +159,51 @@ namespace think { namespace byte_buffer {
     public:
       virtual ~BufferManager(){}
       virtual int64_t allocate_buffer( int64_t size, const char* file, int line ) = 0;
+      //Page aligned, zero initialized allocation placed on numa nodes according
+      //to the policy.  node is only used by AllocationPolicy::Bind.
+      virtual int64_t allocate_buffer( int64_t size, AllocationPolicy::Enum policy, int32_t node,
+				       const char* file, int line ) = 0;
+      //Map size bytes of a file starting at byte offset; size <= 0 maps to the end
+      //of the file.  ReadWrite mappings are shared with the file (and extend it
+      //if needed), CopyOnWrite mappings are private.  The returned buffer is
+      //released with release_buffer.
+      virtual int64_t map_file( const char* path, MapMode::Enum mode, int64_t offset, int64_t size ) = 0;
+      //Write back modified pages of a byte range of a file or shared buffer.
+      virtual void flush_buffer( int64_t data, int64_t offset, int64_t size, bool async ) = 0;
+      //Advise the kernel of the access pattern of a byte range of a file or
+      //shared buffer.  DontNeed only drops pages lying entirely inside the
+      //range and is refused for copy on write mappings.
+      virtual void advise_buffer( int64_t data, int64_t offset, int64_t size, AccessAdvice::Enum advice ) = 0;
+      //Allocate a buffer in shared memory.  A null or empty name creates an
+      //anonymous memfd buffer whose descriptor (see shared_buffer_fd) is handed
+      //to the other process; a name creates it with shm_open.
+      virtual int64_t allocate_shared_buffer( const char* name, int64_t size ) = 0;
+      virtual int64_t attach_shared_buffer( const char* name, bool read_only ) = 0;
+      virtual int64_t attach_shared_buffer( int32_t fd, bool read_only ) = 0;
+      virtual int32_t shared_buffer_fd( int64_t data ) = 0;
+      //Remove a named shared buffer; attached processes keep their mappings.
+      virtual void unlink_shared_buffer( const char* name ) = 0;
+      //Shared buffers carry a description of their contents visible to every
+      //attached process.  get_shared_metadata fills metadata with
+      //{datatype, offset, n_elems, byte size, generation}; generation changes
+      //whenever the metadata is set.  Readers never see a partly written
+      //update, and the range is checked against the buffer's size on both
+      //sides.  Read only attachments cannot set it.  data may point anywhere
+      //inside the buffer, such as into a view of it; offsets are always from
+      //the start of the buffer.
+      virtual void set_shared_metadata( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems ) = 0;
+      virtual void get_shared_metadata( int64_t data, int64_t* metadata ) = 0;
+      //Buffers are reference counted.  data may be any address inside a buffer
+      //(a view); retaining it keeps the whole buffer alive until the matching
+      //release_buffer.  Allocation returns a buffer with one reference.
+      virtual void retain_buffer( int64_t data ) = 0;
       virtual void release_buffer( int64_t data) = 0;
+      //Grow or shrink a buffer, returning its (possibly moved) address.  Contents
+      //up to the smaller of the two sizes are preserved; heap buffers use
+      //realloc and numa placed buffers are grown with mremap so large buffers
+      //are remapped rather than copied.  Buffers with retained views cannot be
+      //resized.
+      virtual int64_t resize_buffer( int64_t data, int64_t new_size ) = 0;
 
       virtual void copy( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
 			 unsigned char* dst, int64_t offset, int64_t n_elems ) = 0;
@@ -74,6 +249,301 @@ namespace think { namespace byte_buffer {
       virtual void set_value( int64_t dst_data, Datatype::Enum dst_type,
 			      int64_t offset, double value, int64_t n_elems ) = 0;
 
+      //Reductions over n_elems elements starting at offset.  Float sums are
+      //accumulated pairwise in double.  Integer sums wrap on overflow in int64
+      //and are returned as double, so results above 2^53 are rounded.  Min
+      //and max return NaN if the range contains one.  The sum of an empty
+      //range is 0, its mean NaN, and its min and max throw.
+      virtual double reduce( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems,
+			     ReduceOp::Enum op ) = 0;
+      //Index relative to offset of the first minimum/maximum, or of the first NaN.
+      virtual int64_t argmin( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems ) = 0;
+      virtual int64_t argmax( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems ) = 0;
+
+      //Element-wise kernels.  Inputs are converted as copy does and computed in
+      //the widest type involved (integers in int64, sqrt and exp of integers in
+      //double); the result is cast into dst.  dst may alias an input for in
+      //place operation.  Integer arithmetic wraps on overflow and integer
+      //division by zero yields zero.
+      virtual void binary_op( int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+			      int64_t rhs_data, Datatype::Enum rhs_type, int64_t rhs_offset,
+			      int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			      int64_t n_elems, BinaryOp::Enum op ) = 0;
+      //dst = lhs op scalar.  A scalar with a fractional part (or outside
+      //int64's range) makes integer computations use double.
+      virtual void scalar_op( int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+			      double scalar,
+			      int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			      int64_t n_elems, BinaryOp::Enum op ) = 0;
+      virtual void unary_op( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			     int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			     int64_t n_elems, UnaryOp::Enum op ) = 0;
+      virtual void clamp( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			  double low, double high,
+			  int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			  int64_t n_elems ) = 0;
+      //y += alpha * x
+      virtual void axpy( double alpha, int64_t x_data, Datatype::Enum x_type, int64_t x_offset,
+			 int64_t y_data, Datatype::Enum y_type, int64_t y_offset,
+			 int64_t n_elems ) = 0;
+
+      //Evaluate a chain of element-wise stages in a single pass.  Input 0 is
+      //loaded, the n_ops stages described by ops and operands (two per stage)
+      //are applied in order and the result is stored into dst.  Intermediate
+      //values never touch memory, they are processed in cache sized blocks.
+      virtual void evaluate_expression( const int64_t* input_datas, const int32_t* input_types,
+					const int64_t* input_offsets, int32_t n_inputs,
+					const int32_t* ops, const double* operands, int32_t n_ops,
+					int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+					int64_t n_elems ) = 0;
+
+      //XXH64 of the bytes of the range.
+      virtual int64_t hash_range( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems,
+				  int64_t seed ) = 0;
+      //Value equality of two ranges.  Ranges of the same integer type compare
+      //bytes; otherwise values are compared exactly, an integer equalling a
+      //float only when the float holds that integer.  0.0 equals -0.0 and NaN
+      //equals NaN only when nan_equal is set.
+      virtual bool equals_range( int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+				 int64_t rhs_data, Datatype::Enum rhs_type, int64_t rhs_offset,
+				 int64_t n_elems, bool nan_equal ) = 0;
+
+      //Copy an n_dims dimensional tensor into a dense destination with its
+      //dimensions reordered.  Source element (i_0 .. i_n) lives at src_offset +
+      //sum(i_k * src_strides[k]) and destination dimension j is source
+      //dimension permutation[j] (so NCHW -> NHWC is {0, 2, 3, 1}).  Values are
+      //converted as copy does.
+      virtual void permute_copy( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				 const int64_t* shape, const int64_t* src_strides,
+				 const int32_t* permutation, int32_t n_dims,
+				 int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset ) = 0;
+
+      //Split n_elems groups of n_channels interleaved values (RGBRGB..., IQIQ...)
+      //into n_channels planar buffers; channel k goes to dst_datas[k] starting
+      //at dst_offsets[k].  Values are converted as copy does.
+      virtual void deinterleave( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				 int32_t n_channels, const int64_t* dst_datas,
+				 const int64_t* dst_offsets, Datatype::Enum dst_type,
+				 int64_t n_elems ) = 0;
+      //Inverse of deinterleave: merge n_channels planar buffers of n_elems
+      //values each into a single interleaved buffer.
+      virtual void interleave( const int64_t* src_datas, const int64_t* src_offsets,
+			       Datatype::Enum src_type, int32_t n_channels,
+			       int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			       int64_t n_elems ) = 0;
+
+      //Bitwise op over n_bits bits of Bit buffers; Not ignores rhs.
+      virtual void bit_op( int64_t lhs_data, int64_t lhs_offset,
+			   int64_t rhs_data, int64_t rhs_offset,
+			   int64_t dst_data, int64_t dst_offset,
+			   int64_t n_bits, BitOp::Enum op ) = 0;
+      //Number of set bits in a range of a Bit buffer.
+      virtual int64_t popcount( int64_t data, int64_t offset, int64_t n_bits ) = 0;
+
+      //Compress integer ranges into byte buffers.  Encoding returns the bytes
+      //written to dst, which needs max_encoded_size bytes in the worst case;
+      //decoding returns the number of values written to dst.
+      virtual int64_t max_encoded_size( IntegerCodec::Enum codec, int64_t n_elems ) = 0;
+      virtual int64_t encode_integers( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				       int64_t n_elems, IntegerCodec::Enum codec,
+				       int64_t dst_data, int64_t dst_capacity ) = 0;
+      virtual int64_t decoded_count( int64_t src_data, int64_t src_size ) = 0;
+      virtual int64_t decode_integers( int64_t src_data, int64_t src_size,
+				       int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+				       int64_t dst_capacity ) = 0;
+
+      //Blosc style compression: the range is split into blocks of about
+      //block_bytes (0 for the default), each optionally byte shuffled and then
+      //LZ compressed, in parallel.  compress_buffer returns the bytes written
+      //to dst, which needs max_compressed_size bytes in the worst case.
+      virtual int64_t max_compressed_size( Datatype::Enum type, int64_t n_elems, int64_t block_bytes ) = 0;
+      virtual int64_t compress_buffer( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				       int64_t n_elems, int64_t block_bytes, bool shuffle,
+				       int64_t dst_data, int64_t dst_capacity ) = 0;
+      virtual Datatype::Enum compressed_datatype( int64_t src_data, int64_t src_size ) = 0;
+      virtual int64_t compressed_count( int64_t src_data, int64_t src_size ) = 0;
+      //Decompress into dst, converting if dst_type is not the compressed
+      //datatype.  Returns the number of elements written.
+      virtual int64_t decompress_buffer( int64_t src_data, int64_t src_size,
+					 int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+					 int64_t dst_capacity ) = 0;
+
+      //Int8 quantization between Float or Double buffers and Byte buffers,
+      //read as int8 when is_signed and uint8 otherwise.  Element i uses
+      //channel (i / inner_size) % n_channels, one channel being per tensor;
+      //scales and zero_points hold a value per channel and
+      //real = (quantized - zero_point) * scale.  Calibration fits them to the
+      //range's min/max, or to the given percentile of it when below 100.
+      virtual void calibrate_quantization( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+					   int64_t n_elems, int64_t n_channels, int64_t inner_size,
+					   QuantScheme::Enum scheme, bool is_signed, double percentile,
+					   double* scales, int32_t* zero_points ) = 0;
+      virtual void quantize( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			     int64_t n_elems, int64_t n_channels, int64_t inner_size,
+			     const double* scales, const int32_t* zero_points,
+			     int64_t dst_data, int64_t dst_offset, bool is_signed ) = 0;
+      virtual void dequantize( int64_t src_data, int64_t src_offset, bool is_signed,
+			       int64_t n_elems, int64_t n_channels, int64_t inner_size,
+			       const double* scales, const int32_t* zero_points,
+			       int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset ) = 0;
+
+      //Stable LSD radix sort of a range in place.  NaN sorts last, in either
+      //order, as the canonical NaN.  When index_data is nonzero the
+      //permutation applied is written to it as Int or Long positions relative
+      //to offset.  argsort only writes the permutation.
+      virtual void sort( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems,
+			 bool descending, int64_t index_data, Datatype::Enum index_type,
+			 int64_t index_offset ) = 0;
+      virtual void argsort( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems,
+			    bool descending, int64_t index_data, Datatype::Enum index_type,
+			    int64_t index_offset ) = 0;
+
+      //The k largest (or smallest) values of a range, best first with ties
+      //going to the earlier element and NaN ranking below every number.
+      //Values are written converted to values_type and positions relative to
+      //src_offset as Int or Long indices; either data may be 0 to skip it.
+      virtual void top_k( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			  int64_t n_elems, int64_t k, bool largest,
+			  int64_t values_data, Datatype::Enum values_type, int64_t values_offset,
+			  int64_t index_data, Datatype::Enum index_type, int64_t index_offset ) = 0;
+
+      //Prefix sums of src into dst (which may be src).  dst[i] is the sum of
+      //src[0..i], or of src[0..i) when exclusive.  Sums accumulate in the
+      //wider of the two datatypes (int64 for integers), so an Int source can
+      //be scanned into a Long destination without overflowing.
+      virtual void scan( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			 int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			 int64_t n_elems, bool exclusive ) = 0;
+
+      //Histograms of a range, added to counts so batches can accumulate.
+      //Bins are n_bins equal bins over [low, high] or [edges[i], edges[i + 1])
+      //for increasing edges, the last bin closed in both cases; NaN and values
+      //outside are not counted.  bincount counts each integer in [0, n_bins)
+      //and returns the number of values outside that range.
+      virtual void histogram( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			      int64_t n_elems, int64_t n_bins, double low, double high,
+			      int64_t* counts ) = 0;
+      virtual void histogram( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			      int64_t n_elems, const double* edges, int64_t n_edges,
+			      int64_t* counts ) = 0;
+      virtual int64_t bincount( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				int64_t n_elems, int64_t n_bins, int64_t* counts ) = 0;
+
+      //Checksum of the bytes of a range.  Crc32c is the standard Castagnoli
+      //CRC (SSE4.2 accelerated where available) and continues from seed as
+      //the CRC of preceding bytes, 0 to start; XxHash64 uses seed as its seed.
+      virtual int64_t checksum_range( int64_t data, Datatype::Enum type, int64_t offset,
+				      int64_t n_elems, ChecksumType::Enum checksum,
+				      int64_t seed ) = 0;
+      //Copy as copy does and return the checksum of the bytes written to dst,
+      //computed block by block while they are still in cache.  The ranges
+      //must not overlap.
+      virtual int64_t copy_with_checksum( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+					  int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+					  int64_t n_elems, ChecksumType::Enum checksum,
+					  int64_t seed ) = 0;
+
+      //Vector products over ranges of any datatypes, mixed freely (a float
+      //query against a byte table, say).  Integer pairs accumulate in int64,
+      //wrapping on overflow, and everything else in double; dot returns a
+      //double, so integer results above 2^53 are rounded.  Cosine similarity
+      //is NaN when either vector is all zeros.
+      virtual double dot( int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+			  int64_t rhs_data, Datatype::Enum rhs_type, int64_t rhs_offset,
+			  int64_t n_elems ) = 0;
+      virtual double norm( int64_t data, Datatype::Enum type, int64_t offset,
+			   int64_t n_elems, NormType::Enum norm ) = 0;
+      virtual double cosine_similarity( int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+					int64_t rhs_data, Datatype::Enum rhs_type, int64_t rhs_offset,
+					int64_t n_elems ) = 0;
+      //y = A x for the row major n_rows x n_cols matrix A with rows lda
+      //elements apart, or y = x A when transpose is set.  n_vectors products
+      //are computed, the i'th reading x at x_offset + i * x_stride and writing
+      //y at y_offset + i * y_stride.
+      virtual void gemv( int64_t a_data, Datatype::Enum a_type, int64_t a_offset,
+			 int64_t n_rows, int64_t n_cols, int64_t lda, bool transpose,
+			 int64_t x_data, Datatype::Enum x_type, int64_t x_offset, int64_t x_stride,
+			 int64_t y_data, Datatype::Enum y_type, int64_t y_offset, int64_t y_stride,
+			 int64_t n_vectors ) = 0;
+
+      //C = alpha op(A) op(B) + beta C for row major m x n C, op(A) m x k and
+      //op(B) k x n, with rows lda, ldb and ldc elements apart; op transposes
+      //when trans_a or trans_b is set.  All three must be Float or all
+      //Double.  A zero beta ignores the prior contents of C.
+      virtual void gemm( bool trans_a, bool trans_b, int64_t m, int64_t n, int64_t k, double alpha,
+			 int64_t a_data, Datatype::Enum a_type, int64_t a_offset, int64_t lda,
+			 int64_t b_data, Datatype::Enum b_type, int64_t b_offset, int64_t ldb,
+			 double beta,
+			 int64_t c_data, Datatype::Enum c_type, int64_t c_offset, int64_t ldc ) = 0;
+
+      //Running statistics live in a caller owned array of six doubles:
+      //count, mean, sum of squared differences from the mean, min, max and
+      //NaN count, all zeros when empty.  accumulate_statistics folds a range
+      //into it in one pass (from a buffer or, as copy does, from an array);
+      //merge_statistics folds in another state, so ranges may be accumulated
+      //separately on any thread and merged.  NaN values are only counted.
+      virtual void accumulate_statistics( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+					  int64_t n_elems, double* state ) = 0;
+      virtual void accumulate_statistics( const unsigned char* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) = 0;
+      virtual void accumulate_statistics( const int16_t* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) = 0;
+      virtual void accumulate_statistics( const int32_t* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) = 0;
+      virtual void accumulate_statistics( const int64_t* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) = 0;
+      virtual void accumulate_statistics( const float* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) = 0;
+      virtual void accumulate_statistics( const double* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) = 0;
+      virtual void merge_statistics( double* state, const double* other ) = 0;
+
+      //NaN and infinite values in float buffers; integer buffers have none.
+      //find_first_nonfinite returns -1 when every value is finite and
+      //replace_nonfinite returns how many values it replaced.
+      virtual int64_t count_nonfinite( int64_t data, Datatype::Enum type, int64_t offset,
+				       int64_t n_elems ) = 0;
+      virtual int64_t find_first_nonfinite( int64_t data, Datatype::Enum type, int64_t offset,
+					    int64_t n_elems ) = 0;
+      virtual int64_t replace_nonfinite( int64_t data, Datatype::Enum type, int64_t offset,
+					 int64_t n_elems, double value ) = 0;
+      //Copy as copy does, where converting float values to an integer
+      //datatype saturates and turns NaN into zero.  Replace turns NaN into
+      //nan_value instead and Throw raises an error on it, possibly after
+      //writing part of dst.
+      virtual void copy_with_nan_policy( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+					 int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+					 int64_t n_elems, NanPolicy::Enum policy, double nan_value ) = 0;
+
+      //Masked selection by a bit buffer, mask bit i (counting from the bit
+      //offset mask_offset) selecting element i, with values converted as copy
+      //converts them.  copy_masked writes the selected elements of src to
+      //the same positions of dst.  compress packs the selected elements to
+      //the front of dst and returns how many there were; expand is its
+      //inverse, writing consecutive src values to the selected positions of
+      //dst and returning how many it read.  where writes lhs where the bit
+      //is set and rhs elsewhere.  Unselected elements of dst are untouched;
+      //copy_masked neither reads nor writes them.  compress can pack in
+      //place, dst starting at or before src with elements no wider, and
+      //throws on other overlaps.
+      virtual void copy_masked( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				int64_t mask_data, int64_t mask_offset,
+				int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+				int64_t n_elems ) = 0;
+      virtual int64_t compress( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				int64_t mask_data, int64_t mask_offset,
+				int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+				int64_t n_elems ) = 0;
+      virtual int64_t expand( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			      int64_t mask_data, int64_t mask_offset,
+			      int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			      int64_t n_elems ) = 0;
+      virtual void where( int64_t mask_data, int64_t mask_offset,
+			  int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+			  int64_t rhs_data, Datatype::Enum rhs_type, int64_t rhs_offset,
+			  int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			  int64_t n_elems ) = 0;
+
       virtual unsigned char get_value_int8( int64_t src_data, Datatype::Enum src_type, int64_t offset ) = 0;
       virtual int16_t get_value_int16( int64_t src_data, Datatype::Enum src_type, int64_t offset ) = 0;
       virtual int32_t get_value_int32( int64_t src_data, Datatype::Enum src_type, int64_t offset ) = 0;
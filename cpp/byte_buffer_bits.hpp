@@ -0,0 +1,203 @@
+#ifndef BYTE_BUFFER_BITS_HPP
+#define BYTE_BUFFER_BITS_HPP
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Bit buffers hold bit i in bit (i % 8) of byte (i / 8) and are addressed
+    //by bit offsets.  Kernels work on up to 64 bits at a time; words are read
+    //and written through memcpy so this assumes a little endian host, as the
+    //rest of the library does.
+    static const int64_t bit_word = 64;
+    //Bit ranges below this many bits run on the calling thread.
+    static const int64_t parallel_bit_chunk = 1 << 18;
+
+    inline uint64_t low_bits_mask( int64_t n_bits )
+    {
+      return n_bits >= bit_word ? ~0ULL : (1ULL << n_bits) - 1;
+    }
+
+    //Bits [bit_offset, bit_offset + n_bits) as the low bits of a word;
+    //n_bits is at most 64 and no byte past the range is touched.
+    inline uint64_t load_bits( const uint8_t* bits, int64_t bit_offset, int64_t n_bits )
+    {
+      if (n_bits <= 0)
+	return 0;
+      const uint8_t* src = bits + (bit_offset >> 3);
+      int64_t shift = bit_offset & 7;
+      int64_t n_bytes = (shift + n_bits + 7) >> 3;
+      uint64_t word = 0;
+      memcpy(&word, src, std::min(n_bytes, (int64_t) 8));
+      uint64_t retval = word >> shift;
+      if (n_bytes > 8)
+	retval |= (uint64_t) src[8] << (bit_word - shift);
+      return retval & low_bits_mask(n_bits);
+    }
+
+    //Replace bits [bit_offset, bit_offset + n_bits) with the low bits of
+    //value, leaving the neighbouring bits of the first and last byte alone.
+    inline void store_bits( uint8_t* bits, int64_t bit_offset, int64_t n_bits, uint64_t value )
+    {
+      if (n_bits <= 0)
+	return;
+      uint8_t* dst = bits + (bit_offset >> 3);
+      int64_t shift = bit_offset & 7;
+      int64_t n_bytes = (shift + n_bits + 7) >> 3;
+      int64_t n_low_bytes = std::min(n_bytes, (int64_t) 8);
+      uint64_t mask = low_bits_mask(n_bits);
+      value &= mask;
+      uint64_t word = 0;
+      memcpy(&word, dst, n_low_bytes);
+      word = (word & ~(mask << shift)) | (value << shift);
+      memcpy(dst, &word, n_low_bytes);
+      if (n_bytes > 8) {
+	uint8_t high_mask = (uint8_t) (mask >> (bit_word - shift));
+	dst[8] = (uint8_t) ((dst[8] & ~high_mask) | (value >> (bit_word - shift)));
+      }
+    }
+
+    //Bits before the first 64 bit boundary of aligned_offset, after which
+    //whole words of the range start.
+    inline int64_t head_bits( int64_t aligned_offset, int64_t n_bits )
+    {
+      return std::min(n_bits, (bit_word - (aligned_offset & (bit_word - 1))) & (bit_word - 1));
+    }
+
+    //Run fn(pos, n_bits) over pieces of at most 64 bits.  Pieces after the
+    //first start on a 64 bit boundary of aligned_offset, so when the pieces
+    //are written at aligned_offset + pos no two threads share a byte.
+    template<typename TFn>
+    inline void for_each_bit_word( thread_pool& pool, int64_t aligned_offset, int64_t n_bits,
+				   TFn fn )
+    {
+      int64_t head = head_bits(aligned_offset, n_bits);
+      if (head > 0)
+	fn((int64_t) 0, head);
+      int64_t n_words = (n_bits - head + bit_word - 1) / bit_word;
+      int64_t n_chunks = chunk_count(pool, n_bits, parallel_bit_chunk);
+      parallel_chunks(pool, n_words, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  for ( int64_t word = begin; word < end; ++word ) {
+	    int64_t pos = head + word * bit_word;
+	    fn(pos, std::min(bit_word, n_bits - pos));
+	  }
+	});
+    }
+
+    //Nonzero values (including NaN) become 1.
+    template<typename src_type>
+    inline void pack_bits( thread_pool& pool, const src_type* src, uint8_t* dst,
+			   int64_t dst_bit_offset, int64_t n_bits )
+    {
+      for_each_bit_word(pool, dst_bit_offset, n_bits,
+			[&](int64_t pos, int64_t count) {
+			  uint64_t word = 0;
+			  for ( int64_t idx = 0; idx < count; ++idx )
+			    word |= (uint64_t) (src[pos + idx] != 0) << idx;
+			  store_bits(dst, dst_bit_offset + pos, count, word);
+			});
+    }
+
+    template<typename dst_type>
+    inline void unpack_bits( thread_pool& pool, const uint8_t* src, int64_t src_bit_offset,
+			     dst_type* dst, int64_t n_bits )
+    {
+      for_each_bit_word(pool, src_bit_offset, n_bits,
+			[&](int64_t pos, int64_t count) {
+			  uint64_t word = load_bits(src, src_bit_offset + pos, count);
+			  for ( int64_t idx = 0; idx < count; ++idx )
+			    dst[pos + idx] = (dst_type) ((word >> idx) & 1);
+			});
+    }
+
+    //Bit to bit copies and the bitwise ops below are not safe for ranges that
+    //overlap at different offsets.
+    inline void copy_bits( thread_pool& pool, const uint8_t* src, int64_t src_bit_offset,
+			   uint8_t* dst, int64_t dst_bit_offset, int64_t n_bits )
+    {
+      if ((src_bit_offset & 7) == 0 && (dst_bit_offset & 7) == 0) {
+	int64_t n_bytes = n_bits >> 3;
+	memmove(dst + (dst_bit_offset >> 3), src + (src_bit_offset >> 3), n_bytes);
+	int64_t done = n_bytes << 3;
+	if (done < n_bits)
+	  store_bits(dst, dst_bit_offset + done, n_bits - done,
+		     load_bits(src, src_bit_offset + done, n_bits - done));
+	return;
+      }
+      for_each_bit_word(pool, dst_bit_offset, n_bits,
+			[&](int64_t pos, int64_t count) {
+			  store_bits(dst, dst_bit_offset + pos, count,
+				     load_bits(src, src_bit_offset + pos, count));
+			});
+    }
+
+    inline void fill_bits( thread_pool& pool, uint8_t* dst, int64_t dst_bit_offset,
+			   bool value, int64_t n_bits )
+    {
+      uint64_t word = value ? ~0ULL : 0;
+      for_each_bit_word(pool, dst_bit_offset, n_bits,
+			[&](int64_t pos, int64_t count) {
+			  store_bits(dst, dst_bit_offset + pos, count, word);
+			});
+    }
+
+    inline uint64_t apply_bit_op( BitOp::Enum op, uint64_t lhs, uint64_t rhs )
+    {
+      switch(op) {
+      case BitOp::And: return lhs & rhs;
+      case BitOp::Or: return lhs | rhs;
+      case BitOp::Xor: return lhs ^ rhs;
+      case BitOp::AndNot: return lhs & ~rhs;
+      case BitOp::Not: return ~lhs;
+      }
+      throw runtime_error("unknown bit op");
+    }
+
+    //Not reads only lhs; rhs may be null for it.
+    inline void bit_op_kernel( thread_pool& pool, BitOp::Enum op,
+			       const uint8_t* lhs, int64_t lhs_bit_offset,
+			       const uint8_t* rhs, int64_t rhs_bit_offset,
+			       uint8_t* dst, int64_t dst_bit_offset, int64_t n_bits )
+    {
+      if (op < BitOp::And || op > BitOp::Not)
+	throw runtime_error("unknown bit op");
+      for_each_bit_word(pool, dst_bit_offset, n_bits,
+			[&](int64_t pos, int64_t count) {
+			  uint64_t lhs_word = load_bits(lhs, lhs_bit_offset + pos, count);
+			  uint64_t rhs_word = op == BitOp::Not ? 0
+			    : load_bits(rhs, rhs_bit_offset + pos, count);
+			  store_bits(dst, dst_bit_offset + pos, count,
+				     apply_bit_op(op, lhs_word, rhs_word));
+			});
+    }
+
+    inline int64_t popcount_bits( thread_pool& pool, const uint8_t* src, int64_t src_bit_offset,
+				  int64_t n_bits )
+    {
+      int64_t head = head_bits(src_bit_offset, n_bits);
+      int64_t n_words = (n_bits - head + bit_word - 1) / bit_word;
+      int64_t n_chunks = chunk_count(pool, n_bits, parallel_bit_chunk);
+      vector<int64_t> partials(n_chunks);
+      parallel_chunks(pool, n_words, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  int64_t count = 0;
+	  for ( int64_t word = begin; word < end; ++word ) {
+	    int64_t pos = head + word * bit_word;
+	    count += __builtin_popcountll(load_bits(src, src_bit_offset + pos,
+						    std::min(bit_word, n_bits - pos)));
+	  }
+	  partials[chunk] = count;
+	});
+      int64_t retval = __builtin_popcountll(load_bits(src, src_bit_offset, head));
+      for ( int64_t partial : partials )
+	retval += partial;
+      return retval;
+    }
+  }
+}
+
+#endif
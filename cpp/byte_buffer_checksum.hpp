@@ -0,0 +1,322 @@
+#ifndef BYTE_BUFFER_CHECKSUM_HPP
+#define BYTE_BUFFER_CHECKSUM_HPP
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_cpu.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_elementwise.hpp"
+#include "byte_buffer_hash.hpp"
+#ifdef BYTE_BUFFER_X86_DISPATCH
+#include <nmmintrin.h>
+#endif
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //CRC32C (Castagnoli, as used by iSCSI, ext4 and most storage formats).
+    //CRCs of neighbouring pieces combine into the CRC of the whole, so large
+    //ranges are checksummed in parallel chunks; XXH64 has no such combine
+    //and runs on a single thread.
+    static const uint32_t crc32c_polynomial = 0x82F63B78;
+    //Bytes per chunk below which a checksum runs on the calling thread.
+    static const int64_t parallel_checksum_chunk = 1 << 20;
+    //Bytes copied per block before the block is checksummed, small enough
+    //that the block is still in L2 when it is read back.
+    static const int64_t checksum_copy_block = 1 << 16;
+
+    //Slicing by 8 tables: table k maps a byte to the CRC of that byte
+    //followed by k zero bytes.
+    inline const uint32_t* crc32c_tables()
+    {
+      static const vector<uint32_t> retval = []() {
+	vector<uint32_t> tables(8 * 256);
+	for ( uint32_t value = 0; value < 256; ++value ) {
+	  uint32_t crc = value;
+	  for ( int bit = 0; bit < 8; ++bit )
+	    crc = (crc & 1) ? (crc >> 1) ^ crc32c_polynomial : crc >> 1;
+	  tables[value] = crc;
+	}
+	for ( int table = 1; table < 8; ++table )
+	  for ( int value = 0; value < 256; ++value ) {
+	    uint32_t previous = tables[(table - 1) * 256 + value];
+	    tables[table * 256 + value] = (previous >> 8) ^ tables[previous & 0xff];
+	  }
+	return tables;
+      }();
+      return retval.data();
+    }
+
+    //The update functions work on the inverted CRC register.
+    inline uint32_t crc32c_update_table( uint32_t crc, const uint8_t* data, int64_t length )
+    {
+      const uint32_t* tables = crc32c_tables();
+      for ( ; length >= 8; length -= 8, data += 8 ) {
+	uint64_t word = read_u64(data) ^ crc;
+	crc = tables[7 * 256 + (word & 0xff)] ^ tables[6 * 256 + ((word >> 8) & 0xff)]
+	  ^ tables[5 * 256 + ((word >> 16) & 0xff)] ^ tables[4 * 256 + ((word >> 24) & 0xff)]
+	  ^ tables[3 * 256 + ((word >> 32) & 0xff)] ^ tables[2 * 256 + ((word >> 40) & 0xff)]
+	  ^ tables[256 + ((word >> 48) & 0xff)] ^ tables[word >> 56];
+      }
+      for ( ; length > 0; --length, ++data )
+	crc = (crc >> 8) ^ tables[(crc ^ *data) & 0xff];
+      return crc;
+    }
+
+    inline uint32_t gf2_matrix_times( const uint32_t* matrix, uint32_t vector )
+    {
+      uint32_t retval = 0;
+      for ( ; vector; vector >>= 1, ++matrix )
+	if (vector & 1)
+	  retval ^= *matrix;
+      return retval;
+    }
+
+    inline void gf2_matrix_square( uint32_t* square, const uint32_t* matrix )
+    {
+      for ( int row = 0; row < 32; ++row )
+	square[row] = gf2_matrix_times(matrix, matrix[row]);
+    }
+
+    //Operator for a single zero bit: the register shifts right and folds in
+    //the polynomial.
+    inline void crc32c_zero_bit( uint32_t* matrix )
+    {
+      matrix[0] = crc32c_polynomial;
+      uint32_t row = 1;
+      for ( int idx = 1; idx < 32; ++idx, row <<= 1 )
+	matrix[idx] = row;
+    }
+
+    //Bytes per stripe when the hardware CRC runs three stripes at once.
+    static const int64_t crc32c_stripe = 4096;
+
+    //Operator advancing the register over crc32c_stripe zero bytes.
+    inline const uint32_t* crc32c_stripe_shift()
+    {
+      static const vector<uint32_t> retval = []() {
+	vector<uint32_t> matrix(32), square(32);
+	crc32c_zero_bit(matrix.data());
+	for ( int64_t bits = 1; bits < crc32c_stripe * 8; bits *= 2 ) {
+	  gf2_matrix_square(square.data(), matrix.data());
+	  matrix.swap(square);
+	}
+	return matrix;
+      }();
+      return retval.data();
+    }
+
+#ifdef BYTE_BUFFER_X86_DISPATCH
+    __attribute__((target("sse4.2")))
+    inline uint32_t crc32c_update_sse42( uint32_t crc, const uint8_t* data, int64_t length )
+    {
+#ifdef __x86_64__
+      //The crc32 instruction has a latency of three cycles but a throughput
+      //of one, so three stripes run interleaved.  The register is linear in
+      //its input, so the stripes started from zero join the first through
+      //the zero byte operator.
+      const uint32_t* shift = crc32c_stripe_shift();
+      for ( ; length >= 3 * crc32c_stripe; length -= 3 * crc32c_stripe ) {
+	uint64_t first = crc;
+	uint64_t second = 0;
+	uint64_t third = 0;
+	for ( int64_t pos = 0; pos < crc32c_stripe; pos += 8, data += 8 ) {
+	  first = _mm_crc32_u64(first, read_u64(data));
+	  second = _mm_crc32_u64(second, read_u64(data + crc32c_stripe));
+	  third = _mm_crc32_u64(third, read_u64(data + 2 * crc32c_stripe));
+	}
+	data += 2 * crc32c_stripe;
+	crc = gf2_matrix_times(shift, (uint32_t) first) ^ (uint32_t) second;
+	crc = gf2_matrix_times(shift, crc) ^ (uint32_t) third;
+      }
+      uint64_t wide = crc;
+      for ( ; length >= 8; length -= 8, data += 8 )
+	wide = _mm_crc32_u64(wide, read_u64(data));
+      crc = (uint32_t) wide;
+#endif
+      for ( ; length >= 4; length -= 4, data += 4 )
+	crc = _mm_crc32_u32(crc, read_u32(data));
+      for ( ; length > 0; --length, ++data )
+	crc = _mm_crc32_u8(crc, *data);
+      return crc;
+    }
+#endif
+
+    inline uint32_t crc32c_update( uint32_t crc, const uint8_t* data, int64_t length )
+    {
+#ifdef BYTE_BUFFER_X86_DISPATCH
+      if (host_cpu().sse42)
+	return crc32c_update_sse42(crc, data, length);
+#endif
+      return crc32c_update_table(crc, data, length);
+    }
+
+    //CRC of the bytes following a piece whose CRC was crc.
+    inline uint32_t crc32c( uint32_t crc, const uint8_t* data, int64_t length )
+    {
+      return ~crc32c_update(~crc, data, length);
+    }
+
+    //CRC of A followed by B from the CRCs of each and B's length, by
+    //applying the operator that feeds length zero bytes through the register
+    //(as zlib's crc32_combine does).
+    inline uint32_t crc32c_combine( uint32_t crc_a, uint32_t crc_b, int64_t length_b )
+    {
+      if (length_b <= 0)
+	return crc_a;
+      uint32_t even[32];
+      uint32_t odd[32];
+      crc32c_zero_bit(odd);
+      //Operators for two and then four zero bits.
+      gf2_matrix_square(even, odd);
+      gf2_matrix_square(odd, even);
+      //Square up to one zero byte and beyond, applying the operator for
+      //every set bit of the length.
+      do {
+	gf2_matrix_square(even, odd);
+	if (length_b & 1)
+	  crc_a = gf2_matrix_times(even, crc_a);
+	length_b >>= 1;
+	if (length_b == 0)
+	  break;
+	gf2_matrix_square(odd, even);
+	if (length_b & 1)
+	  crc_a = gf2_matrix_times(odd, crc_a);
+	length_b >>= 1;
+      } while (length_b != 0);
+      return crc_a ^ crc_b;
+    }
+
+    //Incremental XXH64, equal to xxh64 over everything passed to update.
+    struct xxh64_stream
+    {
+      uint64_t seed;
+      uint64_t lanes[4];
+      unsigned char pending[32];
+      int64_t n_pending;
+      int64_t length;
+
+      explicit xxh64_stream( uint64_t _seed )
+	: seed(_seed), n_pending(0), length(0)
+      {
+	lanes[0] = seed + xxh_prime1 + xxh_prime2;
+	lanes[1] = seed + xxh_prime2;
+	lanes[2] = seed;
+	lanes[3] = seed - xxh_prime1;
+      }
+
+      void consume( const unsigned char* stripe )
+      {
+	for ( int lane = 0; lane < 4; ++lane )
+	  lanes[lane] = xxh64_round(lanes[lane], read_u64(stripe + lane * 8));
+      }
+
+      void update( const unsigned char* data, int64_t n_bytes )
+      {
+	length += n_bytes;
+	if (n_pending > 0) {
+	  int64_t count = std::min(n_bytes, 32 - n_pending);
+	  memcpy(pending + n_pending, data, count);
+	  n_pending += count;
+	  data += count;
+	  n_bytes -= count;
+	  if (n_pending < 32)
+	    return;
+	  consume(pending);
+	  n_pending = 0;
+	}
+	for ( ; n_bytes >= 32; n_bytes -= 32, data += 32 )
+	  consume(data);
+	memcpy(pending, data, n_bytes);
+	n_pending = n_bytes;
+      }
+
+      uint64_t digest() const
+      {
+	uint64_t retval = length >= 32
+	  ? xxh64_converge(lanes[0], lanes[1], lanes[2], lanes[3])
+	  : seed + xxh_prime5;
+	return xxh64_tail(retval + (uint64_t) length, pending, pending + n_pending);
+      }
+    };
+
+    inline void check_checksum_type( ChecksumType::Enum checksum )
+    {
+      if (checksum != ChecksumType::Crc32c && checksum != ChecksumType::XxHash64)
+	throw runtime_error("unknown checksum type");
+    }
+
+    //Checksum n_bytes produced by fill(pos, count), which writes (or
+    //locates) count bytes starting at byte pos and returns where they are.
+    //CRCs run fill over parallel chunks, XXH64 over the range in order.
+    template<typename TFillFn>
+    inline uint64_t checksum_bytes( thread_pool& pool, int64_t n_bytes, int64_t unit,
+				    ChecksumType::Enum checksum, uint64_t seed, TFillFn fill )
+    {
+      check_checksum_type(checksum);
+      //Blocks and chunks split on whole units (elements) so fill never sees
+      //a partial one.
+      int64_t n_units = n_bytes / unit;
+      int64_t block_units = std::max((int64_t) 1, checksum_copy_block / unit);
+      if (checksum == ChecksumType::XxHash64) {
+	xxh64_stream stream(seed);
+	for ( int64_t pos = 0; pos < n_units; pos += block_units ) {
+	  int64_t count = std::min(block_units, n_units - pos) * unit;
+	  stream.update(fill(pos * unit, count), count);
+	}
+	return stream.digest();
+      }
+      int64_t n_chunks = chunk_count(pool, n_bytes, parallel_checksum_chunk);
+      vector<uint32_t> crcs(n_chunks);
+      parallel_chunks(pool, n_units, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  uint32_t crc = ~0U;
+	  for ( int64_t pos = begin; pos < end; pos += block_units ) {
+	    int64_t count = std::min(block_units, end - pos) * unit;
+	    crc = crc32c_update(crc, fill(pos * unit, count), count);
+	  }
+	  crcs[chunk] = ~crc;
+	});
+      uint32_t retval = (uint32_t) seed;
+      for ( int64_t chunk = 0; chunk < n_chunks; ++chunk ) {
+	int64_t begin = n_units * chunk / n_chunks;
+	int64_t end = n_units * (chunk + 1) / n_chunks;
+	retval = crc32c_combine(retval, crcs[chunk], (end - begin) * unit);
+      }
+      return retval;
+    }
+
+    inline uint64_t range_checksum( thread_pool& pool, buffer_range src, int64_t n_elems,
+				    ChecksumType::Enum checksum, uint64_t seed )
+    {
+      int64_t elem_size = datatype_size(src.type);
+      const uint8_t* bytes = reinterpret_cast<const uint8_t*>(src.data) + src.offset * elem_size;
+      return checksum_bytes(pool, n_elems * elem_size, elem_size, checksum, seed,
+			    [&](int64_t pos, int64_t) { return bytes + pos; });
+    }
+
+    //Copy src to dst with the copy conversions and checksum the bytes written
+    //to dst block by block, while each block is still in cache.
+    inline uint64_t copy_range_with_checksum( thread_pool& pool, buffer_range src, buffer_range dst,
+					      int64_t n_elems, ChecksumType::Enum checksum,
+					      uint64_t seed )
+    {
+      int64_t elem_size = datatype_size(dst.type);
+      uint8_t* bytes = reinterpret_cast<uint8_t*>(dst.data) + dst.offset * elem_size;
+      return checksum_bytes(pool, n_elems * elem_size, elem_size, checksum, seed,
+			    [&](int64_t pos, int64_t count) {
+			      int64_t elem = pos / elem_size;
+			      typed_buffer_op<void>(src.data, src.type, [&](auto src_ptr) {
+				  typed_buffer_op<void>(dst.data, dst.type, [&](auto dst_ptr) {
+				      do_copy(src_ptr, src.offset + elem, dst_ptr, dst.offset + elem,
+					      count / elem_size);
+				    });
+				});
+			      return (const uint8_t*) bytes + pos;
+			    });
+    }
+  }
+}
+
+#endif
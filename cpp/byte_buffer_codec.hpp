@@ -0,0 +1,412 @@
+#ifndef BYTE_BUFFER_CODEC_HPP
+#define BYTE_BUFFER_CODEC_HPP
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_cpu.hpp"
+#include "byte_buffer_bits.hpp"
+#include "byte_buffer_elementwise.hpp"
+#ifdef BYTE_BUFFER_X86_DISPATCH
+#include <tmmintrin.h>
+#endif
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Encoded integer streams start with this header; the rest depends on the
+    //codec:
+    //DeltaVarint - differences from the previous value, zigzag encoded so
+    //  small negative steps stay small, stored as in streamvbyte: a control
+    //  stream with a 2 bit length code (1, 2, 4 or 8 bytes) per value followed
+    //  by the little endian value bytes.
+    //FrameOfReference, DeltaFrameOfReference - blocks of for_block values
+    //  (or zigzag deltas), each a bit width byte, the block minimum as 8 bytes
+    //  and every value less the minimum packed at that width.
+    struct integer_stream_header
+    {
+      uint32_t magic;
+      uint32_t codec;
+      int64_t n_elems;
+    };
+    static const uint32_t integer_stream_magic = 0x56444242;
+    static const int64_t for_block = 128;
+    static const int64_t for_block_header = 9;
+
+    inline uint64_t zigzag_encode( int64_t value )
+    {
+      return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+    }
+
+    inline int64_t zigzag_decode( uint64_t value )
+    {
+      return (int64_t) ((value >> 1) ^ (0 - (value & 1)));
+    }
+
+    inline int varint_code( uint64_t value )
+    {
+      if (value < (1ULL << 8)) return 0;
+      if (value < (1ULL << 16)) return 1;
+      if (value < (1ULL << 32)) return 2;
+      return 3;
+    }
+
+    inline int64_t varint_length( int code ) { return 1LL << code; }
+
+    inline int64_t bit_width( uint64_t value )
+    {
+      return value == 0 ? 0 : 64 - __builtin_clzll(value);
+    }
+
+    inline void check_integer_datatype( Datatype::Enum type )
+    {
+      if (type != Datatype::Byte && type != Datatype::Short
+	  && type != Datatype::Int && type != Datatype::Long)
+	throw runtime_error("integer codecs need an integer datatype");
+    }
+
+    inline int64_t max_encoded_integers_size( IntegerCodec::Enum codec, int64_t n_elems )
+    {
+      int64_t header = (int64_t) sizeof(integer_stream_header);
+      switch(codec) {
+      case IntegerCodec::DeltaVarint:
+	return header + (n_elems + 3) / 4 + 8 * n_elems;
+      case IntegerCodec::FrameOfReference:
+      case IntegerCodec::DeltaFrameOfReference:
+	return header + (n_elems + for_block - 1) / for_block * for_block_header + 8 * n_elems;
+      }
+      throw runtime_error("unknown integer codec");
+    }
+
+    //Appends to a fixed size output, failing rather than overrunning it.
+    struct byte_writer
+    {
+      uint8_t* data;
+      int64_t capacity;
+      int64_t pos;
+
+      uint8_t* reserve( int64_t n_bytes )
+      {
+	if (pos + n_bytes > capacity)
+	  throw runtime_error("encode destination too small");
+	uint8_t* retval = data + pos;
+	pos += n_bytes;
+	return retval;
+      }
+    };
+
+    //Visit the values of an integer range as int64 blocks.
+    template<typename TFn>
+    inline void for_each_int64_block( buffer_range src, int64_t n_elems, TFn fn )
+    {
+      int64_t block[elementwise_block];
+      for ( int64_t pos = 0; pos < n_elems; pos += elementwise_block ) {
+	int64_t count = std::min(elementwise_block, n_elems - pos);
+	load_block(src.data, src.type, src.offset + pos, block, count);
+	fn(block, count);
+      }
+    }
+
+    inline void encode_delta_varint( buffer_range src, int64_t n_elems, byte_writer& out )
+    {
+      uint8_t* control = out.reserve((n_elems + 3) / 4);
+      memset(control, 0, (n_elems + 3) / 4);
+      int64_t index = 0;
+      int64_t previous = 0;
+      for_each_int64_block(src, n_elems, [&](const int64_t* block, int64_t count) {
+	  for ( int64_t idx = 0; idx < count; ++idx, ++index ) {
+	    uint64_t value = zigzag_encode((int64_t) ((uint64_t) block[idx] - (uint64_t) previous));
+	    previous = block[idx];
+	    int code = varint_code(value);
+	    control[index >> 2] |= (uint8_t) (code << (2 * (index & 3)));
+	    memcpy(out.reserve(varint_length(code)), &value, varint_length(code));
+	  }
+	});
+    }
+
+    inline const uint8_t* varint_group_lengths()
+    {
+      //Bytes taken by the four values of each control byte.
+      static const struct group_lengths {
+	uint8_t lengths[256];
+	group_lengths() {
+	  for ( int control = 0; control < 256; ++control ) {
+	    lengths[control] = 0;
+	    for ( int value = 0; value < 4; ++value )
+	      lengths[control] += (uint8_t) varint_length((control >> (2 * value)) & 3);
+	  }
+	}
+      } retval;
+      return retval.lengths;
+    }
+
+    inline const uint8_t* varint_read_one( const uint8_t* data, int code, uint64_t& value )
+    {
+      value = 0;
+      memcpy(&value, data, varint_length(code));
+      return data + varint_length(code);
+    }
+
+    //Decode the raw (still zigzagged) values of n_elems lengths codes.
+    //Returns the data position after them.
+    inline const uint8_t* varint_decode_scalar( const uint8_t* control, int64_t control_index,
+						const uint8_t* data, uint64_t* dst, int64_t n_elems )
+    {
+      for ( int64_t idx = 0; idx < n_elems; ++idx, ++control_index ) {
+	int code = (control[control_index >> 2] >> (2 * (control_index & 3))) & 3;
+	data = varint_read_one(data, code, dst[idx]);
+      }
+      return data;
+    }
+
+#ifdef BYTE_BUFFER_X86_DISPATCH
+    //Shuffles moving two values, with the length codes of a nibble of the
+    //control byte, from packed bytes into two 64 bit lanes.
+    struct varint_pair_shuffles
+    {
+      uint8_t masks[16][16];
+      uint8_t lengths[16];
+      varint_pair_shuffles()
+      {
+	for ( int codes = 0; codes < 16; ++codes ) {
+	  int64_t first = varint_length(codes & 3);
+	  int64_t second = varint_length(codes >> 2);
+	  lengths[codes] = (uint8_t) (first + second);
+	  for ( int byte = 0; byte < 8; ++byte ) {
+	    masks[codes][byte] = byte < first ? (uint8_t) byte : 0x80;
+	    masks[codes][8 + byte] = byte < second ? (uint8_t) (first + byte) : 0x80;
+	  }
+	}
+      }
+    };
+
+    inline const varint_pair_shuffles& pair_shuffles()
+    {
+      static const varint_pair_shuffles retval;
+      return retval;
+    }
+
+    //Four values per control byte with one 16 byte load and shuffle per pair
+    //of values.  Stops while at least 32 bytes of data remain readable and
+    //leaves the rest to the scalar decoder.
+    __attribute__((target("ssse3")))
+    inline int64_t varint_decode_ssse3( const uint8_t* control, const uint8_t*& data,
+					const uint8_t* data_end, uint64_t* dst, int64_t n_groups )
+    {
+      const varint_pair_shuffles& shuffles = pair_shuffles();
+      int64_t group = 0;
+      for ( ; group < n_groups && data_end - data >= 32; ++group ) {
+	uint8_t codes = control[group];
+	int low = codes & 15;
+	int high = codes >> 4;
+	__m128i first = _mm_loadu_si128((const __m128i*) data);
+	__m128i second = _mm_loadu_si128((const __m128i*) (data + shuffles.lengths[low]));
+	first = _mm_shuffle_epi8(first, _mm_loadu_si128((const __m128i*) shuffles.masks[low]));
+	second = _mm_shuffle_epi8(second, _mm_loadu_si128((const __m128i*) shuffles.masks[high]));
+	_mm_storeu_si128((__m128i*) (dst + 4 * group), first);
+	_mm_storeu_si128((__m128i*) (dst + 4 * group + 2), second);
+	data += shuffles.lengths[low] + shuffles.lengths[high];
+      }
+      return group;
+    }
+#endif
+
+    inline void decode_delta_varint( const uint8_t* data, const uint8_t* data_end, int64_t n_elems,
+				     buffer_range dst )
+    {
+      int64_t control_size = (n_elems + 3) / 4;
+      if (control_size > data_end - data)
+	throw runtime_error("truncated integer stream");
+      const uint8_t* control = data;
+      data += control_size;
+      //Every value is at least one byte, at most eight.
+      const uint8_t* group_lengths = varint_group_lengths();
+      int64_t data_size = 0;
+      for ( int64_t idx = 0; idx < n_elems / 4; ++idx )
+	data_size += group_lengths[control[idx]];
+      for ( int64_t idx = n_elems - n_elems % 4; idx < n_elems; ++idx )
+	data_size += varint_length((control[idx >> 2] >> (2 * (idx & 3))) & 3);
+      if (data_size > data_end - data)
+	throw runtime_error("truncated integer stream");
+      uint64_t raw[elementwise_block];
+      int64_t values[elementwise_block];
+      int64_t previous = 0;
+      for ( int64_t pos = 0; pos < n_elems; pos += elementwise_block ) {
+	int64_t count = std::min(elementwise_block, n_elems - pos);
+	int64_t decoded = 0;
+#ifdef BYTE_BUFFER_X86_DISPATCH
+	if (host_cpu().ssse3)
+	  decoded = 4 * varint_decode_ssse3(control + pos / 4, data, data_end, raw, count / 4);
+#endif
+	data = varint_decode_scalar(control, pos + decoded, data, raw + decoded, count - decoded);
+	for ( int64_t idx = 0; idx < count; ++idx ) {
+	  previous = (int64_t) ((uint64_t) previous + (uint64_t) zigzag_decode(raw[idx]));
+	  values[idx] = previous;
+	}
+	store_block(values, dst.data, dst.type, dst.offset + pos, count);
+      }
+    }
+
+    inline void encode_frame_of_reference( buffer_range src, int64_t n_elems, bool delta,
+					   byte_writer& out )
+    {
+      uint64_t values[for_block];
+      int64_t fill = 0;
+      int64_t previous = 0;
+      auto flush = [&]() {
+	uint64_t reference = values[0];
+	for ( int64_t idx = 1; idx < fill; ++idx )
+	  reference = std::min(reference, values[idx]);
+	uint64_t range = 0;
+	for ( int64_t idx = 0; idx < fill; ++idx )
+	  range |= values[idx] - reference;
+	int64_t width = bit_width(range);
+	uint8_t* header = out.reserve(for_block_header);
+	header[0] = (uint8_t) width;
+	memcpy(header + 1, &reference, 8);
+	int64_t n_bytes = (fill * width + 7) / 8;
+	uint8_t* packed = out.reserve(n_bytes);
+	//Values collect in a word that is written out each time it fills.
+	uint64_t word = 0;
+	int64_t used = 0;
+	for ( int64_t idx = 0; idx < fill; ++idx ) {
+	  uint64_t value = values[idx] - reference;
+	  word |= value << used;
+	  if (used + width >= 64) {
+	    memcpy(packed, &word, 8);
+	    packed += 8;
+	    int64_t carried = used + width - 64;
+	    word = carried > 0 ? value >> (width - carried) : 0;
+	    used = carried;
+	  }
+	  else {
+	    used += width;
+	  }
+	}
+	memcpy(packed, &word, (used + 7) / 8);
+	fill = 0;
+      };
+      //Values are compared as unsigned; plain values are offset so signed
+      //order is kept.
+      for_each_int64_block(src, n_elems, [&](const int64_t* block, int64_t count) {
+	  for ( int64_t idx = 0; idx < count; ++idx ) {
+	    if (delta) {
+	      values[fill++] = zigzag_encode((int64_t) ((uint64_t) block[idx] - (uint64_t) previous));
+	      previous = block[idx];
+	    }
+	    else {
+	      values[fill++] = (uint64_t) block[idx] ^ (1ULL << 63);
+	    }
+	    if (fill == for_block)
+	      flush();
+	  }
+	});
+      if (fill > 0)
+	flush();
+    }
+
+    inline void decode_frame_of_reference( const uint8_t* data, const uint8_t* data_end,
+					   int64_t n_elems, bool delta, buffer_range dst )
+    {
+      int64_t values[for_block];
+      int64_t previous = 0;
+      for ( int64_t pos = 0; pos < n_elems; pos += for_block ) {
+	int64_t count = std::min(for_block, n_elems - pos);
+	if (for_block_header > data_end - data)
+	  throw runtime_error("truncated integer stream");
+	int64_t width = data[0];
+	uint64_t reference;
+	memcpy(&reference, data + 1, 8);
+	data += for_block_header;
+	int64_t n_bytes = (count * width + 7) / 8;
+	if (width > 64 || n_bytes > data_end - data)
+	  throw runtime_error("corrupt integer stream");
+	uint64_t mask = low_bits_mask(width);
+	for ( int64_t idx = 0; idx < count; ++idx ) {
+	  //A single unaligned word covers values of up to 57 bits, as long as
+	  //the word stays inside the block.
+	  int64_t bit = idx * width;
+	  uint64_t packed;
+	  if (width <= 57 && (bit >> 3) + 8 <= n_bytes) {
+	    memcpy(&packed, data + (bit >> 3), 8);
+	    packed = (packed >> (bit & 7)) & mask;
+	  }
+	  else {
+	    packed = load_bits(data, bit, width);
+	  }
+	  uint64_t value = reference + packed;
+	  if (delta) {
+	    previous = (int64_t) ((uint64_t) previous + (uint64_t) zigzag_decode(value));
+	    values[idx] = previous;
+	  }
+	  else {
+	    values[idx] = (int64_t) (value ^ (1ULL << 63));
+	  }
+	}
+	data += n_bytes;
+	store_block(values, dst.data, dst.type, dst.offset + pos, count);
+      }
+    }
+
+    inline int64_t encode_integer_range( buffer_range src, int64_t n_elems, IntegerCodec::Enum codec,
+					 uint8_t* dst, int64_t dst_capacity )
+    {
+      check_integer_datatype(src.type);
+      byte_writer out = { dst, dst_capacity, 0 };
+      integer_stream_header header = { integer_stream_magic, (uint32_t) codec, n_elems };
+      memcpy(out.reserve(sizeof(header)), &header, sizeof(header));
+      switch(codec) {
+      case IntegerCodec::DeltaVarint:
+	encode_delta_varint(src, n_elems, out);
+	break;
+      case IntegerCodec::FrameOfReference:
+	encode_frame_of_reference(src, n_elems, false, out);
+	break;
+      case IntegerCodec::DeltaFrameOfReference:
+	encode_frame_of_reference(src, n_elems, true, out);
+	break;
+      default:
+	throw runtime_error("unknown integer codec");
+      }
+      return out.pos;
+    }
+
+    inline integer_stream_header read_integer_header( const uint8_t* src, int64_t src_size )
+    {
+      integer_stream_header header;
+      if (src_size < (int64_t) sizeof(header))
+	throw runtime_error("truncated integer stream");
+      memcpy(&header, src, sizeof(header));
+      if (header.magic != integer_stream_magic || header.n_elems < 0)
+	throw runtime_error("not an integer stream");
+      return header;
+    }
+
+    inline int64_t decode_integer_range( const uint8_t* src, int64_t src_size, buffer_range dst,
+					 int64_t dst_capacity )
+    {
+      check_integer_datatype(dst.type);
+      integer_stream_header header = read_integer_header(src, src_size);
+      if (header.n_elems > dst_capacity)
+	throw runtime_error("decode destination too small");
+      const uint8_t* data = src + sizeof(header);
+      const uint8_t* data_end = src + src_size;
+      switch(header.codec) {
+      case IntegerCodec::DeltaVarint:
+	decode_delta_varint(data, data_end, header.n_elems, dst);
+	break;
+      case IntegerCodec::FrameOfReference:
+	decode_frame_of_reference(data, data_end, header.n_elems, false, dst);
+	break;
+      case IntegerCodec::DeltaFrameOfReference:
+	decode_frame_of_reference(data, data_end, header.n_elems, true, dst);
+	break;
+      default:
+	throw runtime_error("unknown integer codec");
+      }
+      return header.n_elems;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,358 @@
+#ifndef BYTE_BUFFER_COMPRESS_HPP
+#define BYTE_BUFFER_COMPRESS_HPP
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_elementwise.hpp"
+#include "byte_buffer_interleave.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Compressed buffers are split into independent blocks so they compress
+    //and decompress in parallel.  Each block is optionally byte shuffled
+    //(byte k of every element stored together, which turns the slowly
+    //changing high bytes of numeric data into long runs) and then run
+    //through an LZ77 codec using the LZ4 block format.  Blocks that do not
+    //shrink are stored as they are.
+    //
+    //Layout: compressed_header, a uint32 size per block (high bit set for
+    //stored blocks), then the blocks back to back.
+    struct compressed_header
+    {
+      uint32_t magic;
+      int32_t datatype;
+      int64_t n_elems;
+      int64_t block_elems;
+      uint32_t flags;
+      uint32_t reserved;
+    };
+    static const uint32_t compressed_magic = 0x5a424242;
+    static const uint32_t compressed_shuffled = 1;
+    static const uint32_t stored_block = 0x80000000u;
+    static const int64_t default_compress_block = 256 * 1024;
+
+    //LZ4 format constants: matches are at least 4 bytes, offsets fit in 16
+    //bits, the last 5 bytes are always literals and no match starts in the
+    //last 12.
+    static const int64_t lz_min_match = 4;
+    static const int64_t lz_max_offset = 65535;
+    static const int64_t lz_last_literals = 5;
+    static const int64_t lz_match_limit = 12;
+    static const int lz_hash_bits = 14;
+
+    inline uint32_t lz_read32( const uint8_t* data )
+    {
+      uint32_t retval;
+      memcpy(&retval, data, 4);
+      return retval;
+    }
+
+    inline uint32_t lz_hash( uint32_t sequence )
+    {
+      return (sequence * 2654435761u) >> (32 - lz_hash_bits);
+    }
+
+    inline uint8_t* lz_write_length( uint8_t* out, int64_t length )
+    {
+      for ( ; length >= 255; length -= 255 )
+	*out++ = 255;
+      *out++ = (uint8_t) length;
+      return out;
+    }
+
+    //Write one sequence: literals followed by a match, or just literals when
+    //match_length is 0.  Returns null if it would not fit.
+    inline uint8_t* lz_write_sequence( uint8_t* out, uint8_t* out_end,
+				       const uint8_t* literals, int64_t n_literals,
+				       int64_t offset, int64_t match_length )
+    {
+      if (n_literals + n_literals / 255 + match_length / 255 + 8 > out_end - out)
+	return nullptr;
+      int64_t match_code = match_length > 0 ? match_length - lz_min_match : 0;
+      *out++ = (uint8_t) ((std::min(n_literals, (int64_t) 15) << 4)
+			  | std::min(match_code, (int64_t) 15));
+      if (n_literals >= 15)
+	out = lz_write_length(out, n_literals - 15);
+      memcpy(out, literals, n_literals);
+      out += n_literals;
+      if (match_length > 0) {
+	*out++ = (uint8_t) (offset & 0xFF);
+	*out++ = (uint8_t) (offset >> 8);
+	if (match_code >= 15)
+	  out = lz_write_length(out, match_code - 15);
+      }
+      return out;
+    }
+
+    //Greedy single probe hash matcher, skipping ahead faster the longer it
+    //goes without a match.  Returns the compressed size, or 0 when the result
+    //would not be smaller than dst_capacity.
+    inline int64_t lz_compress( const uint8_t* src, int64_t n_bytes, uint8_t* dst, int64_t dst_capacity )
+    {
+      vector<uint32_t> table(1 << lz_hash_bits, 0);
+      uint8_t* out = dst;
+      uint8_t* out_end = dst + dst_capacity;
+      int64_t anchor = 0;
+      int64_t pos = 0;
+      int64_t match_end_limit = n_bytes - lz_last_literals;
+      while (pos + lz_match_limit < n_bytes) {
+	uint32_t sequence = lz_read32(src + pos);
+	uint32_t hash = lz_hash(sequence);
+	int64_t candidate = table[hash];
+	table[hash] = (uint32_t) pos;
+	if (candidate < pos && pos - candidate <= lz_max_offset
+	    && lz_read32(src + candidate) == sequence) {
+	  int64_t length = lz_min_match;
+	  while (pos + length < match_end_limit && src[pos + length] == src[candidate + length])
+	    ++length;
+	  out = lz_write_sequence(out, out_end, src + anchor, pos - anchor, pos - candidate, length);
+	  if (out == nullptr)
+	    return 0;
+	  pos += length;
+	  anchor = pos;
+	}
+	else {
+	  pos += 1 + ((pos - anchor) >> 6);
+	}
+      }
+      out = lz_write_sequence(out, out_end, src + anchor, n_bytes - anchor, 0, 0);
+      if (out == nullptr || out - dst >= dst_capacity)
+	return 0;
+      return out - dst;
+    }
+
+    inline int64_t lz_read_length( const uint8_t*& in, const uint8_t* in_end )
+    {
+      int64_t retval = 0;
+      uint8_t value;
+      do {
+	if (in >= in_end)
+	  throw runtime_error("corrupt compressed block");
+	value = *in++;
+	retval += value;
+      } while (value == 255);
+      return retval;
+    }
+
+    //Decode exactly dst_size bytes, checking every length and offset against
+    //both buffers.
+    inline void lz_decompress( const uint8_t* src, int64_t src_size, uint8_t* dst, int64_t dst_size )
+    {
+      const uint8_t* in = src;
+      const uint8_t* in_end = src + src_size;
+      uint8_t* out = dst;
+      uint8_t* out_end = dst + dst_size;
+      while (in < in_end) {
+	uint8_t token = *in++;
+	int64_t n_literals = token >> 4;
+	if (n_literals == 15)
+	  n_literals += lz_read_length(in, in_end);
+	if (n_literals > in_end - in || n_literals > out_end - out)
+	  throw runtime_error("corrupt compressed block");
+	memcpy(out, in, n_literals);
+	in += n_literals;
+	out += n_literals;
+	if (in == in_end)
+	  break;
+	if (in_end - in < 2)
+	  throw runtime_error("corrupt compressed block");
+	int64_t offset = in[0] | (in[1] << 8);
+	in += 2;
+	int64_t length = token & 15;
+	if (length == 15)
+	  length += lz_read_length(in, in_end);
+	length += lz_min_match;
+	if (offset == 0 || offset > out - dst || length > out_end - out)
+	  throw runtime_error("corrupt compressed block");
+	//Overlapping matches repeat the last offset bytes; copying everything
+	//written since the match start doubles the copy size each time.
+	const uint8_t* match = out - offset;
+	while (length > 0) {
+	  int64_t chunk = std::min((int64_t) (out - match), length);
+	  memcpy(out, match, chunk);
+	  out += chunk;
+	  length -= chunk;
+	}
+      }
+      if (out != out_end)
+	throw runtime_error("corrupt compressed block");
+    }
+
+    inline int64_t compressed_block_count( int64_t n_elems, int64_t block_elems )
+    {
+      return (n_elems + block_elems - 1) / block_elems;
+    }
+
+    //Blocks hold whole elements and their sizes fit the size table.
+    inline int64_t compress_block_elems( int64_t block_bytes, int64_t elem_size )
+    {
+      if (block_bytes <= 0)
+	block_bytes = default_compress_block;
+      return std::max((int64_t) 1, std::min(block_bytes, (int64_t) 1 << 30) / elem_size);
+    }
+
+    inline int64_t max_compressed_bytes( int64_t n_elems, int64_t elem_size, int64_t block_bytes )
+    {
+      int64_t n_blocks = compressed_block_count(n_elems, compress_block_elems(block_bytes, elem_size));
+      return (int64_t) sizeof(compressed_header) + 4 * n_blocks + n_elems * elem_size;
+    }
+
+    //Byte shuffling is splitting elem_size interleaved byte channels.
+    inline void shuffle_bytes( const uint8_t* src, uint8_t* dst, int64_t elem_size, int64_t n_elems )
+    {
+      vector<uint8_t*> planes(elem_size);
+      for ( int64_t byte = 0; byte < elem_size; ++byte )
+	planes[byte] = dst + byte * n_elems;
+      split_channels(src, planes.data(), (int32_t) elem_size, n_elems);
+    }
+
+    inline void unshuffle_bytes( const uint8_t* src, uint8_t* dst, int64_t elem_size, int64_t n_elems )
+    {
+      vector<const uint8_t*> planes(elem_size);
+      for ( int64_t byte = 0; byte < elem_size; ++byte )
+	planes[byte] = src + byte * n_elems;
+      merge_channels(planes.data(), dst, (int32_t) elem_size, n_elems);
+    }
+
+    inline int64_t compress_blocks_range( thread_pool& pool, buffer_range src, int64_t n_elems,
+					  int64_t block_bytes, bool shuffle,
+					  uint8_t* dst, int64_t dst_capacity )
+    {
+      int64_t elem_size = datatype_size(src.type);
+      int64_t block_elems = compress_block_elems(block_bytes, elem_size);
+      int64_t n_blocks = compressed_block_count(n_elems, block_elems);
+      int64_t table_end = (int64_t) sizeof(compressed_header) + 4 * n_blocks;
+      if (dst_capacity < table_end)
+	throw runtime_error("compress destination too small");
+      compressed_header header = { compressed_magic, (int32_t) src.type, n_elems, block_elems,
+				   shuffle && elem_size > 1 ? compressed_shuffled : 0, 0 };
+      const uint8_t* src_bytes = reinterpret_cast<const uint8_t*>(src.data) + src.offset * elem_size;
+      vector<vector<uint8_t> > blocks(n_blocks);
+      vector<uint32_t> sizes(n_blocks);
+      pool.parallel_for(n_blocks, [&](int64_t block) {
+	  int64_t count = std::min(block_elems, n_elems - block * block_elems);
+	  int64_t n_bytes = count * elem_size;
+	  const uint8_t* block_src = src_bytes + block * block_elems * elem_size;
+	  vector<uint8_t> shuffled;
+	  if (header.flags & compressed_shuffled) {
+	    shuffled.resize(n_bytes);
+	    shuffle_bytes(block_src, shuffled.data(), elem_size, count);
+	    block_src = shuffled.data();
+	  }
+	  vector<uint8_t>& compressed = blocks[block];
+	  compressed.resize(n_bytes);
+	  int64_t size = lz_compress(block_src, n_bytes, compressed.data(), n_bytes);
+	  if (size > 0) {
+	    compressed.resize(size);
+	    sizes[block] = (uint32_t) size;
+	  }
+	  else {
+	    compressed.assign(block_src, block_src + n_bytes);
+	    sizes[block] = (uint32_t) n_bytes | stored_block;
+	  }
+	});
+      vector<int64_t> offsets(n_blocks);
+      int64_t total = table_end;
+      for ( int64_t block = 0; block < n_blocks; ++block ) {
+	offsets[block] = total;
+	total += (int64_t) blocks[block].size();
+      }
+      if (total > dst_capacity)
+	throw runtime_error("compress destination too small");
+      memcpy(dst, &header, sizeof(header));
+      memcpy(dst + sizeof(header), sizes.data(), 4 * n_blocks);
+      pool.parallel_for(n_blocks, [&](int64_t block) {
+	  memcpy(dst + offsets[block], blocks[block].data(), blocks[block].size());
+	});
+      return total;
+    }
+
+    inline compressed_header read_compressed_header( const uint8_t* src, int64_t src_size )
+    {
+      compressed_header header;
+      if (src_size < (int64_t) sizeof(header))
+	throw runtime_error("truncated compressed buffer");
+      memcpy(&header, src, sizeof(header));
+      if (header.magic != compressed_magic || header.n_elems < 0 || header.block_elems <= 0
+	  || header.datatype < Datatype::Byte || header.datatype > Datatype::Double)
+	throw runtime_error("not a compressed buffer");
+      return header;
+    }
+
+    //Blocks are decoded into scratch space and unshuffled (or converted) into
+    //the destination.
+    inline int64_t decompress_blocks_range( thread_pool& pool, const uint8_t* src,
+					    int64_t src_size, buffer_range dst,
+					    int64_t dst_capacity )
+    {
+      compressed_header header = read_compressed_header(src, src_size);
+      if (header.n_elems > dst_capacity)
+	throw runtime_error("decompress destination too small");
+      Datatype::Enum src_type = (Datatype::Enum) header.datatype;
+      int64_t elem_size = datatype_size(src_type);
+      int64_t n_blocks = compressed_block_count(header.n_elems, header.block_elems);
+      if (n_blocks > src_size / 4)
+	throw runtime_error("truncated compressed buffer");
+      int64_t table_end = (int64_t) sizeof(header) + 4 * n_blocks;
+      if (src_size < table_end)
+	throw runtime_error("truncated compressed buffer");
+      vector<uint32_t> sizes(n_blocks);
+      memcpy(sizes.data(), src + sizeof(header), 4 * n_blocks);
+      vector<int64_t> offsets(n_blocks);
+      int64_t total = table_end;
+      for ( int64_t block = 0; block < n_blocks; ++block ) {
+	offsets[block] = total;
+	total += sizes[block] & ~stored_block;
+      }
+      if (total > src_size)
+	throw runtime_error("truncated compressed buffer");
+      bool direct = dst.type == src_type;
+      uint8_t* dst_bytes = reinterpret_cast<uint8_t*>(dst.data) + dst.offset * elem_size;
+      pool.parallel_for(n_blocks, [&](int64_t block) {
+	  int64_t count = std::min(header.block_elems, header.n_elems - block * header.block_elems);
+	  int64_t n_bytes = count * elem_size;
+	  int64_t block_size = sizes[block] & ~stored_block;
+	  const uint8_t* block_src = src + offsets[block];
+	  vector<uint8_t> converted;
+	  uint8_t* out = dst_bytes + block * header.block_elems * elem_size;
+	  if (!direct) {
+	    converted.resize(n_bytes);
+	    out = converted.data();
+	  }
+	  bool shuffled = (header.flags & compressed_shuffled) != 0;
+	  vector<uint8_t> decoded;
+	  if (sizes[block] & stored_block) {
+	    if (block_size != n_bytes)
+	      throw runtime_error("corrupt compressed block");
+	  }
+	  else if (!shuffled) {
+	    lz_decompress(block_src, block_size, out, n_bytes);
+	    block_src = nullptr;
+	  }
+	  else {
+	    decoded.resize(n_bytes);
+	    lz_decompress(block_src, block_size, decoded.data(), n_bytes);
+	    block_src = decoded.data();
+	  }
+	  if (shuffled)
+	    unshuffle_bytes(block_src, out, elem_size, count);
+	  else if (block_src != nullptr)
+	    memcpy(out, block_src, n_bytes);
+	  if (!direct) {
+	    typed_buffer_op<void>((int64_t) out, src_type, [&](auto src_ptr) {
+		typed_buffer_op<void>(dst.data, dst.type, [&](auto dst_ptr) {
+		    do_copy(src_ptr, 0, dst_ptr, dst.offset + block * header.block_elems, count);
+		  });
+	      });
+	  }
+	});
+      return header.n_elems;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef BYTE_BUFFER_CPU_HPP
+#define BYTE_BUFFER_CPU_HPP
+
+//Kernels that need more than the baseline instruction set are compiled with
+//target attributes and picked at runtime, so the library still loads on
+//machines without those extensions.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BYTE_BUFFER_X86_DISPATCH 1
+#endif
+
+namespace think { namespace byte_buffer {
+
+    struct cpu_features
+    {
+      bool ssse3;
+      bool sse42;
+      bool avx2;
+      bool fma;
+      bool avx512f;
+      bool avx512bw;
+      bool avx512vl;
+    };
+
+    inline const cpu_features& host_cpu()
+    {
+      static const cpu_features retval = []() {
+	cpu_features features = {};
+#ifdef BYTE_BUFFER_X86_DISPATCH
+	__builtin_cpu_init();
+	features.ssse3 = __builtin_cpu_supports("ssse3");
+	features.sse42 = __builtin_cpu_supports("sse4.2");
+	features.avx2 = __builtin_cpu_supports("avx2");
+	features.fma = __builtin_cpu_supports("fma");
+	features.avx512f = __builtin_cpu_supports("avx512f");
+	features.avx512bw = __builtin_cpu_supports("avx512bw");
+	features.avx512vl = __builtin_cpu_supports("avx512vl");
+#endif
+	return features;
+      }();
+      return retval;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,302 @@
+#ifndef BYTE_BUFFER_ELEMENTWISE_HPP
+#define BYTE_BUFFER_ELEMENTWISE_HPP
+#include <cmath>
+#include <stdexcept>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Element-wise kernels stream their inputs through small blocks of a
+    //single compute type: each block is converted in with the same copy_op
+    //casts the copy calls use, operated on, and converted out.  The blocks
+    //stay in L1 so this costs little over a fused loop while keeping the
+    //number of instantiations linear in the number of datatypes.
+    static const int64_t elementwise_block = 1024;
+    //Ranges below this many elements run on the calling thread.
+    static const int64_t parallel_elementwise_chunk = 1 << 15;
+
+    struct ComputeType {
+      enum Enum {
+	Long = 0,
+	Float,
+	Double,
+      };
+    };
+
+    inline bool is_float_datatype( Datatype::Enum type )
+    {
+      return type == Datatype::Float || type == Datatype::Double;
+    }
+
+    inline int64_t datatype_size( Datatype::Enum type )
+    {
+      return typed_buffer_op<int64_t>(0, type, [](auto type_ptr) {
+	  return (int64_t) sizeof(*type_ptr);
+	});
+    }
+
+    //Usual arithmetic conversions, except that integers are always computed
+    //in int64 so intermediate results of narrower types cannot overflow.
+    inline ComputeType::Enum promote( Datatype::Enum lhs, Datatype::Enum rhs )
+    {
+      if (lhs == Datatype::Double || rhs == Datatype::Double)
+	return ComputeType::Double;
+      if (lhs == Datatype::Float || rhs == Datatype::Float)
+	return ComputeType::Float;
+      return ComputeType::Long;
+    }
+
+    inline ComputeType::Enum promote( Datatype::Enum a, Datatype::Enum b, Datatype::Enum c )
+    {
+      ComputeType::Enum ab = promote(a, b);
+      ComputeType::Enum ac = promote(a, c);
+      return ab > ac ? ab : ac;
+    }
+
+    //A scalar operand only widens integer computations to double when it is
+    //not an integer in int64's range (or is NaN).
+    inline ComputeType::Enum promote_scalar( ComputeType::Enum type, double scalar )
+    {
+      if (type == ComputeType::Long && scalar != (double) convert_value<int64_t>(scalar))
+	return ComputeType::Double;
+      return type;
+    }
+
+    template<typename TRetType, typename TOpType>
+    inline TRetType compute_type_op( ComputeType::Enum type, TOpType op )
+    {
+      switch(type) {
+      case ComputeType::Long: return op((int64_t*) nullptr);
+      case ComputeType::Float: return op((float*) nullptr);
+      case ComputeType::Double: return op((double*) nullptr);
+      }
+      throw runtime_error("unknown compute type");
+    }
+
+    template<typename ctype>
+    inline void load_block( int64_t data, Datatype::Enum type, int64_t offset,
+			    ctype* block, int64_t n_elems )
+    {
+      typed_buffer_op<void>(data, type, [=](auto src_ptr) {
+	  do_copy(src_ptr, offset, block, 0, n_elems);
+	});
+    }
+
+    template<typename ctype>
+    inline void store_block( const ctype* block, int64_t data, Datatype::Enum type,
+			     int64_t offset, int64_t n_elems )
+    {
+      typed_buffer_op<void>(data, type, [=](auto dst_ptr) {
+	  do_copy(block, 0, dst_ptr, offset, n_elems);
+	});
+    }
+
+    //Integer arithmetic wraps on overflow as the hardware does.  Signed
+    //overflow is undefined, so it is done on the unsigned representation.
+    template<typename ctype>
+    inline ctype add( ctype lhs, ctype rhs ) { return lhs + rhs; }
+    template<>
+    inline int64_t add( int64_t lhs, int64_t rhs ) { return (int64_t) ((uint64_t) lhs + (uint64_t) rhs); }
+
+    template<typename ctype>
+    inline ctype subtract( ctype lhs, ctype rhs ) { return lhs - rhs; }
+    template<>
+    inline int64_t subtract( int64_t lhs, int64_t rhs ) { return (int64_t) ((uint64_t) lhs - (uint64_t) rhs); }
+
+    template<typename ctype>
+    inline ctype multiply( ctype lhs, ctype rhs ) { return lhs * rhs; }
+    template<>
+    inline int64_t multiply( int64_t lhs, int64_t rhs ) { return (int64_t) ((uint64_t) lhs * (uint64_t) rhs); }
+
+    template<typename ctype>
+    inline ctype negate( ctype value ) { return -value; }
+    template<>
+    inline int64_t negate( int64_t value ) { return (int64_t) (0 - (uint64_t) value); }
+
+    template<typename ctype>
+    inline ctype divide( ctype lhs, ctype rhs ) { return lhs / rhs; }
+    //Integer division by zero yields zero rather than a trap, and the one
+    //overflowing quotient, of the minimum by -1, wraps.
+    template<>
+    inline int64_t divide( int64_t lhs, int64_t rhs )
+    {
+      return rhs == 0 ? 0 : rhs == -1 ? negate(lhs) : lhs / rhs;
+    }
+
+    template<typename ctype>
+    inline void apply_binary( BinaryOp::Enum op, const ctype* lhs, const ctype* rhs,
+			      ctype* dst, int64_t n_elems )
+    {
+      switch(op) {
+      case BinaryOp::Add:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = add(lhs[idx], rhs[idx]);
+	break;
+      case BinaryOp::Sub:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = subtract(lhs[idx], rhs[idx]);
+	break;
+      case BinaryOp::Mul:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = multiply(lhs[idx], rhs[idx]);
+	break;
+      case BinaryOp::Div:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = divide(lhs[idx], rhs[idx]);
+	break;
+      case BinaryOp::Min:
+	for ( int64_t idx = 0; idx < n_elems; ++idx )
+	  dst[idx] = rhs[idx] < lhs[idx] ? rhs[idx] : lhs[idx];
+	break;
+      case BinaryOp::Max:
+	for ( int64_t idx = 0; idx < n_elems; ++idx )
+	  dst[idx] = rhs[idx] > lhs[idx] ? rhs[idx] : lhs[idx];
+	break;
+      default:
+	throw runtime_error("unknown binary op");
+      }
+    }
+
+    template<typename ctype>
+    inline void apply_scalar( BinaryOp::Enum op, const ctype* lhs, ctype rhs,
+			      ctype* dst, int64_t n_elems )
+    {
+      switch(op) {
+      case BinaryOp::Add:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = add(lhs[idx], rhs);
+	break;
+      case BinaryOp::Sub:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = subtract(lhs[idx], rhs);
+	break;
+      case BinaryOp::Mul:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = multiply(lhs[idx], rhs);
+	break;
+      case BinaryOp::Div:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = divide(lhs[idx], rhs);
+	break;
+      case BinaryOp::Min:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = rhs < lhs[idx] ? rhs : lhs[idx];
+	break;
+      case BinaryOp::Max:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = rhs > lhs[idx] ? rhs : lhs[idx];
+	break;
+      default:
+	throw runtime_error("unknown binary op");
+      }
+    }
+
+    template<typename ctype>
+    inline void apply_unary( UnaryOp::Enum op, const ctype* src, ctype* dst, int64_t n_elems )
+    {
+      switch(op) {
+      case UnaryOp::Abs:
+	for ( int64_t idx = 0; idx < n_elems; ++idx )
+	  dst[idx] = src[idx] < 0 ? negate(src[idx]) : src[idx];
+	break;
+      case UnaryOp::Sqrt:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = convert_value<ctype>(sqrt(src[idx]));
+	break;
+      case UnaryOp::Exp:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = convert_value<ctype>(exp(src[idx]));
+	break;
+      case UnaryOp::Negate:
+	for ( int64_t idx = 0; idx < n_elems; ++idx ) dst[idx] = negate(src[idx]);
+	break;
+      default:
+	throw runtime_error("unknown unary op");
+      }
+    }
+
+    //Run fn(offset, n_elems) over blocks of the range, in parallel for large
+    //ranges.
+    template<typename TFn>
+    inline void for_each_block( thread_pool& pool, int64_t n_elems, TFn fn )
+    {
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  for ( int64_t pos = begin; pos < end; pos += elementwise_block )
+	    fn(pos, std::min(elementwise_block, end - pos));
+	});
+    }
+
+    //Describes a range of a typed buffer for the kernels below.
+    struct buffer_range
+    {
+      int64_t data;
+      Datatype::Enum type;
+      int64_t offset;
+    };
+
+    template<typename ctype>
+    inline void binary_kernel( thread_pool& pool, BinaryOp::Enum op, buffer_range lhs,
+			       buffer_range rhs, buffer_range dst, int64_t n_elems )
+    {
+      for_each_block(pool, n_elems, [&](int64_t pos, int64_t count) {
+	  ctype lhs_block[elementwise_block];
+	  ctype rhs_block[elementwise_block];
+	  load_block(lhs.data, lhs.type, lhs.offset + pos, lhs_block, count);
+	  load_block(rhs.data, rhs.type, rhs.offset + pos, rhs_block, count);
+	  apply_binary(op, lhs_block, rhs_block, lhs_block, count);
+	  store_block(lhs_block, dst.data, dst.type, dst.offset + pos, count);
+	});
+    }
+
+    template<typename ctype>
+    inline void scalar_kernel( thread_pool& pool, BinaryOp::Enum op, buffer_range lhs,
+			       double rhs, buffer_range dst, int64_t n_elems )
+    {
+      for_each_block(pool, n_elems, [&](int64_t pos, int64_t count) {
+	  ctype block[elementwise_block];
+	  load_block(lhs.data, lhs.type, lhs.offset + pos, block, count);
+	  apply_scalar(op, block, convert_value<ctype>(rhs), block, count);
+	  store_block(block, dst.data, dst.type, dst.offset + pos, count);
+	});
+    }
+
+    template<typename ctype>
+    inline void unary_kernel( thread_pool& pool, UnaryOp::Enum op, buffer_range src,
+			      buffer_range dst, int64_t n_elems )
+    {
+      for_each_block(pool, n_elems, [&](int64_t pos, int64_t count) {
+	  ctype block[elementwise_block];
+	  load_block(src.data, src.type, src.offset + pos, block, count);
+	  apply_unary(op, block, block, count);
+	  store_block(block, dst.data, dst.type, dst.offset + pos, count);
+	});
+    }
+
+    template<typename ctype>
+    inline void clamp_kernel( thread_pool& pool, buffer_range src, double low, double high,
+			      buffer_range dst, int64_t n_elems )
+    {
+      ctype low_value = convert_value<ctype>(low);
+      ctype high_value = convert_value<ctype>(high);
+      for_each_block(pool, n_elems, [&](int64_t pos, int64_t count) {
+	  ctype block[elementwise_block];
+	  load_block(src.data, src.type, src.offset + pos, block, count);
+	  for ( int64_t idx = 0; idx < count; ++idx ) {
+	    ctype value = block[idx] < low_value ? low_value : block[idx];
+	    block[idx] = value > high_value ? high_value : value;
+	  }
+	  store_block(block, dst.data, dst.type, dst.offset + pos, count);
+	});
+    }
+
+    template<typename ctype>
+    inline void axpy_kernel( thread_pool& pool, double alpha, buffer_range x,
+			     buffer_range y, int64_t n_elems )
+    {
+      ctype alpha_value = convert_value<ctype>(alpha);
+      for_each_block(pool, n_elems, [&](int64_t pos, int64_t count) {
+	  ctype x_block[elementwise_block];
+	  ctype y_block[elementwise_block];
+	  load_block(x.data, x.type, x.offset + pos, x_block, count);
+	  load_block(y.data, y.type, y.offset + pos, y_block, count);
+	  for ( int64_t idx = 0; idx < count; ++idx )
+	    y_block[idx] = add(y_block[idx], multiply(alpha_value, x_block[idx]));
+	  store_block(y_block, y.data, y.type, y.offset + pos, count);
+	});
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef BYTE_BUFFER_EXPRESSION_HPP
+#define BYTE_BUFFER_EXPRESSION_HPP
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_elementwise.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //One decoded stage of an expression program.
+    struct expression_stage
+    {
+      ExprOp::Enum op;
+      double a;
+      double b;
+    };
+
+    //Round every value of the block through datatype, as storing it into a
+    //buffer of that type and reading it back would, so values out of an
+    //integer datatype's range saturate and NaN becomes zero.
+    template<typename ctype>
+    inline void cast_block( ctype* block, int64_t n_elems, Datatype::Enum type )
+    {
+      typed_buffer_op<void>(0, type, [=](auto type_ptr) {
+	  typedef typename remove_pointer<decltype(type_ptr)>::type stage_type;
+	  for ( int64_t idx = 0; idx < n_elems; ++idx )
+	    block[idx] = (ctype) convert_value<stage_type>(block[idx]);
+	});
+    }
+
+    inline int64_t stage_input( const expression_stage& stage, const vector<buffer_range>& inputs )
+    {
+      int64_t input = convert_value<int64_t>(stage.a);
+      if (input < 0 || input >= (int64_t) inputs.size())
+	throw runtime_error("expression input out of range");
+      return input;
+    }
+
+    //Run every stage over a block before moving to the next one so the whole
+    //program makes a single pass over memory.
+    template<typename ctype>
+    inline void run_stages( const vector<expression_stage>& stages,
+			    const vector<buffer_range>& inputs,
+			    ctype* block, ctype* operand, int64_t pos, int64_t n_elems )
+    {
+      for ( const expression_stage& stage : stages ) {
+	switch(stage.op) {
+	case ExprOp::Add: apply_scalar(BinaryOp::Add, block, (ctype) stage.a, block, n_elems); break;
+	case ExprOp::Sub: apply_scalar(BinaryOp::Sub, block, (ctype) stage.a, block, n_elems); break;
+	case ExprOp::Mul: apply_scalar(BinaryOp::Mul, block, (ctype) stage.a, block, n_elems); break;
+	case ExprOp::Div: apply_scalar(BinaryOp::Div, block, (ctype) stage.a, block, n_elems); break;
+	case ExprOp::Min: apply_scalar(BinaryOp::Min, block, (ctype) stage.a, block, n_elems); break;
+	case ExprOp::Max: apply_scalar(BinaryOp::Max, block, (ctype) stage.a, block, n_elems); break;
+	case ExprOp::MulAdd: {
+	  ctype scale = (ctype) stage.a;
+	  ctype bias = (ctype) stage.b;
+	  for ( int64_t idx = 0; idx < n_elems; ++idx )
+	    block[idx] = block[idx] * scale + bias;
+	  break;
+	}
+	case ExprOp::Clamp: {
+	  ctype low = (ctype) stage.a;
+	  ctype high = (ctype) stage.b;
+	  for ( int64_t idx = 0; idx < n_elems; ++idx ) {
+	    ctype value = block[idx] < low ? low : block[idx];
+	    block[idx] = value > high ? high : value;
+	  }
+	  break;
+	}
+	case ExprOp::Abs: apply_unary(UnaryOp::Abs, block, block, n_elems); break;
+	case ExprOp::Sqrt: apply_unary(UnaryOp::Sqrt, block, block, n_elems); break;
+	case ExprOp::Exp: apply_unary(UnaryOp::Exp, block, block, n_elems); break;
+	case ExprOp::Negate: apply_unary(UnaryOp::Negate, block, block, n_elems); break;
+	case ExprOp::Cast: cast_block(block, n_elems, (Datatype::Enum) convert_value<int32_t>(stage.a)); break;
+	case ExprOp::AddInput:
+	case ExprOp::SubInput:
+	case ExprOp::MulInput:
+	case ExprOp::DivInput: {
+	  const buffer_range& input = inputs[stage_input(stage, inputs)];
+	  load_block(input.data, input.type, input.offset + pos, operand, n_elems);
+	  BinaryOp::Enum op = (BinaryOp::Enum) (BinaryOp::Add + (stage.op - ExprOp::AddInput));
+	  apply_binary(op, block, operand, block, n_elems);
+	  break;
+	}
+	default:
+	  throw runtime_error("unknown expression op");
+	}
+      }
+    }
+
+    template<typename ctype>
+    inline void expression_kernel( thread_pool& pool, const vector<expression_stage>& stages,
+				   const vector<buffer_range>& inputs, buffer_range dst,
+				   int64_t n_elems )
+    {
+      for_each_block(pool, n_elems, [&](int64_t pos, int64_t count) {
+	  ctype block[elementwise_block];
+	  ctype operand[elementwise_block];
+	  load_block(inputs[0].data, inputs[0].type, inputs[0].offset + pos, block, count);
+	  run_stages(stages, inputs, block, operand, pos, count);
+	  store_block(block, dst.data, dst.type, dst.offset + pos, count);
+	});
+    }
+
+    //Programs compute in float when every buffer involved fits in one
+    //(bytes, shorts and floats) and in double otherwise.
+    inline ComputeType::Enum expression_compute_type( const vector<buffer_range>& inputs,
+						      Datatype::Enum dst_type )
+    {
+      ComputeType::Enum retval = ComputeType::Float;
+      auto widen = [&](Datatype::Enum type) {
+	if (type != Datatype::Byte && type != Datatype::Short && type != Datatype::Float)
+	  retval = ComputeType::Double;
+      };
+      for ( const buffer_range& input : inputs )
+	widen(input.type);
+      widen(dst_type);
+      return retval;
+    }
+
+    inline vector<expression_stage> decode_stages( const int32_t* ops, const double* operands,
+						   int32_t n_ops )
+    {
+      vector<expression_stage> retval;
+      for ( int32_t idx = 0; idx < n_ops; ++idx ) {
+	expression_stage stage = { (ExprOp::Enum) ops[idx],
+				   operands[2 * idx], operands[2 * idx + 1] };
+	if (stage.op == ExprOp::Cast) {
+	  int32_t type = convert_value<int32_t>(stage.a);
+	  if (type < Datatype::Byte || type > Datatype::Double)
+	    throw runtime_error("invalid cast datatype");
+	}
+	retval.push_back(stage);
+      }
+      return retval;
+    }
+  }
+}
+
+#endif
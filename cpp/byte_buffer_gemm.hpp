@@ -0,0 +1,316 @@
+#ifndef BYTE_BUFFER_GEMM_HPP
+#define BYTE_BUFFER_GEMM_HPP
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_cpu.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_elementwise.hpp"
+#ifdef BYTE_BUFFER_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Matrix multiply in the usual blocked arrangement: B is packed a
+    //gemm_kc x gemm_nc panel at a time into slivers as wide as the micro
+    //tile, sized to stay in the last level cache, and A a gemm_mc x gemm_kc
+    //block at a time into slivers as tall as the micro tile, sized for L2.
+    //The micro kernel then keeps an mr x nr tile of C in registers while it
+    //streams through a sliver of each.  Transposes and leading dimensions
+    //are absorbed by the packing, so the kernels only see one layout.
+    static const int64_t gemm_kc = 256;
+    //Multiples of every micro tile's mr and nr below.
+    static const int64_t gemm_mc = 96;
+    static const int64_t gemm_nc = 4096;
+
+    //Computes the product of a kc long sliver of A (packed mr values per
+    //step) and of B (nr values per step) into tile, row major mr x nr.
+    template<typename T>
+    struct gemm_kernel
+    {
+      int64_t mr;
+      int64_t nr;
+      void (*fn)( int64_t kc, const T* a, const T* b, T* tile );
+    };
+
+    template<typename T>
+    inline void gemm_micro_portable( int64_t kc, const T* a, const T* b, T* tile )
+    {
+      const int64_t mr = 4;
+      const int64_t nr = 8;
+      T acc[mr * nr] = {0};
+      for ( int64_t step = 0; step < kc; ++step ) {
+	for ( int64_t row = 0; row < mr; ++row )
+	  for ( int64_t col = 0; col < nr; ++col )
+	    acc[row * nr + col] += a[step * mr + row] * b[step * nr + col];
+      }
+      std::copy(acc, acc + mr * nr, tile);
+    }
+
+#ifdef BYTE_BUFFER_X86_DISPATCH
+    //The micro kernels hold two vectors of each of the mr rows of the tile,
+    //leaving registers for the two B vectors and the broadcast A value.
+    template<typename T> struct avx2_vec;
+    template<> struct avx2_vec<float> { typedef __m256 type; };
+    template<> struct avx2_vec<double> { typedef __m256d type; };
+    template<typename T> struct avx512_vec;
+    template<> struct avx512_vec<float> { typedef __m512 type; };
+    template<> struct avx512_vec<double> { typedef __m512d type; };
+
+    __attribute__((target("avx2,fma"))) inline __m256 vec_set1( float value ) { return _mm256_set1_ps(value); }
+    __attribute__((target("avx2,fma"))) inline __m256d vec_set1( double value ) { return _mm256_set1_pd(value); }
+    __attribute__((target("avx2,fma"))) inline void vec_load( __m256& dst, const float* src ) { dst = _mm256_loadu_ps(src); }
+    __attribute__((target("avx2,fma"))) inline void vec_load( __m256d& dst, const double* src ) { dst = _mm256_loadu_pd(src); }
+    __attribute__((target("avx2,fma"))) inline void vec_store( float* dst, __m256 src ) { _mm256_storeu_ps(dst, src); }
+    __attribute__((target("avx2,fma"))) inline void vec_store( double* dst, __m256d src ) { _mm256_storeu_pd(dst, src); }
+    __attribute__((target("avx2,fma"))) inline __m256 vec_fmadd( __m256 a, __m256 b, __m256 c ) { return _mm256_fmadd_ps(a, b, c); }
+    __attribute__((target("avx2,fma"))) inline __m256d vec_fmadd( __m256d a, __m256d b, __m256d c ) { return _mm256_fmadd_pd(a, b, c); }
+
+    __attribute__((target("avx512f"))) inline __m512 vec_set1_512( float value ) { return _mm512_set1_ps(value); }
+    __attribute__((target("avx512f"))) inline __m512d vec_set1_512( double value ) { return _mm512_set1_pd(value); }
+    __attribute__((target("avx512f"))) inline void vec_load( __m512& dst, const float* src ) { dst = _mm512_loadu_ps(src); }
+    __attribute__((target("avx512f"))) inline void vec_load( __m512d& dst, const double* src ) { dst = _mm512_loadu_pd(src); }
+    __attribute__((target("avx512f"))) inline void vec_store( float* dst, __m512 src ) { _mm512_storeu_ps(dst, src); }
+    __attribute__((target("avx512f"))) inline void vec_store( double* dst, __m512d src ) { _mm512_storeu_pd(dst, src); }
+    __attribute__((target("avx512f"))) inline __m512 vec_fmadd( __m512 a, __m512 b, __m512 c ) { return _mm512_fmadd_ps(a, b, c); }
+    __attribute__((target("avx512f"))) inline __m512d vec_fmadd( __m512d a, __m512d b, __m512d c ) { return _mm512_fmadd_pd(a, b, c); }
+
+    template<typename T, int64_t mr>
+    __attribute__((target("avx2,fma")))
+    void gemm_micro_avx2( int64_t kc, const T* a, const T* b, T* tile )
+    {
+      typedef typename avx2_vec<T>::type vec;
+      const int64_t width = 32 / sizeof(T);
+      vec acc[mr][2];
+      for ( int64_t row = 0; row < mr; ++row )
+	acc[row][0] = acc[row][1] = vec_set1((T) 0);
+      for ( int64_t step = 0; step < kc; ++step ) {
+	vec b_low, b_high;
+	vec_load(b_low, b + step * 2 * width);
+	vec_load(b_high, b + step * 2 * width + width);
+	for ( int64_t row = 0; row < mr; ++row ) {
+	  vec a_value = vec_set1(a[step * mr + row]);
+	  acc[row][0] = vec_fmadd(a_value, b_low, acc[row][0]);
+	  acc[row][1] = vec_fmadd(a_value, b_high, acc[row][1]);
+	}
+      }
+      for ( int64_t row = 0; row < mr; ++row ) {
+	vec_store(tile + row * 2 * width, acc[row][0]);
+	vec_store(tile + row * 2 * width + width, acc[row][1]);
+      }
+    }
+
+    template<typename T, int64_t mr>
+    __attribute__((target("avx512f")))
+    void gemm_micro_avx512( int64_t kc, const T* a, const T* b, T* tile )
+    {
+      typedef typename avx512_vec<T>::type vec;
+      const int64_t width = 64 / sizeof(T);
+      vec acc[mr][2];
+      for ( int64_t row = 0; row < mr; ++row )
+	acc[row][0] = acc[row][1] = vec_set1_512((T) 0);
+      for ( int64_t step = 0; step < kc; ++step ) {
+	vec b_low, b_high;
+	vec_load(b_low, b + step * 2 * width);
+	vec_load(b_high, b + step * 2 * width + width);
+	for ( int64_t row = 0; row < mr; ++row ) {
+	  vec a_value = vec_set1_512(a[step * mr + row]);
+	  acc[row][0] = vec_fmadd(a_value, b_low, acc[row][0]);
+	  acc[row][1] = vec_fmadd(a_value, b_high, acc[row][1]);
+	}
+      }
+      for ( int64_t row = 0; row < mr; ++row ) {
+	vec_store(tile + row * 2 * width, acc[row][0]);
+	vec_store(tile + row * 2 * width + width, acc[row][1]);
+      }
+    }
+#endif
+
+    template<typename T>
+    inline gemm_kernel<T> select_gemm_kernel()
+    {
+#ifdef BYTE_BUFFER_X86_DISPATCH
+      if (host_cpu().avx512f)
+	return gemm_kernel<T> { 12, 128 / (int64_t) sizeof(T), gemm_micro_avx512<T, 12> };
+      if (host_cpu().avx2 && host_cpu().fma)
+	return gemm_kernel<T> { 6, 64 / (int64_t) sizeof(T), gemm_micro_avx2<T, 6> };
+#endif
+      return gemm_kernel<T> { 4, 8, gemm_micro_portable<T> };
+    }
+
+    //A row major matrix, optionally read transposed.
+    template<typename T>
+    struct gemm_operand
+    {
+      const T* data;
+      int64_t ld;
+      bool transpose;
+      const T* at( int64_t row, int64_t col ) const
+      {
+	return transpose ? data + col * ld + row : data + row * ld + col;
+      }
+    };
+
+    //Rows [row, row + n_rows) by steps [step, step + kc) of A into slivers of
+    //mr rows, each kc steps of mr values, the last padded with zeros.
+    template<typename T>
+    inline void gemm_pack_a( const gemm_operand<T>& a, int64_t row, int64_t n_rows,
+			     int64_t step, int64_t kc, int64_t mr, T* packed )
+    {
+      for ( int64_t sliver = 0; sliver < n_rows; sliver += mr, packed += kc * mr ) {
+	int64_t sliver_rows = std::min(mr, n_rows - sliver);
+	for ( int64_t idx = 0; idx < mr; ++idx ) {
+	  if (idx >= sliver_rows) {
+	    for ( int64_t pos = 0; pos < kc; ++pos )
+	      packed[pos * mr + idx] = 0;
+	  }
+	  else if (!a.transpose) {
+	    const T* src = a.at(row + sliver + idx, step);
+	    for ( int64_t pos = 0; pos < kc; ++pos )
+	      packed[pos * mr + idx] = src[pos];
+	  }
+	  else {
+	    for ( int64_t pos = 0; pos < kc; ++pos )
+	      packed[pos * mr + idx] = *a.at(row + sliver + idx, step + pos);
+	  }
+	}
+      }
+    }
+
+    //Slivers [sliver_begin, sliver_end) of nr columns starting at col, steps
+    //[step, step + kc) of B, each kc steps of nr values, zero padded.
+    template<typename T>
+    inline void gemm_pack_b( const gemm_operand<T>& b, int64_t col, int64_t n_cols,
+			     int64_t step, int64_t kc, int64_t nr,
+			     int64_t sliver_begin, int64_t sliver_end, T* packed )
+    {
+      for ( int64_t sliver = sliver_begin; sliver < sliver_end; ++sliver ) {
+	T* dst = packed + sliver * kc * nr;
+	int64_t first = sliver * nr;
+	int64_t sliver_cols = std::min(nr, n_cols - first);
+	for ( int64_t pos = 0; pos < kc; ++pos, dst += nr ) {
+	  if (!b.transpose) {
+	    const T* src = b.at(step + pos, col + first);
+	    for ( int64_t idx = 0; idx < sliver_cols; ++idx )
+	      dst[idx] = src[idx];
+	  }
+	  else {
+	    for ( int64_t idx = 0; idx < sliver_cols; ++idx )
+	      dst[idx] = *b.at(step + pos, col + first + idx);
+	  }
+	  for ( int64_t idx = sliver_cols; idx < nr; ++idx )
+	    dst[idx] = 0;
+	}
+      }
+    }
+
+    //C = alpha tile + beta C on the first depth block, C += alpha tile after.
+    //A zero beta overwrites C without reading it, as in BLAS.
+    template<typename T>
+    inline void gemm_update_tile( const T* tile, int64_t nr, T* c, int64_t ldc,
+				  int64_t n_rows, int64_t n_cols, T alpha, T beta, bool first )
+    {
+      for ( int64_t row = 0; row < n_rows; ++row, c += ldc, tile += nr ) {
+	if (!first) {
+	  for ( int64_t col = 0; col < n_cols; ++col )
+	    c[col] += alpha * tile[col];
+	}
+	else if (beta == 0) {
+	  for ( int64_t col = 0; col < n_cols; ++col )
+	    c[col] = alpha * tile[col];
+	}
+	else {
+	  for ( int64_t col = 0; col < n_cols; ++col )
+	    c[col] = alpha * tile[col] + beta * c[col];
+	}
+      }
+    }
+
+    //Row major C (m x n) = alpha op(A) op(B) + beta C.  Each packed B panel
+    //is shared by macro tiles of gemm_mc rows of C; when there are too few
+    //rows to occupy the threads the panel's columns are split as well.
+    template<typename T>
+    inline void gemm_typed( thread_pool& pool, int64_t m, int64_t n, int64_t k, T alpha,
+			    gemm_operand<T> a, gemm_operand<T> b, T beta, T* c, int64_t ldc )
+    {
+      if (m == 0 || n == 0)
+	return;
+      if (k == 0 || alpha == 0) {
+	for ( int64_t row = 0; row < m; ++row )
+	  for ( int64_t col = 0; col < n; ++col )
+	    c[row * ldc + col] = beta == 0 ? 0 : beta * c[row * ldc + col];
+	return;
+      }
+      gemm_kernel<T> kernel = select_gemm_kernel<T>();
+      int64_t mr = kernel.mr;
+      int64_t nr = kernel.nr;
+      int64_t m_blocks = (m + gemm_mc - 1) / gemm_mc;
+      vector<T> b_packed(gemm_kc * gemm_nc);
+      for ( int64_t col = 0; col < n; col += gemm_nc ) {
+	int64_t nc = std::min(gemm_nc, n - col);
+	int64_t n_slivers = (nc + nr - 1) / nr;
+	int64_t col_groups = std::min(n_slivers,
+				      (pool.concurrency() * 4 + m_blocks - 1) / m_blocks);
+	for ( int64_t step = 0; step < k; step += gemm_kc ) {
+	  int64_t kc = std::min(gemm_kc, k - step);
+	  bool first = step == 0;
+	  parallel_chunks(pool, n_slivers, std::min(n_slivers, pool.concurrency()),
+			  [&](int64_t, int64_t begin, int64_t end) {
+			    gemm_pack_b(b, col, nc, step, kc, nr, begin, end, b_packed.data());
+			  });
+	  pool.parallel_for(m_blocks * col_groups, [&](int64_t task) {
+	      int64_t row = (task / col_groups) * gemm_mc;
+	      int64_t group = task % col_groups;
+	      int64_t mc = std::min(gemm_mc, m - row);
+	      int64_t sliver_begin = n_slivers * group / col_groups;
+	      int64_t sliver_end = n_slivers * (group + 1) / col_groups;
+	      vector<T> a_packed(gemm_mc * gemm_kc);
+	      vector<T> tile(mr * nr);
+	      gemm_pack_a(a, row, mc, step, kc, mr, a_packed.data());
+	      for ( int64_t sliver = sliver_begin; sliver < sliver_end; ++sliver ) {
+		const T* b_sliver = b_packed.data() + sliver * kc * nr;
+		int64_t tile_col = sliver * nr;
+		int64_t tile_cols = std::min(nr, nc - tile_col);
+		for ( int64_t tile_row = 0; tile_row < mc; tile_row += mr ) {
+		  kernel.fn(kc, a_packed.data() + tile_row * kc, b_sliver, tile.data());
+		  gemm_update_tile(tile.data(), nr, c + (row + tile_row) * ldc + col + tile_col, ldc,
+				   std::min(mr, mc - tile_row), tile_cols, alpha, beta, first);
+		}
+	      }
+	    });
+	}
+      }
+    }
+
+    inline void gemm_ranges( thread_pool& pool, bool trans_a, bool trans_b,
+			     int64_t m, int64_t n, int64_t k, double alpha,
+			     buffer_range a, int64_t lda, buffer_range b, int64_t ldb,
+			     double beta, buffer_range c, int64_t ldc )
+    {
+      if (a.type != c.type || b.type != c.type
+	  || (c.type != Datatype::Float && c.type != Datatype::Double))
+	throw runtime_error("gemm needs float or double matrices of one datatype");
+      if (m < 0 || n < 0 || k < 0
+	  || lda < std::max((int64_t) 1, trans_a ? m : k)
+	  || ldb < std::max((int64_t) 1, trans_b ? k : n)
+	  || ldc < std::max((int64_t) 1, n))
+	throw runtime_error("invalid matrix dimensions");
+      if (c.type == Datatype::Float)
+	gemm_typed(pool, m, n, k, (float) alpha,
+		   gemm_operand<float> { reinterpret_cast<const float*>(a.data) + a.offset, lda, trans_a },
+		   gemm_operand<float> { reinterpret_cast<const float*>(b.data) + b.offset, ldb, trans_b },
+		   (float) beta, reinterpret_cast<float*>(c.data) + c.offset, ldc);
+      else
+	gemm_typed(pool, m, n, k, alpha,
+		   gemm_operand<double> { reinterpret_cast<const double*>(a.data) + a.offset, lda, trans_a },
+		   gemm_operand<double> { reinterpret_cast<const double*>(b.data) + b.offset, ldb, trans_b },
+		   beta, reinterpret_cast<double*>(c.data) + c.offset, ldc);
+    }
+  }
+}
+
+#endif
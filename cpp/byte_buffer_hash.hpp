@@ -0,0 +1,191 @@
+#ifndef BYTE_BUFFER_HASH_HPP
+#define BYTE_BUFFER_HASH_HPP
+#include <cstring>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_elementwise.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //XXH64 (https://github.com/Cyan4973/xxHash), so hashes match those of
+    //any other xxHash64 implementation given the same bytes and seed.
+    static const uint64_t xxh_prime1 = 11400714785074694791ULL;
+    static const uint64_t xxh_prime2 = 14029467366897019727ULL;
+    static const uint64_t xxh_prime3 = 1609587929392839161ULL;
+    static const uint64_t xxh_prime4 = 9650029242287828579ULL;
+    static const uint64_t xxh_prime5 = 2870177450012600261ULL;
+
+    inline uint64_t rotate_left( uint64_t value, int bits )
+    {
+      return (value << bits) | (value >> (64 - bits));
+    }
+
+    inline uint64_t read_u64( const unsigned char* data )
+    {
+      uint64_t retval;
+      memcpy(&retval, data, sizeof(retval));
+      return retval;
+    }
+
+    inline uint32_t read_u32( const unsigned char* data )
+    {
+      uint32_t retval;
+      memcpy(&retval, data, sizeof(retval));
+      return retval;
+    }
+
+    inline uint64_t xxh64_round( uint64_t acc, uint64_t input )
+    {
+      acc += input * xxh_prime2;
+      acc = rotate_left(acc, 31);
+      return acc * xxh_prime1;
+    }
+
+    inline uint64_t xxh64_merge_round( uint64_t acc, uint64_t value )
+    {
+      acc ^= xxh64_round(0, value);
+      return acc * xxh_prime1 + xxh_prime4;
+    }
+
+    inline uint64_t xxh64_converge( uint64_t v1, uint64_t v2, uint64_t v3, uint64_t v4 )
+    {
+      uint64_t retval = rotate_left(v1, 1) + rotate_left(v2, 7) + rotate_left(v3, 12)
+	+ rotate_left(v4, 18);
+      retval = xxh64_merge_round(retval, v1);
+      retval = xxh64_merge_round(retval, v2);
+      retval = xxh64_merge_round(retval, v3);
+      return xxh64_merge_round(retval, v4);
+    }
+
+    //The final (fewer than 32) bytes and avalanche, shared with the
+    //streaming hash.
+    inline uint64_t xxh64_tail( uint64_t retval, const unsigned char* data,
+				const unsigned char* end )
+    {
+      for ( ; end - data >= 8; data += 8 ) {
+	retval ^= xxh64_round(0, read_u64(data));
+	retval = rotate_left(retval, 27) * xxh_prime1 + xxh_prime4;
+      }
+      if (end - data >= 4) {
+	retval ^= (uint64_t) read_u32(data) * xxh_prime1;
+	retval = rotate_left(retval, 23) * xxh_prime2 + xxh_prime3;
+	data += 4;
+      }
+      for ( ; data < end; ++data ) {
+	retval ^= (*data) * xxh_prime5;
+	retval = rotate_left(retval, 11) * xxh_prime1;
+      }
+      retval ^= retval >> 33;
+      retval *= xxh_prime2;
+      retval ^= retval >> 29;
+      retval *= xxh_prime3;
+      retval ^= retval >> 32;
+      return retval;
+    }
+
+    inline uint64_t xxh64( const unsigned char* data, int64_t length, uint64_t seed )
+    {
+      const unsigned char* end = data + length;
+      uint64_t retval;
+      if (length >= 32) {
+	uint64_t v1 = seed + xxh_prime1 + xxh_prime2;
+	uint64_t v2 = seed + xxh_prime2;
+	uint64_t v3 = seed;
+	uint64_t v4 = seed - xxh_prime1;
+	const unsigned char* limit = end - 32;
+	do {
+	  v1 = xxh64_round(v1, read_u64(data));
+	  v2 = xxh64_round(v2, read_u64(data + 8));
+	  v3 = xxh64_round(v3, read_u64(data + 16));
+	  v4 = xxh64_round(v4, read_u64(data + 24));
+	  data += 32;
+	} while (data <= limit);
+	retval = xxh64_converge(v1, v2, v3, v4);
+      }
+      else {
+	retval = seed + xxh_prime5;
+      }
+      return xxh64_tail(retval + (uint64_t) length, data, end);
+    }
+
+    template<typename ctype>
+    inline bool values_equal( ctype lhs, ctype rhs, bool nan_equal )
+    {
+      return lhs == rhs || (nan_equal && lhs != lhs && rhs != rhs);
+    }
+
+    //Compare values converted to a common compute type, block by block so
+    //the scan stops soon after the first difference.
+    template<typename ctype>
+    inline bool equal_values( buffer_range lhs, buffer_range rhs, int64_t n_elems, bool nan_equal )
+    {
+      ctype lhs_block[elementwise_block];
+      ctype rhs_block[elementwise_block];
+      for ( int64_t pos = 0; pos < n_elems; pos += elementwise_block ) {
+	int64_t count = std::min(elementwise_block, n_elems - pos);
+	load_block(lhs.data, lhs.type, lhs.offset + pos, lhs_block, count);
+	load_block(rhs.data, rhs.type, rhs.offset + pos, rhs_block, count);
+	bool equal = true;
+	for ( int64_t idx = 0; idx < count; ++idx )
+	  equal &= values_equal(lhs_block[idx], rhs_block[idx], nan_equal);
+	if (!equal)
+	  return false;
+      }
+      return true;
+    }
+
+    //An integer equals a float value exactly when the float is an integer
+    //in int64's range converting to it.  Comparing both in a float type
+    //would round integers past its mantissa (16777217 would equal
+    //16777216.0f), so the float is converted instead and checked for
+    //having survived the round trip.
+    inline bool integer_equals_float( int64_t lhs, double rhs )
+    {
+      bool in_range = rhs >= -9223372036854775808.0 && rhs < 9223372036854775808.0;
+      int64_t converted = in_range ? (int64_t) rhs : 0;
+      return in_range && (double) converted == rhs && converted == lhs;
+    }
+
+    inline bool equal_integer_float( buffer_range integers, buffer_range floats, int64_t n_elems )
+    {
+      int64_t integer_block[elementwise_block];
+      double float_block[elementwise_block];
+      for ( int64_t pos = 0; pos < n_elems; pos += elementwise_block ) {
+	int64_t count = std::min(elementwise_block, n_elems - pos);
+	load_block(integers.data, integers.type, integers.offset + pos, integer_block, count);
+	load_block(floats.data, floats.type, floats.offset + pos, float_block, count);
+	bool equal = true;
+	for ( int64_t idx = 0; idx < count; ++idx )
+	  equal &= integer_equals_float(integer_block[idx], float_block[idx]);
+	if (!equal)
+	  return false;
+      }
+      return true;
+    }
+
+    inline bool equal_ranges( buffer_range lhs, buffer_range rhs, int64_t n_elems, bool nan_equal )
+    {
+      if (lhs.type == rhs.type) {
+	int64_t elem_size = datatype_size(lhs.type);
+	bool same_bytes = memcmp((const char*) lhs.data + lhs.offset * elem_size,
+				 (const char*) rhs.data + rhs.offset * elem_size,
+				 n_elems * elem_size) == 0;
+	//Identical integers are equal and differing ones are not; floats can
+	//differ in bytes but not value (0.0 and -0.0, NaN payloads) or match
+	//in bytes but not value (NaN when NaNs compare unequal).
+	if (!is_float_datatype(lhs.type) || (same_bytes && nan_equal))
+	  return same_bytes;
+      }
+      if (is_float_datatype(lhs.type) != is_float_datatype(rhs.type))
+	return is_float_datatype(rhs.type) ? equal_integer_float(lhs, rhs, n_elems)
+	  : equal_integer_float(rhs, lhs, n_elems);
+      return compute_type_op<bool>(promote(lhs.type, rhs.type), [&](auto ctype_ptr) {
+	  return equal_values<typename remove_pointer<decltype(ctype_ptr)>::type>
+	    (lhs, rhs, n_elems, nan_equal);
+	});
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef BYTE_BUFFER_HISTOGRAM_HPP
+#define BYTE_BUFFER_HISTOGRAM_HPP
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <limits>
+#include <stdexcept>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_elementwise.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Histograms count into private per chunk bins that are summed at the end,
+    //so chunks never contend on a bin.  Each chunk's bins carry one extra
+    //slot that values outside the bins are sent to, which keeps the counting
+    //loop free of range checks.  Bin indices are int32 so the conversions
+    //from double vectorize.
+    static const int64_t histogram_block = 256;
+    //Bound on the total private bins; wide histograms use fewer chunks.
+    static const int64_t max_histogram_bins = 1 << 24;
+
+    template<typename TBinFn>
+    inline void count_bins( thread_pool& pool, int64_t n_elems, int64_t n_bins, int64_t* counts,
+			    TBinFn bin_fn )
+    {
+      if (n_bins >= (int64_t) numeric_limits<int32_t>::max())
+	throw runtime_error("too many histogram bins");
+      int64_t n_slots = n_bins + 1;
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      n_chunks = std::max((int64_t) 1, std::min(n_chunks, max_histogram_bins / n_slots));
+      vector<int64_t> chunk_counts(n_chunks * n_slots, 0);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  int64_t* slots = chunk_counts.data() + chunk * n_slots;
+	  int32_t bins[histogram_block];
+	  for ( int64_t pos = begin; pos < end; pos += histogram_block ) {
+	    int64_t count = std::min(histogram_block, end - pos);
+	    bin_fn(pos, count, bins);
+	    for ( int64_t idx = 0; idx < count; ++idx )
+	      ++slots[bins[idx]];
+	  }
+	});
+      for ( int64_t chunk = 0; chunk < n_chunks; ++chunk ) {
+	const int64_t* slots = chunk_counts.data() + chunk * n_slots;
+	for ( int64_t bin = 0; bin < n_bins; ++bin )
+	  counts[bin] += slots[bin];
+      }
+    }
+
+    //n_bins equal bins over [low, high]; the last bin includes high.  NaN and
+    //values outside the range are not counted.  The bin computation is a
+    //branch free loop over a block so it vectorizes.
+    template<typename dtype>
+    inline void uniform_histogram_typed( thread_pool& pool, const dtype* src, int64_t n_elems,
+					 int64_t n_bins, double low, double high, int64_t* counts )
+    {
+      if (n_bins <= 0 || !(low < high))
+	throw runtime_error("histogram needs bins and a nonempty range");
+      double scale = (double) n_bins / (high - low);
+      double last = (double) (n_bins - 1);
+      double outside = (double) n_bins;
+      count_bins(pool, n_elems, n_bins, counts, [&](int64_t pos, int64_t count, int32_t* bins) {
+	  for ( int64_t idx = 0; idx < count; ++idx ) {
+	    double value = (double) src[pos + idx];
+	    double bin = (value - low) * scale;
+	    bin = bin > last ? last : bin;
+	    //Written so NaN fails the test and lands outside.
+	    bin = (value >= low && value <= high) ? bin : outside;
+	    bins[idx] = (int32_t) bin;
+	  }
+	});
+    }
+
+    //Bins [edges[i], edges[i + 1]) for ascending edges, the last bin closed.
+    template<typename dtype>
+    inline void edge_histogram_typed( thread_pool& pool, const dtype* src, int64_t n_elems,
+				      const double* edges, int64_t n_edges, int64_t* counts )
+    {
+      if (n_edges < 2)
+	throw runtime_error("histogram needs at least two edges");
+      for ( int64_t idx = 1; idx < n_edges; ++idx )
+	if (!(edges[idx - 1] < edges[idx]))
+	  throw runtime_error("histogram edges must be increasing");
+      int64_t n_bins = n_edges - 1;
+      count_bins(pool, n_elems, n_bins, counts, [&](int64_t pos, int64_t count, int32_t* bins) {
+	  for ( int64_t idx = 0; idx < count; ++idx ) {
+	    double value = (double) src[pos + idx];
+	    //Branch free search for the last edge at or below value; random
+	    //values would mispredict most branches of a regular binary search.
+	    const double* base = edges;
+	    int64_t length = n_edges;
+	    while (length > 1) {
+	      int64_t half = length / 2;
+	      base = base[half] <= value ? base + half : base;
+	      length -= half;
+	    }
+	    int64_t bin = std::min((int64_t) (base - edges), n_bins - 1);
+	    bins[idx] = (int32_t) ((value >= edges[0] && value <= edges[n_bins]) ? bin : n_bins);
+	  }
+	});
+    }
+
+    //Occurrences of each integer in [0, n_bins); returns how many values fell
+    //outside that range.
+    template<typename dtype>
+    inline int64_t bincount_typed( thread_pool& pool, const dtype* src, int64_t n_elems,
+				   int64_t n_bins, int64_t* counts )
+    {
+      if (!is_integral<dtype>::value)
+	throw runtime_error("bincount needs an integer buffer");
+      if (n_bins <= 0)
+	throw runtime_error("bincount needs at least one bin");
+      vector<int64_t> with_outside(n_bins + 1, 0);
+      count_bins(pool, n_elems, n_bins + 1, with_outside.data(),
+		 [&](int64_t pos, int64_t count, int32_t* bins) {
+		   for ( int64_t idx = 0; idx < count; ++idx ) {
+		     int64_t value = (int64_t) src[pos + idx];
+		     bins[idx] = (int32_t) ((value >= 0 && value < n_bins) ? value : n_bins);
+		   }
+		 });
+      for ( int64_t bin = 0; bin < n_bins; ++bin )
+	counts[bin] += with_outside[bin];
+      return with_outside[n_bins];
+    }
+  }
+}
+
+#endif
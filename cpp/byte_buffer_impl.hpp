@@ -3,7 +3,16 @@
 #include <memory>
 #include <stdexcept>
 #include <cstring>
+#include <map>
+#include <mutex>
+#include <limits>
+#include <type_traits>
 #include "byte_buffer.hpp"
+#include "byte_buffer_numa.hpp"
+#include "byte_buffer_mmap.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_reduce.hpp"
+#include "byte_buffer_bits.hpp"
 
 namespace think { namespace byte_buffer {
     using namespace std;
@@ -31,6 +40,37 @@ namespace think { namespace byte_buffer {
     DEFINE_DATATYPE(Double,double);
 
 
+    //Float to integer conversions saturate, where a plain cast is undefined
+    //out of range: NaN becomes zero and other values clamp to the integer's
+    //range.  The clamp is done in double, which holds every limit exactly
+    //except int64's maximum; values from 2^63 up are caught separately.
+    template<typename dst_type, typename src_type>
+    inline dst_type convert_value( src_type value, false_type )
+    {
+      return (dst_type) value;
+    }
+
+    template<typename dst_type, typename src_type>
+    inline dst_type convert_value( src_type value, true_type )
+    {
+      const double low = (double) numeric_limits<dst_type>::min();
+      const double high = (double) numeric_limits<dst_type>::max();
+      double converted = (double) value;
+      if (sizeof(dst_type) == 8 && converted >= high)
+	return numeric_limits<dst_type>::max();
+      converted = converted < low ? low : converted;
+      converted = converted > high ? high : converted;
+      return (dst_type) (converted == converted ? converted : 0.0);
+    }
+
+    template<typename dst_type, typename src_type>
+    inline dst_type convert_value( src_type value )
+    {
+      return convert_value<dst_type>(value, integral_constant<bool, is_floating_point<src_type>::value
+				     && is_integral<dst_type>::value>());
+    }
+
+
     template<typename lhs, typename rhs>
     struct copy_op
     {
@@ -41,7 +81,7 @@ namespace think { namespace byte_buffer {
 	dst += dst_offset;
 	src += src_offset;
 	for(int64_t idx = 0; idx < n_elems; ++idx) {
-	  dst[idx] = (rhs) src[idx];
+	  dst[idx] = convert_value<rhs>(src[idx]);
 	}
       }
     };
@@ -86,7 +126,7 @@ namespace think { namespace byte_buffer {
     template<typename val_type, typename buf_type>
     struct buf_get {
       static inline val_type get(const buf_type* src, int64_t src_offset ) {
-	return static_cast<val_type>(src[src_offset]);
+	return convert_value<val_type>(src[src_offset]);
       }
     };
 
@@ -101,15 +141,16 @@ namespace think { namespace byte_buffer {
 	dst += dst_offset;
 	switch(n_elems) {
 	case 1:
-	  dst[0] = (dst_type)value;
+	  dst[0] = convert_value<dst_type>(value);
 	  break;
 	default:
 	  if (0 == value) {
 	    memset(dst, 0, n_elems * sizeof(dst_type));
 	  }
 	  else {
+	    dst_type converted = convert_value<dst_type>(value);
 	    for( int64_t idx = 0; idx < n_elems; ++idx )
-	      dst[idx] = (dst_type)value;
+	      dst[idx] = converted;
 	  }
 	}
       }
@@ -144,28 +185,285 @@ namespace think { namespace byte_buffer {
       case Datatype::Long: return op((typename datatype_to_type<Datatype::Long>::TType*)data);
       case Datatype::Float: return op((typename datatype_to_type<Datatype::Float>::TType*)data);
       case Datatype::Double: return op((typename datatype_to_type<Datatype::Double>::TType*)data);
+      //Bits are not addressable; the copies and accessors handle them before
+      //getting here.
+      case Datatype::Bit: throw runtime_error("operation not supported on bit buffers");
       };
       throw exception();
       return TRetType();
     }
+  }
+}
+
+#include "byte_buffer_elementwise.hpp"
+#include "byte_buffer_expression.hpp"
+#include "byte_buffer_hash.hpp"
+#include "byte_buffer_permute.hpp"
+#include "byte_buffer_interleave.hpp"
+#include "byte_buffer_codec.hpp"
+#include "byte_buffer_compress.hpp"
+#include "byte_buffer_quantize.hpp"
+#include "byte_buffer_sort.hpp"
+#include "byte_buffer_select.hpp"
+#include "byte_buffer_scan.hpp"
+#include "byte_buffer_histogram.hpp"
+#include "byte_buffer_checksum.hpp"
+#include "byte_buffer_linalg.hpp"
+#include "byte_buffer_gemm.hpp"
+#include "byte_buffer_statistics.hpp"
+#include "byte_buffer_nonfinite.hpp"
+#include "byte_buffer_mask.hpp"
+
+namespace think { namespace byte_buffer {
+
+    //Every buffer handed out by the manager is recorded along with how to give
+    //it back and how many owners it has.  Views are plain addresses inside a
+    //buffer; retaining one adds an owner to the buffer containing it.
+    struct allocation_record
+    {
+      struct Kind {
+	enum Enum {
+	  Heap = 0,
+	  Mapped,
+	  File,
+	  Shared,
+	};
+      };
+      Kind::Enum kind;
+      //Bytes addressable from the buffer address.
+      int64_t size;
+      //Start and length of the underlying mapping.
+      void* base;
+      int64_t length;
+      //Descriptor kept open for shared buffers, -1 otherwise.
+      int fd;
+      int64_t ref_count;
+      //Copy on write file mappings, whose written pages belong to this
+      //process alone.
+      bool private_pages;
+      //Shared buffers attached without write access.
+      bool read_only;
+    };
 
     struct BufferManagerImpl : public BufferManager
     {
+      //Guards the allocation map, including the reference counts held in it.
+      mutex m_allocation_lock;
+      map<int64_t, allocation_record> m_allocations;
+      unique_ptr<thread_pool> m_pool;
+      once_flag m_pool_created;
+
       BufferManagerImpl(){}
       virtual ~BufferManagerImpl(){}
+
+      //Workers are started the first time a kernel wants them.
+      thread_pool& pool()
+      {
+	call_once(m_pool_created, [this]() {
+	    int n_threads = (int) thread::hardware_concurrency();
+	    m_pool.reset(new thread_pool(std::max(0, n_threads - 1)));
+	  });
+	return *m_pool;
+      }
+
+      int64_t add_allocation( int64_t data, allocation_record::Kind::Enum kind, int64_t size,
+			      void* base, int64_t length, int fd, bool private_pages = false,
+			      bool read_only = false )
+      {
+	lock_guard<mutex> guard(m_allocation_lock);
+	m_allocations[data] = allocation_record { kind, size, base, length, fd, 1,
+						  private_pages, read_only };
+	return data;
+      }
+      //Find the buffer containing an address.  Callers hold the allocation lock.
+      map<int64_t, allocation_record>::iterator find_allocation( int64_t data )
+      {
+	auto iter = m_allocations.upper_bound(data);
+	if (iter == m_allocations.begin())
+	  throw runtime_error("unknown buffer");
+	--iter;
+	if (data > iter->first + iter->second.size)
+	  throw runtime_error("unknown buffer");
+	return iter;
+      }
+      static void free_allocation( int64_t data, const allocation_record& record )
+      {
+	if (record.kind == allocation_record::Kind::Heap) {
+	  free((void*)data);
+	  return;
+	}
+	munmap(record.base, record.length);
+	if (record.fd >= 0)
+	  close(record.fd);
+      }
+
       virtual int64_t allocate_buffer( int64_t size, const char* file, int line )
       {
-	return reinterpret_cast<int64_t>(malloc(size));
+	void* data = malloc(size);
+	if (data == nullptr)
+	  throw runtime_error("malloc failed");
+	return add_allocation(reinterpret_cast<int64_t>(data), allocation_record::Kind::Heap,
+			      size, data, size, -1);
+      }
+      virtual int64_t allocate_buffer( int64_t size, AllocationPolicy::Enum policy, int32_t node,
+				       const char* file, int line )
+      {
+	int64_t length = round_up_to_page(size);
+	void* base = allocate_numa_memory(length, policy, node);
+	return add_allocation(reinterpret_cast<int64_t>(base), allocation_record::Kind::Mapped,
+			      size, base, length, -1);
+      }
+      virtual int64_t map_file( const char* path, MapMode::Enum mode, int64_t offset, int64_t size )
+      {
+	file_mapping mapping = map_file_memory(path, mode, offset, size);
+	int64_t base = reinterpret_cast<int64_t>(mapping.base);
+	return add_allocation(mapping.data, allocation_record::Kind::File,
+			      base + mapping.length - mapping.data,
+			      mapping.base, mapping.length, -1, mode == MapMode::CopyOnWrite);
+      }
+      int64_t add_shared_mapping( const shared_mapping& mapping )
+      {
+	int64_t base = reinterpret_cast<int64_t>(mapping.base);
+	return add_allocation(mapping.data, allocation_record::Kind::Shared,
+			      base + mapping.length - mapping.data,
+			      mapping.base, mapping.length, mapping.fd, false, mapping.read_only);
+      }
+      //The shared mapping holding data, which may be a view into it.
+      allocation_record find_shared_mapping( int64_t data )
+      {
+	lock_guard<mutex> guard(m_allocation_lock);
+	auto iter = find_allocation(data);
+	if (iter->second.kind != allocation_record::Kind::Shared)
+	  throw runtime_error("not a shared buffer");
+	return iter->second;
+      }
+      virtual int64_t allocate_shared_buffer( const char* name, int64_t size )
+      {
+	return add_shared_mapping(create_shared_memory(name, size));
+      }
+      virtual int64_t attach_shared_buffer( const char* name, bool read_only )
+      {
+	return add_shared_mapping(attach_shared_memory(name, read_only));
+      }
+      virtual int64_t attach_shared_buffer( int32_t fd, bool read_only )
+      {
+	return add_shared_mapping(attach_shared_memory((int) fd, read_only));
+      }
+      virtual int32_t shared_buffer_fd( int64_t data )
+      {
+	return find_shared_mapping(data).fd;
+      }
+      virtual void unlink_shared_buffer( const char* name )
+      {
+	if (shm_unlink(name) != 0)
+	  throw runtime_error(string("failed to unlink shared buffer ") + name);
+      }
+      virtual void set_shared_metadata( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems )
+      {
+	allocation_record record = find_shared_mapping(data);
+	if (record.read_only)
+	  throw runtime_error("shared buffer is attached read only");
+	write_shared_metadata(shared_header(record.base), type, offset, n_elems);
+      }
+      virtual void get_shared_metadata( int64_t data, int64_t* metadata )
+      {
+	read_shared_metadata(shared_header(find_shared_mapping(data).base), metadata);
+      }
+      //The file or shared mapping holding [data + offset, data + offset +
+      //size); data may be a view into it.  Only these have pages backed by
+      //something other than the process itself for flush and advise to act
+      //on.
+      allocation_record find_file_mapping( int64_t data, int64_t offset, int64_t size )
+      {
+	lock_guard<mutex> guard(m_allocation_lock);
+	auto iter = find_allocation(data);
+	if (iter->second.kind != allocation_record::Kind::File
+	    && iter->second.kind != allocation_record::Kind::Shared)
+	  throw runtime_error("not a file or shared mapping");
+	if (offset < 0 || size < 0 || data + offset + size > iter->first + iter->second.size)
+	  throw runtime_error("range outside of the mapping");
+	return iter->second;
+      }
+      virtual void flush_buffer( int64_t data, int64_t offset, int64_t size, bool async )
+      {
+	find_file_mapping(data, offset, size);
+	flush_memory(data, offset, size, async);
+      }
+      virtual void advise_buffer( int64_t data, int64_t offset, int64_t size, AccessAdvice::Enum advice )
+      {
+	allocation_record record = find_file_mapping(data, offset, size);
+	if (advice == AccessAdvice::DontNeed && record.private_pages)
+	  throw runtime_error("dont need would discard the writes of a private mapping");
+	advise_memory(data, offset, size, advice);
+      }
+      virtual int64_t resize_buffer( int64_t data, int64_t new_size )
+      {
+	if (new_size <= 0)
+	  throw runtime_error("invalid buffer size");
+	lock_guard<mutex> guard(m_allocation_lock);
+	auto iter = m_allocations.find(data);
+	if (iter == m_allocations.end())
+	  throw runtime_error("unknown buffer");
+	allocation_record record = iter->second;
+	if (record.ref_count > 1)
+	  throw runtime_error("buffers with live views cannot be resized");
+	void* new_data;
+	switch(record.kind) {
+	case allocation_record::Kind::Heap:
+	  //glibc serves large blocks with their own mapping and grows those with
+	  //mremap as well.
+	  new_data = realloc((void*)data, new_size);
+	  if (new_data == nullptr)
+	    throw runtime_error("realloc failed");
+	  record.length = new_size;
+	  break;
+	case allocation_record::Kind::Mapped:
+	  record.length = round_up_to_page(new_size);
+	  //The new pages inherit the mapping's memory policy.
+	  new_data = mremap(record.base, iter->second.length, record.length, MREMAP_MAYMOVE);
+	  if (new_data == MAP_FAILED)
+	    throw runtime_error("mremap failed");
+	  break;
+	case allocation_record::Kind::File:
+	  throw runtime_error("file mappings cannot be resized");
+	default:
+	  throw runtime_error("shared buffers cannot be resized");
+	}
+	m_allocations.erase(iter);
+	record.base = new_data;
+	record.size = new_size;
+	m_allocations[reinterpret_cast<int64_t>(new_data)] = record;
+	return reinterpret_cast<int64_t>(new_data);
+      }
+      virtual void retain_buffer( int64_t data )
+      {
+	lock_guard<mutex> guard(m_allocation_lock);
+	++find_allocation(data)->second.ref_count;
       }
       virtual void release_buffer( int64_t data)
       {
-	free((void*)data);
+	allocation_record record;
+	{
+	  lock_guard<mutex> guard(m_allocation_lock);
+	  auto iter = find_allocation(data);
+	  if (--iter->second.ref_count > 0)
+	    return;
+	  data = iter->first;
+	  record = iter->second;
+	  m_allocations.erase(iter);
+	}
+	free_allocation(data, record);
       }
 
       template<typename dst_type>
       void buffer_to_data( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
 		 dst_type* dst, int64_t dst_offset, int64_t n_elems )
       {
+	if (src_type == Datatype::Bit) {
+	  unpack_bits(pool(), reinterpret_cast<const uint8_t*>(src_data), src_offset,
+		      dst + dst_offset, n_elems);
+	  return;
+	}
 	typed_buffer_op<void>(src_data, src_type,
 			      [=](auto src_ptr) {
 				do_copy(src_ptr, src_offset, dst, dst_offset, n_elems);
@@ -204,6 +502,11 @@ namespace think { namespace byte_buffer {
 			   int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
 			   int64_t n_elems )
       {
+	if (dst_type == Datatype::Bit) {
+	  pack_bits(pool(), src + src_offset, reinterpret_cast<uint8_t*>(dst_data), dst_offset,
+		    n_elems);
+	  return;
+	}
 	typed_buffer_op<void>(dst_data, dst_type,
 			      [=](auto dst_ptr) {
 				do_copy(src, src_offset, dst_ptr, dst_offset, n_elems);
@@ -238,6 +541,23 @@ namespace think { namespace byte_buffer {
 
       virtual void copy( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
 			 int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset, int64_t n_elems ) {
+	if (src_type == Datatype::Bit && dst_type == Datatype::Bit) {
+	  copy_bits(pool(), reinterpret_cast<const uint8_t*>(src_data), src_offset,
+		    reinterpret_cast<uint8_t*>(dst_data), dst_offset, n_elems);
+	  return;
+	}
+	if (src_type == Datatype::Bit) {
+	  typed_buffer_op<void>(dst_data, dst_type, [=](auto dst_ptr) {
+	      buffer_to_data(src_data, src_type, src_offset, dst_ptr, dst_offset, n_elems);
+	    });
+	  return;
+	}
+	if (dst_type == Datatype::Bit) {
+	  typed_buffer_op<void>(src_data, src_type, [=](auto src_ptr) {
+	      data_to_buffer(src_ptr, src_offset, dst_data, dst_type, dst_offset, n_elems);
+	    });
+	  return;
+	}
 	typed_buffer_op<void>(src_data, src_type, [=](auto src_ptr) {
 	    typed_buffer_op<void>(dst_data, dst_type, [=](auto dst_ptr) {
 		do_copy(src_ptr, src_offset,
@@ -249,6 +569,10 @@ namespace think { namespace byte_buffer {
 
       template<typename src_type>
       void set_buffer_value( int64_t dst_data, Datatype::Enum dst_type, int64_t offset, src_type value, int64_t n_elems ) {
+	if (dst_type == Datatype::Bit) {
+	  fill_bits(pool(), reinterpret_cast<uint8_t*>(dst_data), offset, value != 0, n_elems);
+	  return;
+	}
 	typed_buffer_op<void>(dst_data, dst_type,
 			      [=](auto dst_ptr) {
 				do_set(dst_ptr, offset, value, n_elems);
@@ -278,6 +602,8 @@ namespace think { namespace byte_buffer {
       template<typename dst_type>
       dst_type get_buffer_value( int64_t src_data, Datatype::Enum src_type, int64_t offset )
       {
+	if (src_type == Datatype::Bit)
+	  return (dst_type) load_bits(reinterpret_cast<const uint8_t*>(src_data), offset, 1);
 	return typed_buffer_op<dst_type>(src_data, src_type,
 					 [=](auto src_ptr) {
 					   return do_get<dst_type>(src_ptr, offset);
@@ -303,6 +629,471 @@ namespace think { namespace byte_buffer {
 	return get_buffer_value<double>( src_data, src_type, offset );
       }
 
+      virtual double reduce( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems,
+			     ReduceOp::Enum op ) {
+	return typed_buffer_op<double>(data, type, [=](auto src_ptr) {
+	    return reduce_range(pool(), src_ptr + offset, n_elems, op);
+	  });
+      }
+      virtual int64_t argmin( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems ) {
+	return typed_buffer_op<int64_t>(data, type, [=](auto src_ptr) {
+	    return reduce_arg_extreme<typename remove_pointer<decltype(src_ptr)>::type, true>
+	      (pool(), src_ptr + offset, n_elems);
+	  });
+      }
+      virtual int64_t argmax( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems ) {
+	return typed_buffer_op<int64_t>(data, type, [=](auto src_ptr) {
+	    return reduce_arg_extreme<typename remove_pointer<decltype(src_ptr)>::type, false>
+	      (pool(), src_ptr + offset, n_elems);
+	  });
+      }
+
+      virtual void binary_op( int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+			      int64_t rhs_data, Datatype::Enum rhs_type, int64_t rhs_offset,
+			      int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			      int64_t n_elems, BinaryOp::Enum op ) {
+	buffer_range lhs = { lhs_data, lhs_type, lhs_offset };
+	buffer_range rhs = { rhs_data, rhs_type, rhs_offset };
+	buffer_range dst = { dst_data, dst_type, dst_offset };
+	compute_type_op<void>(promote(lhs_type, rhs_type, dst_type), [&](auto ctype_ptr) {
+	    binary_kernel<typename remove_pointer<decltype(ctype_ptr)>::type>
+	      (pool(), op, lhs, rhs, dst, n_elems);
+	  });
+      }
+      virtual void scalar_op( int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+			      double scalar,
+			      int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			      int64_t n_elems, BinaryOp::Enum op ) {
+	buffer_range lhs = { lhs_data, lhs_type, lhs_offset };
+	buffer_range dst = { dst_data, dst_type, dst_offset };
+	compute_type_op<void>(promote_scalar(promote(lhs_type, dst_type), scalar), [&](auto ctype_ptr) {
+	    scalar_kernel<typename remove_pointer<decltype(ctype_ptr)>::type>
+	      (pool(), op, lhs, scalar, dst, n_elems);
+	  });
+      }
+      virtual void unary_op( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			     int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			     int64_t n_elems, UnaryOp::Enum op ) {
+	buffer_range src = { src_data, src_type, src_offset };
+	buffer_range dst = { dst_data, dst_type, dst_offset };
+	ComputeType::Enum compute_type = promote(src_type, dst_type);
+	if (compute_type == ComputeType::Long && (op == UnaryOp::Sqrt || op == UnaryOp::Exp))
+	  compute_type = ComputeType::Double;
+	compute_type_op<void>(compute_type, [&](auto ctype_ptr) {
+	    unary_kernel<typename remove_pointer<decltype(ctype_ptr)>::type>
+	      (pool(), op, src, dst, n_elems);
+	  });
+      }
+      virtual void clamp( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			  double low, double high,
+			  int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			  int64_t n_elems ) {
+	buffer_range src = { src_data, src_type, src_offset };
+	buffer_range dst = { dst_data, dst_type, dst_offset };
+	ComputeType::Enum compute_type = promote_scalar(promote_scalar(promote(src_type, dst_type),
+								       low), high);
+	compute_type_op<void>(compute_type, [&](auto ctype_ptr) {
+	    clamp_kernel<typename remove_pointer<decltype(ctype_ptr)>::type>
+	      (pool(), src, low, high, dst, n_elems);
+	  });
+      }
+      virtual void axpy( double alpha, int64_t x_data, Datatype::Enum x_type, int64_t x_offset,
+			 int64_t y_data, Datatype::Enum y_type, int64_t y_offset,
+			 int64_t n_elems ) {
+	buffer_range x = { x_data, x_type, x_offset };
+	buffer_range y = { y_data, y_type, y_offset };
+	compute_type_op<void>(promote_scalar(promote(x_type, y_type), alpha), [&](auto ctype_ptr) {
+	    axpy_kernel<typename remove_pointer<decltype(ctype_ptr)>::type>
+	      (pool(), alpha, x, y, n_elems);
+	  });
+      }
+
+      virtual void evaluate_expression( const int64_t* input_datas, const int32_t* input_types,
+					const int64_t* input_offsets, int32_t n_inputs,
+					const int32_t* ops, const double* operands, int32_t n_ops,
+					int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+					int64_t n_elems ) {
+	if (n_inputs < 1)
+	  throw runtime_error("expression has no inputs");
+	vector<buffer_range> inputs;
+	for ( int32_t idx = 0; idx < n_inputs; ++idx )
+	  inputs.push_back(buffer_range { input_datas[idx], (Datatype::Enum) input_types[idx],
+					  input_offsets[idx] });
+	vector<expression_stage> stages = decode_stages(ops, operands, n_ops);
+	buffer_range dst = { dst_data, dst_type, dst_offset };
+	compute_type_op<void>(expression_compute_type(inputs, dst_type), [&](auto ctype_ptr) {
+	    expression_kernel<typename remove_pointer<decltype(ctype_ptr)>::type>
+	      (pool(), stages, inputs, dst, n_elems);
+	  });
+      }
+
+      virtual int64_t hash_range( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems,
+				  int64_t seed ) {
+	int64_t elem_size = datatype_size(type);
+	return (int64_t) xxh64((const unsigned char*) data + offset * elem_size,
+			       n_elems * elem_size, (uint64_t) seed);
+      }
+      virtual bool equals_range( int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+				 int64_t rhs_data, Datatype::Enum rhs_type, int64_t rhs_offset,
+				 int64_t n_elems, bool nan_equal ) {
+	return equal_ranges(buffer_range { lhs_data, lhs_type, lhs_offset },
+			    buffer_range { rhs_data, rhs_type, rhs_offset },
+			    n_elems, nan_equal);
+      }
+
+      virtual void permute_copy( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				 const int64_t* shape, const int64_t* src_strides,
+				 const int32_t* permutation, int32_t n_dims,
+				 int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset ) {
+	vector<permute_dim> dims = permuted_dims(shape, src_strides, permutation, n_dims);
+	typed_buffer_op<void>(src_data, src_type, [&](auto src_ptr) {
+	    typed_buffer_op<void>(dst_data, dst_type, [&](auto dst_ptr) {
+		permute_copy_typed(pool(), src_ptr + src_offset, dst_ptr + dst_offset, dims);
+	      });
+	  });
+      }
+
+      virtual void deinterleave( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				 int32_t n_channels, const int64_t* dst_datas,
+				 const int64_t* dst_offsets, Datatype::Enum dst_type,
+				 int64_t n_elems ) {
+	if (n_channels <= 0)
+	  throw runtime_error("invalid channel count");
+	typed_buffer_op<void>(src_data, src_type, [&](auto src_ptr) {
+	    typed_buffer_op<void>(0, dst_type, [&](auto dst_type_ptr) {
+		typedef typename remove_pointer<decltype(dst_type_ptr)>::type dst_dtype;
+		vector<dst_dtype*> planes;
+		for ( int32_t channel = 0; channel < n_channels; ++channel )
+		  planes.push_back(reinterpret_cast<dst_dtype*>(dst_datas[channel])
+				   + dst_offsets[channel]);
+		deinterleave_typed(pool(), src_ptr + src_offset, n_channels, planes, n_elems);
+	      });
+	  });
+      }
+      virtual void interleave( const int64_t* src_datas, const int64_t* src_offsets,
+			       Datatype::Enum src_type, int32_t n_channels,
+			       int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			       int64_t n_elems ) {
+	if (n_channels <= 0)
+	  throw runtime_error("invalid channel count");
+	typed_buffer_op<void>(0, src_type, [&](auto src_type_ptr) {
+	    typedef typename remove_pointer<decltype(src_type_ptr)>::type src_dtype;
+	    vector<const src_dtype*> planes;
+	    for ( int32_t channel = 0; channel < n_channels; ++channel )
+	      planes.push_back(reinterpret_cast<const src_dtype*>(src_datas[channel])
+			       + src_offsets[channel]);
+	    typed_buffer_op<void>(dst_data, dst_type, [&](auto dst_ptr) {
+		interleave_typed(pool(), planes, n_channels, dst_ptr + dst_offset, n_elems);
+	      });
+	  });
+      }
+
+      virtual void bit_op( int64_t lhs_data, int64_t lhs_offset,
+			   int64_t rhs_data, int64_t rhs_offset,
+			   int64_t dst_data, int64_t dst_offset,
+			   int64_t n_bits, BitOp::Enum op ) {
+	bit_op_kernel(pool(), op, reinterpret_cast<const uint8_t*>(lhs_data), lhs_offset,
+		      reinterpret_cast<const uint8_t*>(rhs_data), rhs_offset,
+		      reinterpret_cast<uint8_t*>(dst_data), dst_offset, n_bits);
+      }
+      virtual int64_t popcount( int64_t data, int64_t offset, int64_t n_bits ) {
+	return popcount_bits(pool(), reinterpret_cast<const uint8_t*>(data), offset, n_bits);
+      }
+
+      virtual int64_t max_encoded_size( IntegerCodec::Enum codec, int64_t n_elems ) {
+	return max_encoded_integers_size(codec, n_elems);
+      }
+      virtual int64_t encode_integers( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				       int64_t n_elems, IntegerCodec::Enum codec,
+				       int64_t dst_data, int64_t dst_capacity ) {
+	return encode_integer_range(buffer_range { src_data, src_type, src_offset }, n_elems, codec,
+				    reinterpret_cast<uint8_t*>(dst_data), dst_capacity);
+      }
+      virtual int64_t decoded_count( int64_t src_data, int64_t src_size ) {
+	return read_integer_header(reinterpret_cast<const uint8_t*>(src_data), src_size).n_elems;
+      }
+      virtual int64_t decode_integers( int64_t src_data, int64_t src_size,
+				       int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+				       int64_t dst_capacity ) {
+	return decode_integer_range(reinterpret_cast<const uint8_t*>(src_data), src_size,
+				    buffer_range { dst_data, dst_type, dst_offset }, dst_capacity);
+      }
+
+      virtual int64_t max_compressed_size( Datatype::Enum type, int64_t n_elems, int64_t block_bytes ) {
+	return max_compressed_bytes(n_elems, datatype_size(type), block_bytes);
+      }
+      virtual int64_t compress_buffer( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				       int64_t n_elems, int64_t block_bytes, bool shuffle,
+				       int64_t dst_data, int64_t dst_capacity ) {
+	return compress_blocks_range(pool(), buffer_range { src_data, src_type, src_offset },
+				     n_elems, block_bytes, shuffle,
+				     reinterpret_cast<uint8_t*>(dst_data), dst_capacity);
+      }
+      virtual Datatype::Enum compressed_datatype( int64_t src_data, int64_t src_size ) {
+	return (Datatype::Enum) read_compressed_header(reinterpret_cast<const uint8_t*>(src_data),
+						       src_size).datatype;
+      }
+      virtual int64_t compressed_count( int64_t src_data, int64_t src_size ) {
+	return read_compressed_header(reinterpret_cast<const uint8_t*>(src_data), src_size).n_elems;
+      }
+      virtual int64_t decompress_buffer( int64_t src_data, int64_t src_size,
+					 int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+					 int64_t dst_capacity ) {
+	return decompress_blocks_range(pool(), reinterpret_cast<const uint8_t*>(src_data), src_size,
+				       buffer_range { dst_data, dst_type, dst_offset }, dst_capacity);
+      }
+
+      virtual void calibrate_quantization( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+					   int64_t n_elems, int64_t n_channels, int64_t inner_size,
+					   QuantScheme::Enum scheme, bool is_signed, double percentile,
+					   double* scales, int32_t* zero_points ) {
+	quant_layout layout { n_channels, inner_size };
+	check_quant_layout(layout);
+	real_buffer_op(src_data, src_type, [&](auto* src) {
+	    calibrate_typed(pool(), src + src_offset, n_elems, layout, scheme, is_signed, percentile,
+			    scales, zero_points);
+	  });
+      }
+      virtual void quantize( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			     int64_t n_elems, int64_t n_channels, int64_t inner_size,
+			     const double* scales, const int32_t* zero_points,
+			     int64_t dst_data, int64_t dst_offset, bool is_signed ) {
+	quant_layout layout { n_channels, inner_size };
+	check_quant_layout(layout);
+	real_buffer_op(src_data, src_type, [&](auto* src) {
+	    quantized_buffer_op(dst_data, is_signed, [&](auto* dst) {
+		quantize_typed(pool(), src + src_offset, dst + dst_offset, n_elems, layout,
+			       scales, zero_points);
+	      });
+	  });
+      }
+      virtual void dequantize( int64_t src_data, int64_t src_offset, bool is_signed,
+			       int64_t n_elems, int64_t n_channels, int64_t inner_size,
+			       const double* scales, const int32_t* zero_points,
+			       int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset ) {
+	quant_layout layout { n_channels, inner_size };
+	check_quant_layout(layout);
+	quantized_buffer_op(src_data, is_signed, [&](auto* src) {
+	    real_buffer_op(dst_data, dst_type, [&](auto* dst) {
+		dequantize_typed(pool(), src + src_offset, dst + dst_offset, n_elems, layout,
+				 scales, zero_points);
+	      });
+	  });
+      }
+
+      virtual void sort( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems,
+			 bool descending, int64_t index_data, Datatype::Enum index_type,
+			 int64_t index_offset ) {
+	if (index_data == 0) {
+	  sort_range(pool(), data, type, offset, n_elems, descending, true, (int64_t*) nullptr);
+	  return;
+	}
+	index_buffer_op(index_data, index_type, n_elems, [&](auto* indices) {
+	    sort_range(pool(), data, type, offset, n_elems, descending, true, indices + index_offset);
+	  });
+      }
+      virtual void argsort( int64_t data, Datatype::Enum type, int64_t offset, int64_t n_elems,
+			    bool descending, int64_t index_data, Datatype::Enum index_type,
+			    int64_t index_offset ) {
+	index_buffer_op(index_data, index_type, n_elems, [&](auto* indices) {
+	    sort_range(pool(), data, type, offset, n_elems, descending, false, indices + index_offset);
+	  });
+      }
+
+      virtual void top_k( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			  int64_t n_elems, int64_t k, bool largest,
+			  int64_t values_data, Datatype::Enum values_type, int64_t values_offset,
+			  int64_t index_data, Datatype::Enum index_type, int64_t index_offset ) {
+	top_k_range(pool(), buffer_range { src_data, src_type, src_offset }, n_elems, k, largest,
+		    buffer_range { values_data, values_type, values_offset },
+		    buffer_range { index_data, index_type, index_offset });
+      }
+
+      virtual void scan( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			 int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			 int64_t n_elems, bool exclusive ) {
+	buffer_range src = { src_data, src_type, src_offset };
+	buffer_range dst = { dst_data, dst_type, dst_offset };
+	compute_type_op<void>(promote(src_type, dst_type), [&](auto ctype_ptr) {
+	    scan_kernel<typename remove_pointer<decltype(ctype_ptr)>::type>
+	      (pool(), src, dst, n_elems, exclusive);
+	  });
+      }
+
+      virtual void histogram( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			      int64_t n_elems, int64_t n_bins, double low, double high,
+			      int64_t* counts ) {
+	typed_buffer_op<void>(src_data, src_type, [&](auto src_ptr) {
+	    uniform_histogram_typed(pool(), src_ptr + src_offset, n_elems, n_bins, low, high, counts);
+	  });
+      }
+      virtual void histogram( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			      int64_t n_elems, const double* edges, int64_t n_edges,
+			      int64_t* counts ) {
+	typed_buffer_op<void>(src_data, src_type, [&](auto src_ptr) {
+	    edge_histogram_typed(pool(), src_ptr + src_offset, n_elems, edges, n_edges, counts);
+	  });
+      }
+      virtual int64_t bincount( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				int64_t n_elems, int64_t n_bins, int64_t* counts ) {
+	return typed_buffer_op<int64_t>(src_data, src_type, [&](auto src_ptr) {
+	    return bincount_typed(pool(), src_ptr + src_offset, n_elems, n_bins, counts);
+	  });
+      }
+
+      virtual int64_t checksum_range( int64_t data, Datatype::Enum type, int64_t offset,
+				      int64_t n_elems, ChecksumType::Enum checksum,
+				      int64_t seed ) {
+	return (int64_t) range_checksum(pool(), buffer_range { data, type, offset }, n_elems,
+					checksum, (uint64_t) seed);
+      }
+      virtual int64_t copy_with_checksum( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+					  int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+					  int64_t n_elems, ChecksumType::Enum checksum,
+					  int64_t seed ) {
+	return (int64_t) copy_range_with_checksum(pool(), buffer_range { src_data, src_type, src_offset },
+						  buffer_range { dst_data, dst_type, dst_offset },
+						  n_elems, checksum, (uint64_t) seed);
+      }
+
+      virtual double dot( int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+			  int64_t rhs_data, Datatype::Enum rhs_type, int64_t rhs_offset,
+			  int64_t n_elems ) {
+	return dot_ranges(pool(), buffer_range { lhs_data, lhs_type, lhs_offset },
+			  buffer_range { rhs_data, rhs_type, rhs_offset }, n_elems);
+      }
+      virtual double norm( int64_t data, Datatype::Enum type, int64_t offset,
+			   int64_t n_elems, NormType::Enum norm ) {
+	return norm_range(pool(), buffer_range { data, type, offset }, n_elems, norm);
+      }
+      virtual double cosine_similarity( int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+					int64_t rhs_data, Datatype::Enum rhs_type, int64_t rhs_offset,
+					int64_t n_elems ) {
+	return cosine_similarity_ranges(pool(), buffer_range { lhs_data, lhs_type, lhs_offset },
+					buffer_range { rhs_data, rhs_type, rhs_offset }, n_elems);
+      }
+      virtual void gemv( int64_t a_data, Datatype::Enum a_type, int64_t a_offset,
+			 int64_t n_rows, int64_t n_cols, int64_t lda, bool transpose,
+			 int64_t x_data, Datatype::Enum x_type, int64_t x_offset, int64_t x_stride,
+			 int64_t y_data, Datatype::Enum y_type, int64_t y_offset, int64_t y_stride,
+			 int64_t n_vectors ) {
+	gemv_ranges(pool(), buffer_range { a_data, a_type, a_offset }, n_rows, n_cols, lda, transpose,
+		    buffer_range { x_data, x_type, x_offset }, x_stride,
+		    buffer_range { y_data, y_type, y_offset }, y_stride, n_vectors);
+      }
+
+      virtual void gemm( bool trans_a, bool trans_b, int64_t m, int64_t n, int64_t k, double alpha,
+			 int64_t a_data, Datatype::Enum a_type, int64_t a_offset, int64_t lda,
+			 int64_t b_data, Datatype::Enum b_type, int64_t b_offset, int64_t ldb,
+			 double beta,
+			 int64_t c_data, Datatype::Enum c_type, int64_t c_offset, int64_t ldc ) {
+	gemm_ranges(pool(), trans_a, trans_b, m, n, k, alpha,
+		    buffer_range { a_data, a_type, a_offset }, lda,
+		    buffer_range { b_data, b_type, b_offset }, ldb, beta,
+		    buffer_range { c_data, c_type, c_offset }, ldc);
+      }
+
+      virtual void accumulate_statistics( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+					  int64_t n_elems, double* state ) {
+	accumulate_statistics_range(pool(), buffer_range { src_data, src_type, src_offset },
+				    n_elems, state);
+      }
+      virtual void accumulate_statistics( const uint8_t* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) {
+	accumulate_statistics_range(pool(), buffer_range { (int64_t) src, Datatype::Byte, src_offset },
+				    n_elems, state);
+      }
+      virtual void accumulate_statistics( const int16_t* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) {
+	accumulate_statistics_range(pool(), buffer_range { (int64_t) src, Datatype::Short, src_offset },
+				    n_elems, state);
+      }
+      virtual void accumulate_statistics( const int32_t* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) {
+	accumulate_statistics_range(pool(), buffer_range { (int64_t) src, Datatype::Int, src_offset },
+				    n_elems, state);
+      }
+      virtual void accumulate_statistics( const int64_t* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) {
+	accumulate_statistics_range(pool(), buffer_range { (int64_t) src, Datatype::Long, src_offset },
+				    n_elems, state);
+      }
+      virtual void accumulate_statistics( const float* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) {
+	accumulate_statistics_range(pool(), buffer_range { (int64_t) src, Datatype::Float, src_offset },
+				    n_elems, state);
+      }
+      virtual void accumulate_statistics( const double* src, int64_t src_offset, int64_t n_elems,
+					  double* state ) {
+	accumulate_statistics_range(pool(), buffer_range { (int64_t) src, Datatype::Double, src_offset },
+				    n_elems, state);
+      }
+      virtual void merge_statistics( double* state, const double* other ) {
+	think::byte_buffer::merge_statistics(*reinterpret_cast<running_statistics*>(state),
+					     *reinterpret_cast<const running_statistics*>(other));
+      }
+
+      virtual int64_t count_nonfinite( int64_t data, Datatype::Enum type, int64_t offset,
+				       int64_t n_elems ) {
+	return typed_buffer_op<int64_t>(data, type, [&](auto ptr) {
+	    return count_nonfinite_typed(pool(), ptr + offset, n_elems);
+	  });
+      }
+      virtual int64_t find_first_nonfinite( int64_t data, Datatype::Enum type, int64_t offset,
+					    int64_t n_elems ) {
+	return typed_buffer_op<int64_t>(data, type, [&](auto ptr) {
+	    return find_first_nonfinite_typed(pool(), ptr + offset, n_elems);
+	  });
+      }
+      virtual int64_t replace_nonfinite( int64_t data, Datatype::Enum type, int64_t offset,
+					 int64_t n_elems, double value ) {
+	return typed_buffer_op<int64_t>(data, type, [&](auto ptr) {
+	    return replace_nonfinite_typed(pool(), ptr + offset, n_elems, value);
+	  });
+      }
+      virtual void copy_with_nan_policy( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+					 int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+					 int64_t n_elems, NanPolicy::Enum policy, double nan_value ) {
+	copy_with_nan_policy_range(pool(), buffer_range { src_data, src_type, src_offset },
+				   buffer_range { dst_data, dst_type, dst_offset }, n_elems,
+				   policy, nan_value);
+      }
+
+      virtual void copy_masked( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				int64_t mask_data, int64_t mask_offset,
+				int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+				int64_t n_elems ) {
+	copy_masked_range(pool(), buffer_range { src_data, src_type, src_offset },
+			  reinterpret_cast<const uint8_t*>(mask_data), mask_offset,
+			  buffer_range { dst_data, dst_type, dst_offset }, n_elems);
+      }
+      virtual int64_t compress( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+				int64_t mask_data, int64_t mask_offset,
+				int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+				int64_t n_elems ) {
+	return compress_masked_range(pool(), buffer_range { src_data, src_type, src_offset },
+				     reinterpret_cast<const uint8_t*>(mask_data), mask_offset,
+				     buffer_range { dst_data, dst_type, dst_offset }, n_elems);
+      }
+      virtual int64_t expand( int64_t src_data, Datatype::Enum src_type, int64_t src_offset,
+			      int64_t mask_data, int64_t mask_offset,
+			      int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			      int64_t n_elems ) {
+	return expand_masked_range(pool(), buffer_range { src_data, src_type, src_offset },
+				   reinterpret_cast<const uint8_t*>(mask_data), mask_offset,
+				   buffer_range { dst_data, dst_type, dst_offset }, n_elems);
+      }
+      virtual void where( int64_t mask_data, int64_t mask_offset,
+			  int64_t lhs_data, Datatype::Enum lhs_type, int64_t lhs_offset,
+			  int64_t rhs_data, Datatype::Enum rhs_type, int64_t rhs_offset,
+			  int64_t dst_data, Datatype::Enum dst_type, int64_t dst_offset,
+			  int64_t n_elems ) {
+	where_range(pool(), reinterpret_cast<const uint8_t*>(mask_data), mask_offset,
+		    buffer_range { lhs_data, lhs_type, lhs_offset },
+		    buffer_range { rhs_data, rhs_type, rhs_offset },
+		    buffer_range { dst_data, dst_type, dst_offset }, n_elems);
+      }
+
       virtual void release_manager() {
 	delete this;
       }
@@ -0,0 +1,475 @@
+#ifndef BYTE_BUFFER_INTERLEAVE_HPP
+#define BYTE_BUFFER_INTERLEAVE_HPP
+#include <vector>
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_cpu.hpp"
+#include "byte_buffer_elementwise.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef BYTE_BUFFER_X86_DISPATCH
+#include <tmmintrin.h>
+#endif
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //The SIMD shuffles move raw bits of the element width, so one set of
+    //kernels serves every datatype of that width.  They only touch memory
+    //through the intrinsics; the scalar loops copy with memcpy.
+    template<int size> struct bits_type {};
+    template<> struct bits_type<1> { typedef uint8_t TType; };
+    template<> struct bits_type<2> { typedef uint16_t TType; };
+    template<> struct bits_type<4> { typedef uint32_t TType; };
+    template<> struct bits_type<8> { typedef uint64_t TType; };
+
+    //Groups handled per block when values are converted on the way through.
+    static const int64_t interleave_block = 256;
+
+    //SIMD prefixes of the split and merge, keyed on the bits type of the
+    //element width.  Each returns the number of groups it handled and leaves
+    //the rest to the scalar loop.
+    template<typename dtype, int n_channels>
+    struct channel_shuffle
+    {
+      static int64_t split( const dtype*, dtype* const*, int64_t ) { return 0; }
+      static int64_t merge( const dtype* const*, dtype*, int64_t ) { return 0; }
+    };
+
+#ifdef __SSE2__
+    template<>
+    struct channel_shuffle<uint32_t, 2>
+    {
+      static int64_t split( const uint32_t* src, uint32_t* const* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 4;
+	for ( int64_t idx = 0; idx < n_simd; idx += 4 ) {
+	  __m128 a = _mm_loadu_ps((const float*) (src + 2 * idx));
+	  __m128 b = _mm_loadu_ps((const float*) (src + 2 * idx + 4));
+	  _mm_storeu_ps((float*) (dst[0] + idx), _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+	  _mm_storeu_ps((float*) (dst[1] + idx), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	return n_simd;
+      }
+      static int64_t merge( const uint32_t* const* src, uint32_t* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 4;
+	for ( int64_t idx = 0; idx < n_simd; idx += 4 ) {
+	  __m128 x = _mm_loadu_ps((const float*) (src[0] + idx));
+	  __m128 y = _mm_loadu_ps((const float*) (src[1] + idx));
+	  _mm_storeu_ps((float*) (dst + 2 * idx), _mm_unpacklo_ps(x, y));
+	  _mm_storeu_ps((float*) (dst + 2 * idx + 4), _mm_unpackhi_ps(x, y));
+	}
+	return n_simd;
+      }
+    };
+
+    //Four xyz groups are three vectors: x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3.
+    template<>
+    struct channel_shuffle<uint32_t, 3>
+    {
+      static int64_t split( const uint32_t* src, uint32_t* const* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 4;
+	for ( int64_t idx = 0; idx < n_simd; idx += 4 ) {
+	  __m128 a = _mm_loadu_ps((const float*) (src + 3 * idx));
+	  __m128 b = _mm_loadu_ps((const float*) (src + 3 * idx + 4));
+	  __m128 c = _mm_loadu_ps((const float*) (src + 3 * idx + 8));
+	  __m128 x2x3 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2));
+	  __m128 x = _mm_shuffle_ps(a, x2x3, _MM_SHUFFLE(2, 0, 3, 0));
+	  __m128 y0y1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1));
+	  __m128 y2y3 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3));
+	  __m128 y = _mm_shuffle_ps(y0y1, y2y3, _MM_SHUFFLE(2, 0, 2, 0));
+	  __m128 z0z1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2));
+	  __m128 z2z3 = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0));
+	  __m128 z = _mm_shuffle_ps(z0z1, z2z3, _MM_SHUFFLE(2, 0, 2, 0));
+	  _mm_storeu_ps((float*) (dst[0] + idx), x);
+	  _mm_storeu_ps((float*) (dst[1] + idx), y);
+	  _mm_storeu_ps((float*) (dst[2] + idx), z);
+	}
+	return n_simd;
+      }
+      static int64_t merge( const uint32_t* const* src, uint32_t* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 4;
+	for ( int64_t idx = 0; idx < n_simd; idx += 4 ) {
+	  __m128 x = _mm_loadu_ps((const float*) (src[0] + idx));
+	  __m128 y = _mm_loadu_ps((const float*) (src[1] + idx));
+	  __m128 z = _mm_loadu_ps((const float*) (src[2] + idx));
+	  __m128 x0y0x1y1 = _mm_unpacklo_ps(x, y);
+	  __m128 z0x1 = _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0));
+	  __m128 y1z1 = _mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1));
+	  __m128 x2y2 = _mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 2, 2, 2));
+	  __m128 z2x3 = _mm_shuffle_ps(z, x, _MM_SHUFFLE(3, 3, 2, 2));
+	  __m128 y3z3 = _mm_shuffle_ps(y, z, _MM_SHUFFLE(3, 3, 3, 3));
+	  _mm_storeu_ps((float*) (dst + 3 * idx),
+			_mm_shuffle_ps(x0y0x1y1, z0x1, _MM_SHUFFLE(2, 0, 1, 0)));
+	  _mm_storeu_ps((float*) (dst + 3 * idx + 4),
+			_mm_shuffle_ps(y1z1, x2y2, _MM_SHUFFLE(2, 0, 2, 0)));
+	  _mm_storeu_ps((float*) (dst + 3 * idx + 8),
+			_mm_shuffle_ps(z2x3, y3z3, _MM_SHUFFLE(2, 0, 2, 0)));
+	}
+	return n_simd;
+      }
+    };
+
+    //Four groups of four channels are a 4x4 transpose either way.
+    template<>
+    struct channel_shuffle<uint32_t, 4>
+    {
+      static int64_t split( const uint32_t* src, uint32_t* const* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 4;
+	for ( int64_t idx = 0; idx < n_simd; idx += 4 ) {
+	  __m128 r0 = _mm_loadu_ps((const float*) (src + 4 * idx));
+	  __m128 r1 = _mm_loadu_ps((const float*) (src + 4 * idx + 4));
+	  __m128 r2 = _mm_loadu_ps((const float*) (src + 4 * idx + 8));
+	  __m128 r3 = _mm_loadu_ps((const float*) (src + 4 * idx + 12));
+	  _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	  _mm_storeu_ps((float*) (dst[0] + idx), r0);
+	  _mm_storeu_ps((float*) (dst[1] + idx), r1);
+	  _mm_storeu_ps((float*) (dst[2] + idx), r2);
+	  _mm_storeu_ps((float*) (dst[3] + idx), r3);
+	}
+	return n_simd;
+      }
+      static int64_t merge( const uint32_t* const* src, uint32_t* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 4;
+	for ( int64_t idx = 0; idx < n_simd; idx += 4 ) {
+	  __m128 r0 = _mm_loadu_ps((const float*) (src[0] + idx));
+	  __m128 r1 = _mm_loadu_ps((const float*) (src[1] + idx));
+	  __m128 r2 = _mm_loadu_ps((const float*) (src[2] + idx));
+	  __m128 r3 = _mm_loadu_ps((const float*) (src[3] + idx));
+	  _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	  _mm_storeu_ps((float*) (dst + 4 * idx), r0);
+	  _mm_storeu_ps((float*) (dst + 4 * idx + 4), r1);
+	  _mm_storeu_ps((float*) (dst + 4 * idx + 8), r2);
+	  _mm_storeu_ps((float*) (dst + 4 * idx + 12), r3);
+	}
+	return n_simd;
+      }
+    };
+
+    template<>
+    struct channel_shuffle<uint64_t, 2>
+    {
+      static int64_t split( const uint64_t* src, uint64_t* const* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 2;
+	for ( int64_t idx = 0; idx < n_simd; idx += 2 ) {
+	  __m128i a = _mm_loadu_si128((const __m128i*) (src + 2 * idx));
+	  __m128i b = _mm_loadu_si128((const __m128i*) (src + 2 * idx + 2));
+	  _mm_storeu_si128((__m128i*) (dst[0] + idx), _mm_unpacklo_epi64(a, b));
+	  _mm_storeu_si128((__m128i*) (dst[1] + idx), _mm_unpackhi_epi64(a, b));
+	}
+	return n_simd;
+      }
+      static int64_t merge( const uint64_t* const* src, uint64_t* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 2;
+	for ( int64_t idx = 0; idx < n_simd; idx += 2 ) {
+	  __m128i x = _mm_loadu_si128((const __m128i*) (src[0] + idx));
+	  __m128i y = _mm_loadu_si128((const __m128i*) (src[1] + idx));
+	  _mm_storeu_si128((__m128i*) (dst + 2 * idx), _mm_unpacklo_epi64(x, y));
+	  _mm_storeu_si128((__m128i*) (dst + 2 * idx + 2), _mm_unpackhi_epi64(x, y));
+	}
+	return n_simd;
+      }
+    };
+
+    //Bytes are split by masking and shifting within wider lanes and packing
+    //the lanes back down; they are merged with the byte and word unpacks.
+    template<>
+    struct channel_shuffle<uint8_t, 2>
+    {
+      static int64_t split( const uint8_t* src, uint8_t* const* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 16;
+	__m128i low_bytes = _mm_set1_epi16(0xFF);
+	for ( int64_t idx = 0; idx < n_simd; idx += 16 ) {
+	  __m128i a = _mm_loadu_si128((const __m128i*) (src + 2 * idx));
+	  __m128i b = _mm_loadu_si128((const __m128i*) (src + 2 * idx + 16));
+	  __m128i even = _mm_packus_epi16(_mm_and_si128(a, low_bytes), _mm_and_si128(b, low_bytes));
+	  __m128i odd = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+	  _mm_storeu_si128((__m128i*) (dst[0] + idx), even);
+	  _mm_storeu_si128((__m128i*) (dst[1] + idx), odd);
+	}
+	return n_simd;
+      }
+      static int64_t merge( const uint8_t* const* src, uint8_t* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 16;
+	for ( int64_t idx = 0; idx < n_simd; idx += 16 ) {
+	  __m128i x = _mm_loadu_si128((const __m128i*) (src[0] + idx));
+	  __m128i y = _mm_loadu_si128((const __m128i*) (src[1] + idx));
+	  _mm_storeu_si128((__m128i*) (dst + 2 * idx), _mm_unpacklo_epi8(x, y));
+	  _mm_storeu_si128((__m128i*) (dst + 2 * idx + 16), _mm_unpackhi_epi8(x, y));
+	}
+	return n_simd;
+      }
+    };
+
+    template<>
+    struct channel_shuffle<uint8_t, 4>
+    {
+      static int64_t split( const uint8_t* src, uint8_t* const* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 16;
+	__m128i low_byte = _mm_set1_epi32(0xFF);
+	for ( int64_t idx = 0; idx < n_simd; idx += 16 ) {
+	  __m128i v[4];
+	  for ( int part = 0; part < 4; ++part )
+	    v[part] = _mm_loadu_si128((const __m128i*) (src + 4 * idx + 16 * part));
+	  for ( int channel = 0; channel < 4; ++channel ) {
+	    __m128i c[4];
+	    for ( int part = 0; part < 4; ++part )
+	      c[part] = _mm_and_si128(_mm_srli_epi32(v[part], 8 * channel), low_byte);
+	    //Values are below 256 so the signed saturating word pack is exact.
+	    __m128i lo = _mm_packs_epi32(c[0], c[1]);
+	    __m128i hi = _mm_packs_epi32(c[2], c[3]);
+	    _mm_storeu_si128((__m128i*) (dst[channel] + idx), _mm_packus_epi16(lo, hi));
+	  }
+	}
+	return n_simd;
+      }
+      static int64_t merge( const uint8_t* const* src, uint8_t* dst, int64_t n_groups )
+      {
+	int64_t n_simd = n_groups - n_groups % 16;
+	for ( int64_t idx = 0; idx < n_simd; idx += 16 ) {
+	  __m128i x = _mm_loadu_si128((const __m128i*) (src[0] + idx));
+	  __m128i y = _mm_loadu_si128((const __m128i*) (src[1] + idx));
+	  __m128i z = _mm_loadu_si128((const __m128i*) (src[2] + idx));
+	  __m128i w = _mm_loadu_si128((const __m128i*) (src[3] + idx));
+	  __m128i xy_lo = _mm_unpacklo_epi8(x, y);
+	  __m128i xy_hi = _mm_unpackhi_epi8(x, y);
+	  __m128i zw_lo = _mm_unpacklo_epi8(z, w);
+	  __m128i zw_hi = _mm_unpackhi_epi8(z, w);
+	  _mm_storeu_si128((__m128i*) (dst + 4 * idx), _mm_unpacklo_epi16(xy_lo, zw_lo));
+	  _mm_storeu_si128((__m128i*) (dst + 4 * idx + 16), _mm_unpackhi_epi16(xy_lo, zw_lo));
+	  _mm_storeu_si128((__m128i*) (dst + 4 * idx + 32), _mm_unpacklo_epi16(xy_hi, zw_hi));
+	  _mm_storeu_si128((__m128i*) (dst + 4 * idx + 48), _mm_unpackhi_epi16(xy_hi, zw_hi));
+	}
+	return n_simd;
+      }
+    };
+#endif
+
+#ifdef BYTE_BUFFER_X86_DISPATCH
+    //Sixteen groups of three bytes are three vectors.  Each output vector
+    //gathers its bytes from all three inputs with one byte shuffle apiece,
+    //a mask byte with the high bit set producing zero.
+    struct rgb_shuffles
+    {
+      uint8_t split[3][3][16];
+      uint8_t merge[3][3][16];
+
+      rgb_shuffles()
+      {
+	for ( int channel = 0; channel < 3; ++channel ) {
+	  for ( int part = 0; part < 3; ++part ) {
+	    for ( int idx = 0; idx < 16; ++idx ) {
+	      int src_byte = 3 * idx + channel - 16 * part;
+	      split[channel][part][idx] = src_byte >= 0 && src_byte < 16 ? src_byte : 0x80;
+	      int dst_byte = 16 * part + idx;
+	      merge[part][channel][idx] = dst_byte % 3 == channel ? dst_byte / 3 : 0x80;
+	    }
+	  }
+	}
+      }
+    };
+
+    inline const rgb_shuffles& rgb_shuffle_masks()
+    {
+      static const rgb_shuffles retval;
+      return retval;
+    }
+
+    __attribute__((target("ssse3")))
+    inline int64_t split_rgb_ssse3( const uint8_t* src, uint8_t* const* dst, int64_t n_groups )
+    {
+      const rgb_shuffles& masks = rgb_shuffle_masks();
+      int64_t n_simd = n_groups - n_groups % 16;
+      for ( int64_t idx = 0; idx < n_simd; idx += 16 ) {
+	__m128i v[3];
+	for ( int part = 0; part < 3; ++part )
+	  v[part] = _mm_loadu_si128((const __m128i*) (src + 3 * idx + 16 * part));
+	for ( int channel = 0; channel < 3; ++channel ) {
+	  __m128i result = _mm_setzero_si128();
+	  for ( int part = 0; part < 3; ++part )
+	    result = _mm_or_si128(result, _mm_shuffle_epi8(
+		       v[part], _mm_loadu_si128((const __m128i*) masks.split[channel][part])));
+	  _mm_storeu_si128((__m128i*) (dst[channel] + idx), result);
+	}
+      }
+      return n_simd;
+    }
+
+    __attribute__((target("ssse3")))
+    inline int64_t merge_rgb_ssse3( const uint8_t* const* src, uint8_t* dst, int64_t n_groups )
+    {
+      const rgb_shuffles& masks = rgb_shuffle_masks();
+      int64_t n_simd = n_groups - n_groups % 16;
+      for ( int64_t idx = 0; idx < n_simd; idx += 16 ) {
+	__m128i v[3];
+	for ( int channel = 0; channel < 3; ++channel )
+	  v[channel] = _mm_loadu_si128((const __m128i*) (src[channel] + idx));
+	for ( int part = 0; part < 3; ++part ) {
+	  __m128i result = _mm_setzero_si128();
+	  for ( int channel = 0; channel < 3; ++channel )
+	    result = _mm_or_si128(result, _mm_shuffle_epi8(
+		       v[channel], _mm_loadu_si128((const __m128i*) masks.merge[part][channel])));
+	  _mm_storeu_si128((__m128i*) (dst + 3 * idx + 16 * part), result);
+	}
+      }
+      return n_simd;
+    }
+
+    template<>
+    struct channel_shuffle<uint8_t, 3>
+    {
+      static int64_t split( const uint8_t* src, uint8_t* const* dst, int64_t n_groups )
+      {
+	return host_cpu().ssse3 ? split_rgb_ssse3(src, dst, n_groups) : 0;
+      }
+      static int64_t merge( const uint8_t* const* src, uint8_t* dst, int64_t n_groups )
+      {
+	return host_cpu().ssse3 ? merge_rgb_ssse3(src, dst, n_groups) : 0;
+      }
+    };
+#endif
+
+    //With the channel count fixed at compile time the scalar loops unroll
+    //and the compiler can vectorize what the shuffles above do not cover.
+    template<typename dtype, int n_channels>
+    inline void split_channels( const dtype* src, dtype* const* dst, int64_t n_groups )
+    {
+      typedef typename bits_type<sizeof(dtype)>::TType bits;
+      dtype* planes[n_channels];
+      bits* bit_planes[n_channels];
+      for ( int channel = 0; channel < n_channels; ++channel ) {
+	planes[channel] = dst[channel];
+	bit_planes[channel] = (bits*) dst[channel];
+      }
+      int64_t idx = channel_shuffle<bits, n_channels>::split((const bits*) src, bit_planes,
+							     n_groups);
+      for ( ; idx < n_groups; ++idx )
+	for ( int channel = 0; channel < n_channels; ++channel )
+	  memcpy(planes[channel] + idx, src + idx * n_channels + channel, sizeof(dtype));
+    }
+
+    template<typename dtype, int n_channels>
+    inline void merge_channels( const dtype* const* src, dtype* dst, int64_t n_groups )
+    {
+      typedef typename bits_type<sizeof(dtype)>::TType bits;
+      const dtype* planes[n_channels];
+      const bits* bit_planes[n_channels];
+      for ( int channel = 0; channel < n_channels; ++channel ) {
+	planes[channel] = src[channel];
+	bit_planes[channel] = (const bits*) src[channel];
+      }
+      int64_t idx = channel_shuffle<bits, n_channels>::merge(bit_planes, (bits*) dst, n_groups);
+      for ( ; idx < n_groups; ++idx )
+	for ( int channel = 0; channel < n_channels; ++channel )
+	  memcpy(dst + idx * n_channels + channel, planes[channel] + idx, sizeof(dtype));
+    }
+
+    template<typename dtype>
+    inline void split_channels( const dtype* src, dtype* const* dst, int32_t n_channels,
+				int64_t n_groups )
+    {
+      switch(n_channels) {
+      case 1: split_channels<dtype, 1>(src, dst, n_groups); break;
+      case 2: split_channels<dtype, 2>(src, dst, n_groups); break;
+      case 3: split_channels<dtype, 3>(src, dst, n_groups); break;
+      case 4: split_channels<dtype, 4>(src, dst, n_groups); break;
+      case 8: split_channels<dtype, 8>(src, dst, n_groups); break;
+      default:
+	for ( int64_t idx = 0; idx < n_groups; ++idx )
+	  for ( int32_t channel = 0; channel < n_channels; ++channel )
+	    memcpy(dst[channel] + idx, src + idx * n_channels + channel, sizeof(dtype));
+      }
+    }
+
+    template<typename dtype>
+    inline void merge_channels( const dtype* const* src, dtype* dst, int32_t n_channels,
+				int64_t n_groups )
+    {
+      switch(n_channels) {
+      case 1: merge_channels<dtype, 1>(src, dst, n_groups); break;
+      case 2: merge_channels<dtype, 2>(src, dst, n_groups); break;
+      case 3: merge_channels<dtype, 3>(src, dst, n_groups); break;
+      case 4: merge_channels<dtype, 4>(src, dst, n_groups); break;
+      case 8: merge_channels<dtype, 8>(src, dst, n_groups); break;
+      default:
+	for ( int64_t idx = 0; idx < n_groups; ++idx )
+	  for ( int32_t channel = 0; channel < n_channels; ++channel )
+	    memcpy(dst + idx * n_channels + channel, src[channel] + idx, sizeof(dtype));
+      }
+    }
+
+    //Split n_groups groups of n_channels interleaved values into planes.
+    //When the types differ each block of groups is first converted, still
+    //interleaved, into the plane type and split from there.
+    template<typename src_type, typename dst_type>
+    inline void deinterleave_typed( thread_pool& pool, const src_type* src, int32_t n_channels,
+				    const vector<dst_type*>& dst, int64_t n_groups )
+    {
+      int64_t n_chunks = chunk_count(pool, n_groups * n_channels, parallel_elementwise_chunk);
+      parallel_chunks(pool, n_groups, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  vector<dst_type> converted;
+	  vector<dst_type*> planes(n_channels);
+	  for ( int64_t pos = begin; pos < end; pos += interleave_block ) {
+	    int64_t count = std::min(interleave_block, end - pos);
+	    for ( int32_t channel = 0; channel < n_channels; ++channel )
+	      planes[channel] = dst[channel] + pos;
+	    const dst_type* groups;
+	    if (is_same<src_type, dst_type>::value) {
+	      groups = (const dst_type*) (src + pos * n_channels);
+	    }
+	    else {
+	      converted.resize(interleave_block * n_channels);
+	      do_copy(src, pos * n_channels, converted.data(), 0, count * n_channels);
+	      groups = converted.data();
+	    }
+	    split_channels(groups, planes.data(), n_channels, count);
+	  }
+	});
+    }
+
+    //Merge planes into n_groups interleaved groups, converting each plane
+    //block into the destination type first when the types differ.
+    template<typename src_type, typename dst_type>
+    inline void interleave_typed( thread_pool& pool, const vector<const src_type*>& src,
+				  int32_t n_channels, dst_type* dst, int64_t n_groups )
+    {
+      int64_t n_chunks = chunk_count(pool, n_groups * n_channels, parallel_elementwise_chunk);
+      parallel_chunks(pool, n_groups, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  vector<dst_type> converted;
+	  vector<const dst_type*> planes(n_channels);
+	  for ( int64_t pos = begin; pos < end; pos += interleave_block ) {
+	    int64_t count = std::min(interleave_block, end - pos);
+	    if (is_same<src_type, dst_type>::value) {
+	      for ( int32_t channel = 0; channel < n_channels; ++channel )
+		planes[channel] = (const dst_type*) (src[channel] + pos);
+	    }
+	    else {
+	      converted.resize(interleave_block * n_channels);
+	      for ( int32_t channel = 0; channel < n_channels; ++channel ) {
+		dst_type* plane = converted.data() + channel * interleave_block;
+		do_copy(src[channel], pos, plane, 0, count);
+		planes[channel] = plane;
+	      }
+	    }
+	    merge_channels(planes.data(), dst + pos * n_channels, n_channels, count);
+	  }
+	});
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,218 @@
+#ifndef BYTE_BUFFER_LINALG_HPP
+#define BYTE_BUFFER_LINALG_HPP
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_reduce.hpp"
+#include "byte_buffer_elementwise.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Vector kernels accept any mix of datatypes and accumulate wider than
+    //their inputs: integer pairs in int64, anything involving a float in
+    //double.  Integer products and sums are done in sum_type (uint64_t) so
+    //that they wrap rather than overflow, and read back as int64.  Products
+    //are summed into reduce_lanes independent accumulators so the loops
+    //vectorize.
+
+    inline ComputeType::Enum accumulate_type( Datatype::Enum lhs, Datatype::Enum rhs )
+    {
+      return promote(lhs, rhs) == ComputeType::Long ? ComputeType::Long : ComputeType::Double;
+    }
+
+    template<typename ctype, typename dtype>
+    inline ctype dot_block( const dtype* lhs, const ctype* rhs, int64_t n_elems )
+    {
+      typedef typename sum_type<ctype>::TType acc_type;
+      acc_type lanes[reduce_lanes] = {0};
+      int64_t n_full = n_elems - n_elems % reduce_lanes;
+      for ( int64_t idx = 0; idx < n_full; idx += reduce_lanes ) {
+	for ( int64_t lane = 0; lane < reduce_lanes; ++lane )
+	  lanes[lane] += (acc_type) lhs[idx + lane] * (acc_type) rhs[idx + lane];
+      }
+      acc_type retval = 0;
+      for ( int64_t idx = n_full; idx < n_elems; ++idx )
+	retval += (acc_type) lhs[idx] * (acc_type) rhs[idx];
+      for ( int64_t lane = 0; lane < reduce_lanes; ++lane )
+	retval += lanes[lane];
+      return (ctype) sum_value(retval);
+    }
+
+    //Run fn(lhs_block, rhs_block, count) over blocks of both ranges converted
+    //to ctype, in parallel chunks, and sum what it returns.
+    template<typename ctype, typename TBlockFn>
+    inline ctype reduce_pair_blocks( thread_pool& pool, buffer_range lhs, buffer_range rhs,
+				     int64_t n_elems, TBlockFn fn )
+    {
+      typedef typename sum_type<ctype>::TType acc_type;
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      vector<acc_type> partials(n_chunks);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  ctype lhs_block[elementwise_block];
+	  ctype rhs_block[elementwise_block];
+	  acc_type sum = 0;
+	  for ( int64_t pos = begin; pos < end; pos += elementwise_block ) {
+	    int64_t count = std::min(elementwise_block, end - pos);
+	    load_block(lhs.data, lhs.type, lhs.offset + pos, lhs_block, count);
+	    load_block(rhs.data, rhs.type, rhs.offset + pos, rhs_block, count);
+	    sum += (acc_type) fn(lhs_block, rhs_block, count);
+	  }
+	  partials[chunk] = sum;
+	});
+      acc_type retval = 0;
+      for ( acc_type partial : partials )
+	retval += partial;
+      return (ctype) sum_value(retval);
+    }
+
+    inline double dot_ranges( thread_pool& pool, buffer_range lhs, buffer_range rhs, int64_t n_elems )
+    {
+      return compute_type_op<double>(accumulate_type(lhs.type, rhs.type), [&](auto ctype_ptr) {
+	  typedef typename remove_pointer<decltype(ctype_ptr)>::type ctype;
+	  return (double) reduce_pair_blocks<ctype>(pool, lhs, rhs, n_elems,
+						    [](const ctype* lhs_block, const ctype* rhs_block,
+						       int64_t count) {
+						      return dot_block(lhs_block, rhs_block, count);
+						    });
+	});
+    }
+
+    //Norms are accumulated in double; any NaN makes the norm NaN.
+    inline double norm_range( thread_pool& pool, buffer_range src, int64_t n_elems,
+			      NormType::Enum norm )
+    {
+      if (norm != NormType::L1 && norm != NormType::L2 && norm != NormType::LInf)
+	throw runtime_error("unknown norm");
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      vector<double> partials(n_chunks);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  double block[elementwise_block];
+	  double lanes[reduce_lanes] = {0};
+	  bool saw_nan = false;
+	  for ( int64_t pos = begin; pos < end; pos += elementwise_block ) {
+	    int64_t count = std::min(elementwise_block, end - pos);
+	    load_block(src.data, src.type, src.offset + pos, block, count);
+	    for ( int64_t idx = 0; idx < count; ++idx ) {
+	      double value = fabs(block[idx]);
+	      double& lane = lanes[idx % reduce_lanes];
+	      if (norm == NormType::L1)
+		lane += value;
+	      else if (norm == NormType::L2)
+		lane += value * value;
+	      else
+		lane = value > lane ? value : lane;
+	      saw_nan |= value != value;
+	    }
+	  }
+	  double retval = 0;
+	  for ( double lane : lanes )
+	    retval = norm == NormType::LInf ? std::max(retval, lane) : retval + lane;
+	  partials[chunk] = saw_nan ? numeric_limits<double>::quiet_NaN() : retval;
+	});
+      double retval = 0;
+      for ( double partial : partials )
+	retval = norm == NormType::LInf
+	  ? (partial != partial || partial > retval ? partial : retval)
+	  : retval + partial;
+      return norm == NormType::L2 ? sqrt(retval) : retval;
+    }
+
+    //Dot product over the product of the L2 norms, in one pass.  NaN when
+    //either vector is zero.
+    inline double cosine_similarity_ranges( thread_pool& pool, buffer_range lhs, buffer_range rhs,
+					    int64_t n_elems )
+    {
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      vector<double> partials(n_chunks * 3);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  double lhs_block[elementwise_block];
+	  double rhs_block[elementwise_block];
+	  double* sums = partials.data() + chunk * 3;
+	  for ( int64_t pos = begin; pos < end; pos += elementwise_block ) {
+	    int64_t count = std::min(elementwise_block, end - pos);
+	    load_block(lhs.data, lhs.type, lhs.offset + pos, lhs_block, count);
+	    load_block(rhs.data, rhs.type, rhs.offset + pos, rhs_block, count);
+	    sums[0] += dot_block(lhs_block, rhs_block, count);
+	    sums[1] += dot_block(lhs_block, lhs_block, count);
+	    sums[2] += dot_block(rhs_block, rhs_block, count);
+	  }
+	});
+      double dot = 0, lhs_sq = 0, rhs_sq = 0;
+      for ( int64_t chunk = 0; chunk < n_chunks; ++chunk ) {
+	dot += partials[chunk * 3];
+	lhs_sq += partials[chunk * 3 + 1];
+	rhs_sq += partials[chunk * 3 + 2];
+      }
+      double denominator = sqrt(lhs_sq) * sqrt(rhs_sq);
+      return denominator > 0 ? dot / denominator : numeric_limits<double>::quiet_NaN();
+    }
+
+    //y = A x for a row major n_rows x n_cols matrix with row stride lda, or
+    //y = x A when transpose is set.  x is converted to the accumulation type
+    //once and each row of A is converted as it is read.  Rows are split
+    //across threads for A x; columns are for x A, each thread accumulating
+    //its columns over every row.
+    template<typename ctype, typename atype>
+    inline void gemv_typed( thread_pool& pool, const atype* a, int64_t n_rows, int64_t n_cols,
+			    int64_t lda, bool transpose, const ctype* x, buffer_range y )
+    {
+      int64_t n_chunks = chunk_count(pool, n_rows * n_cols, parallel_elementwise_chunk);
+      if (!transpose) {
+	n_chunks = std::min(n_chunks, n_rows);
+	parallel_chunks(pool, n_rows, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	    vector<ctype> results(end - begin);
+	    for ( int64_t row = begin; row < end; ++row )
+	      results[row - begin] = dot_block(a + row * lda, x, n_cols);
+	    store_block(results.data(), y.data, y.type, y.offset + begin, end - begin);
+	  });
+      }
+      else {
+	n_chunks = std::min(n_chunks, n_cols);
+	parallel_chunks(pool, n_cols, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	    typedef typename sum_type<ctype>::TType acc_type;
+	    int64_t count = end - begin;
+	    vector<acc_type> sums(count, 0);
+	    acc_type* acc = sums.data();
+	    for ( int64_t row = 0; row < n_rows; ++row ) {
+	      const atype* a_row = a + row * lda + begin;
+	      acc_type scale = (acc_type) x[row];
+	      for ( int64_t idx = 0; idx < count; ++idx )
+		acc[idx] += scale * (acc_type) a_row[idx];
+	    }
+	    vector<ctype> results(count);
+	    for ( int64_t idx = 0; idx < count; ++idx )
+	      results[idx] = (ctype) sum_value(acc[idx]);
+	    store_block(results.data(), y.data, y.type, y.offset + begin, count);
+	  });
+      }
+    }
+
+    inline void gemv_ranges( thread_pool& pool, buffer_range a, int64_t n_rows, int64_t n_cols,
+			     int64_t lda, bool transpose, buffer_range x, int64_t x_stride,
+			     buffer_range y, int64_t y_stride, int64_t n_vectors )
+    {
+      if (n_rows < 0 || n_cols < 0 || n_vectors < 0 || lda < n_cols)
+	throw runtime_error("invalid matrix dimensions");
+      int64_t x_size = transpose ? n_rows : n_cols;
+      compute_type_op<void>(accumulate_type(a.type, x.type), [&](auto ctype_ptr) {
+	  typedef typename remove_pointer<decltype(ctype_ptr)>::type ctype;
+	  vector<ctype> converted(x_size);
+	  typed_buffer_op<void>(a.data, a.type, [&](auto a_ptr) {
+	      for ( int64_t vec = 0; vec < n_vectors; ++vec ) {
+		load_block(x.data, x.type, x.offset + vec * x_stride, converted.data(), x_size);
+		buffer_range y_vec = { y.data, y.type, y.offset + vec * y_stride };
+		gemv_typed(pool, a_ptr + a.offset, n_rows, n_cols, lda, transpose,
+			   (const ctype*) converted.data(), y_vec);
+	      }
+	    });
+	});
+    }
+  }
+}
+
+#endif
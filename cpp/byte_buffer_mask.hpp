@@ -0,0 +1,385 @@
+#ifndef BYTE_BUFFER_MASK_HPP
+#define BYTE_BUFFER_MASK_HPP
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_cpu.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_bits.hpp"
+#include "byte_buffer_elementwise.hpp"
+#include "byte_buffer_interleave.hpp"
+#ifdef BYTE_BUFFER_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Masked kernels take the mask as a bit buffer, bit i selecting element i,
+    //and work a block at a time with the block's mask bits loaded as words.
+    //Compress and expand move elements as raw bits of their size through
+    //block sized scratch, converting to or from the other buffer's datatype
+    //as copy does.  Ranges are split across threads after a popcount pass
+    //gives each chunk where its output (or input) starts.
+    static const int64_t mask_block_words = elementwise_block / bit_word;
+
+    inline void load_mask_words( const uint8_t* mask, int64_t bit_offset, int64_t n_elems,
+				 uint64_t* words )
+    {
+      for ( int64_t word = 0; word * bit_word < n_elems; ++word )
+	words[word] = load_bits(mask, bit_offset + word * bit_word,
+				std::min(bit_word, n_elems - word * bit_word));
+    }
+
+    inline int64_t count_mask_bits( const uint8_t* mask, int64_t bit_offset, int64_t n_elems )
+    {
+      int64_t retval = 0;
+      for ( int64_t pos = 0; pos < n_elems; pos += bit_word )
+	retval += __builtin_popcountll(load_bits(mask, bit_offset + pos,
+						 std::min(bit_word, n_elems - pos)));
+      return retval;
+    }
+
+    inline uint64_t mask_bit( const uint64_t* words, int64_t idx )
+    {
+      return (words[idx / bit_word] >> (idx % bit_word)) & 1;
+    }
+
+    //Every byte value with its bits spread to one byte each, low bit first.
+    struct bit_spread_table
+    {
+      uint64_t spreads[256];
+      bit_spread_table()
+      {
+	for ( int value = 0; value < 256; ++value ) {
+	  spreads[value] = 0;
+	  for ( int bit = 0; bit < 8; ++bit )
+	    spreads[value] |= (uint64_t) ((value >> bit) & 1) << (8 * bit);
+	}
+      }
+    };
+
+    //Mask words as a 0 or 1 byte per element, eight elements per lookup.
+    inline void spread_mask_words( const uint64_t* words, int64_t n_elems, uint8_t* flags )
+    {
+      static const bit_spread_table table;
+      const uint8_t* mask_bytes = reinterpret_cast<const uint8_t*>(words);
+      for ( int64_t byte = 0; byte * 8 < n_elems; ++byte )
+	memcpy(flags + 8 * byte, table.spreads + mask_bytes[byte], 8);
+    }
+
+    //SIMD prefixes of compress and expand, keyed on the bits type of the
+    //element width.  Each returns how many of the n_elems it handled and
+    //advances written (or used) past the packed elements it touched; the
+    //scalar loops below finish the block on the real datatype.
+    template<typename bits_t>
+    struct mask_shuffle
+    {
+      static int64_t compress( const bits_t*, const uint64_t*, int64_t, bits_t*, int64_t& )
+      {
+	return 0;
+      }
+      static int64_t expand( const bits_t*, const uint64_t*, int64_t, bits_t*, int64_t& )
+      {
+	return 0;
+      }
+    };
+
+#ifdef BYTE_BUFFER_X86_DISPATCH
+    //AVX-512 compresses and expands 4 and 8 byte elements a vector at a time
+    //under the mask bits.  Expand loads and stores under the mask, so only
+    //the selected elements of dst are written.
+    __attribute__((target("avx512f")))
+    inline int64_t compress_bits_avx512( const uint32_t* src, const uint64_t* words, int64_t n_elems,
+					 uint32_t* out, int64_t& written )
+    {
+      int64_t idx = 0;
+      for ( ; idx + 16 <= n_elems; idx += 16 ) {
+	__mmask16 selected = (__mmask16) (words[idx / bit_word] >> (idx % bit_word));
+	__m512i values = _mm512_loadu_si512(src + idx);
+	_mm512_storeu_si512(out + written, _mm512_maskz_compress_epi32(selected, values));
+	written += __builtin_popcount(selected);
+      }
+      return idx;
+    }
+
+    __attribute__((target("avx512f")))
+    inline int64_t compress_bits_avx512( const uint64_t* src, const uint64_t* words, int64_t n_elems,
+					 uint64_t* out, int64_t& written )
+    {
+      int64_t idx = 0;
+      for ( ; idx + 8 <= n_elems; idx += 8 ) {
+	__mmask8 selected = (__mmask8) (words[idx / bit_word] >> (idx % bit_word));
+	__m512i values = _mm512_loadu_si512(src + idx);
+	_mm512_storeu_si512(out + written, _mm512_maskz_compress_epi64(selected, values));
+	written += __builtin_popcount(selected);
+      }
+      return idx;
+    }
+
+    __attribute__((target("avx512f")))
+    inline int64_t expand_bits_avx512( const uint32_t* packed, const uint64_t* words, int64_t n_elems,
+				       uint32_t* dst, int64_t& used )
+    {
+      int64_t idx = 0;
+      for ( ; idx + 16 <= n_elems; idx += 16 ) {
+	__mmask16 selected = (__mmask16) (words[idx / bit_word] >> (idx % bit_word));
+	_mm512_mask_storeu_epi32(dst + idx, selected,
+				 _mm512_maskz_expandloadu_epi32(selected, packed + used));
+	used += __builtin_popcount(selected);
+      }
+      return idx;
+    }
+
+    __attribute__((target("avx512f")))
+    inline int64_t expand_bits_avx512( const uint64_t* packed, const uint64_t* words, int64_t n_elems,
+				       uint64_t* dst, int64_t& used )
+    {
+      int64_t idx = 0;
+      for ( ; idx + 8 <= n_elems; idx += 8 ) {
+	__mmask8 selected = (__mmask8) (words[idx / bit_word] >> (idx % bit_word));
+	_mm512_mask_storeu_epi64(dst + idx, selected,
+				 _mm512_maskz_expandloadu_epi64(selected, packed + used));
+	used += __builtin_popcount(selected);
+      }
+      return idx;
+    }
+
+    template<>
+    struct mask_shuffle<uint32_t>
+    {
+      static int64_t compress( const uint32_t* src, const uint64_t* words, int64_t n_elems,
+			       uint32_t* out, int64_t& written )
+      {
+	return host_cpu().avx512f ? compress_bits_avx512(src, words, n_elems, out, written) : 0;
+      }
+      static int64_t expand( const uint32_t* packed, const uint64_t* words, int64_t n_elems,
+			     uint32_t* dst, int64_t& used )
+      {
+	return host_cpu().avx512f ? expand_bits_avx512(packed, words, n_elems, dst, used) : 0;
+      }
+    };
+
+    template<>
+    struct mask_shuffle<uint64_t>
+    {
+      static int64_t compress( const uint64_t* src, const uint64_t* words, int64_t n_elems,
+			       uint64_t* out, int64_t& written )
+      {
+	return host_cpu().avx512f ? compress_bits_avx512(src, words, n_elems, out, written) : 0;
+      }
+      static int64_t expand( const uint64_t* packed, const uint64_t* words, int64_t n_elems,
+			     uint64_t* dst, int64_t& used )
+      {
+	return host_cpu().avx512f ? expand_bits_avx512(packed, words, n_elems, dst, used) : 0;
+      }
+    };
+#endif
+
+    //Selected elements of src to the front of out, which has room for
+    //n_elems + 16; returns how many.  Every element is written and the
+    //output position only advances past selected ones, so there are no
+    //branches to mispredict.
+    template<typename dtype>
+    inline int64_t compress_bits( const dtype* src, const uint64_t* words, int64_t n_elems,
+				  dtype* out )
+    {
+      typedef typename bits_type<sizeof(dtype)>::TType bits;
+      int64_t written = 0;
+      int64_t idx = mask_shuffle<bits>::compress((const bits*) src, words, n_elems,
+						 (bits*) out, written);
+      for ( ; idx < n_elems; ++idx ) {
+	out[written] = src[idx];
+	written += (int64_t) mask_bit(words, idx);
+      }
+      return written;
+    }
+
+    //Selected elements of dst, in order, from the front of packed; returns
+    //how many were used.  Elements that are not selected are not written.
+    template<typename dtype>
+    inline int64_t expand_bits( const dtype* packed, const uint64_t* words, int64_t n_elems,
+				dtype* dst )
+    {
+      typedef typename bits_type<sizeof(dtype)>::TType bits;
+      int64_t used = 0;
+      int64_t idx = mask_shuffle<bits>::expand((const bits*) packed, words, n_elems,
+					       (bits*) dst, used);
+      int64_t first_word = idx / bit_word;
+      for ( int64_t word = first_word; word * bit_word < n_elems; ++word ) {
+	uint64_t selected = words[word];
+	if (word == first_word)
+	  selected &= ~(uint64_t) 0 << (idx % bit_word);
+	for ( ; selected != 0; selected &= selected - 1 )
+	  dst[word * bit_word + __builtin_ctzll(selected)] = packed[used++];
+      }
+      return used;
+    }
+
+    //Where each chunk of [0, n_elems) starts in the packed side of compress
+    //and expand.  A single chunk on one thread saves the counting pass.
+    inline vector<int64_t> packed_chunk_starts( thread_pool& pool, const uint8_t* mask,
+						int64_t mask_offset, int64_t n_elems )
+    {
+      int64_t n_chunks = pool.concurrency() > 1
+	? chunk_count(pool, n_elems, parallel_elementwise_chunk) : 1;
+      vector<int64_t> starts(n_chunks, 0);
+      if (n_chunks > 1) {
+	parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	    starts[chunk] = count_mask_bits(mask, mask_offset + begin, end - begin);
+	  });
+	int64_t start = 0;
+	for ( int64_t& chunk_start : starts ) {
+	  int64_t count = chunk_start;
+	  chunk_start = start;
+	  start += count;
+	}
+      }
+      return starts;
+    }
+
+    //Selected elements of src to the same positions of dst.  Unselected
+    //elements of dst are neither read nor written.  Words with every bit set
+    //copy as a plain loop; the others visit only their set bits.  src and dst
+    //must not overlap unless they are the same range.
+    inline void copy_masked_range( thread_pool& pool, buffer_range src, const uint8_t* mask,
+				   int64_t mask_offset, buffer_range dst, int64_t n_elems )
+    {
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      typed_buffer_op<void>(dst.data, dst.type, [&](auto dst_ptr) {
+	  typedef typename remove_pointer<decltype(dst_ptr)>::type dst_type;
+	  parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	      uint64_t words[mask_block_words];
+	      dst_type block[elementwise_block];
+	      for ( int64_t pos = begin; pos < end; pos += elementwise_block ) {
+		int64_t count = std::min(elementwise_block, end - pos);
+		load_mask_words(mask, mask_offset + pos, count, words);
+		load_block(src.data, src.type, src.offset + pos, block, count);
+		dst_type* out = dst_ptr + dst.offset + pos;
+		for ( int64_t word = 0; word * bit_word < count; ++word ) {
+		  int64_t base = word * bit_word;
+		  uint64_t bits = words[word];
+		  if (bits == ~0ULL) {
+		    for ( int64_t idx = base; idx < base + bit_word; ++idx )
+		      out[idx] = block[idx];
+		    continue;
+		  }
+		  for ( ; bits != 0; bits &= bits - 1 ) {
+		    int64_t idx = base + __builtin_ctzll(bits);
+		    out[idx] = block[idx];
+		  }
+		}
+	      }
+	    });
+	});
+    }
+
+    //Selected elements of src packed to the front of dst; returns how many.
+    //Chunks write their output while others may still be reading theirs, so
+    //a dst overlapping src is compressed on one thread, where every block is
+    //read before any write can reach it.  That only holds when dst starts at
+    //or before src with elements no wider; other overlaps are rejected.
+    inline int64_t compress_masked_range( thread_pool& pool, buffer_range src, const uint8_t* mask,
+					  int64_t mask_offset, buffer_range dst, int64_t n_elems )
+    {
+      int64_t src_size = datatype_size(src.type);
+      int64_t dst_size = datatype_size(dst.type);
+      int64_t src_begin = src.data + src.offset * src_size;
+      int64_t dst_begin = dst.data + dst.offset * dst_size;
+      bool overlap = n_elems > 0 && src_begin < dst_begin + n_elems * dst_size
+	&& dst_begin < src_begin + n_elems * src_size;
+      if (overlap && (dst_begin > src_begin || dst_size > src_size))
+	throw runtime_error("compress destination overlaps the source past its start");
+      vector<int64_t> starts = overlap ? vector<int64_t>(1, 0)
+	: packed_chunk_starts(pool, mask, mask_offset, n_elems);
+      int64_t n_chunks = (int64_t) starts.size();
+      vector<int64_t> counts(n_chunks, 0);
+      typed_buffer_op<void>(src.data, src.type, [&](auto src_ptr) {
+	  typedef typename remove_pointer<decltype(src_ptr)>::type src_type;
+	  parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	      uint64_t words[mask_block_words];
+	      src_type out[elementwise_block + 16];
+	      int64_t out_pos = starts[chunk];
+	      for ( int64_t pos = begin; pos < end; pos += elementwise_block ) {
+		int64_t count = std::min(elementwise_block, end - pos);
+		load_mask_words(mask, mask_offset + pos, count, words);
+		int64_t written = compress_bits(src_ptr + src.offset + pos, words, count, out);
+		store_block(out, dst.data, dst.type, dst.offset + out_pos, written);
+		out_pos += written;
+	      }
+	      counts[chunk] = out_pos - starts[chunk];
+	    });
+	});
+      int64_t retval = 0;
+      for ( int64_t count : counts )
+	retval += count;
+      return retval;
+    }
+
+    //Consecutive elements of src to the selected positions of dst, leaving
+    //the rest of dst alone; returns how many were read from src.
+    inline int64_t expand_masked_range( thread_pool& pool, buffer_range src, const uint8_t* mask,
+					int64_t mask_offset, buffer_range dst, int64_t n_elems )
+    {
+      vector<int64_t> starts = packed_chunk_starts(pool, mask, mask_offset, n_elems);
+      int64_t n_chunks = (int64_t) starts.size();
+      vector<int64_t> counts(n_chunks, 0);
+      typed_buffer_op<void>(dst.data, dst.type, [&](auto dst_ptr) {
+	  typedef typename remove_pointer<decltype(dst_ptr)>::type dst_type;
+	  parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	      uint64_t words[mask_block_words];
+	      dst_type packed[elementwise_block];
+	      int64_t in_pos = starts[chunk];
+	      for ( int64_t pos = begin; pos < end; pos += elementwise_block ) {
+		int64_t count = std::min(elementwise_block, end - pos);
+		load_mask_words(mask, mask_offset + pos, count, words);
+		int64_t n_packed = 0;
+		for ( int64_t word = 0; word * bit_word < count; ++word )
+		  n_packed += __builtin_popcountll(words[word]);
+		load_block(src.data, src.type, src.offset + in_pos, packed, n_packed);
+		expand_bits(packed, words, count, dst_ptr + dst.offset + pos);
+		in_pos += n_packed;
+	      }
+	      counts[chunk] = in_pos - starts[chunk];
+	    });
+	});
+      int64_t retval = 0;
+      for ( int64_t count : counts )
+	retval += count;
+      return retval;
+    }
+
+    //dst[i] = mask bit i ? lhs[i] : rhs[i].  The operands are converted to
+    //dst's datatype a block at a time and the bits spread to a byte per
+    //element so the select vectorizes as a blend.  dst may be either operand.
+    inline void where_range( thread_pool& pool, const uint8_t* mask, int64_t mask_offset,
+			     buffer_range lhs, buffer_range rhs, buffer_range dst, int64_t n_elems )
+    {
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      typed_buffer_op<void>(dst.data, dst.type, [&](auto dst_ptr) {
+	  typedef typename remove_pointer<decltype(dst_ptr)>::type dst_type;
+	  parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	      uint64_t words[mask_block_words];
+	      uint8_t selected[elementwise_block];
+	      dst_type lhs_block[elementwise_block];
+	      dst_type rhs_block[elementwise_block];
+	      for ( int64_t pos = begin; pos < end; pos += elementwise_block ) {
+		int64_t count = std::min(elementwise_block, end - pos);
+		load_mask_words(mask, mask_offset + pos, count, words);
+		spread_mask_words(words, count, selected);
+		load_block(lhs.data, lhs.type, lhs.offset + pos, lhs_block, count);
+		load_block(rhs.data, rhs.type, rhs.offset + pos, rhs_block, count);
+		dst_type* out = dst_ptr + dst.offset + pos;
+		for ( int64_t idx = 0; idx < count; ++idx )
+		  out[idx] = selected[idx] ? lhs_block[idx] : rhs_block[idx];
+	      }
+	    });
+	});
+    }
+  }
+}
+
+#endif
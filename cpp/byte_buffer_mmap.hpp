@@ -0,0 +1,355 @@
+#ifndef BYTE_BUFFER_MMAP_HPP
+#define BYTE_BUFFER_MMAP_HPP
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <cstdint>
+#include <cerrno>
+#include <atomic>
+#include <thread>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "byte_buffer.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    inline int64_t page_size()
+    {
+      return sysconf(_SC_PAGESIZE);
+    }
+
+    inline int64_t round_up_to_page( int64_t size )
+    {
+      int64_t page = page_size();
+      return ((size + page - 1) / page) * page;
+    }
+
+    //A mapping of [base, base + length) of which the caller was handed
+    //data, which lies inside it (mmap offsets have to be page aligned).
+    struct file_mapping
+    {
+      void* base;
+      int64_t length;
+      int64_t data;
+    };
+
+    inline file_mapping map_file_memory( const char* path, MapMode::Enum mode,
+					 int64_t offset, int64_t size )
+    {
+      if (offset < 0)
+	throw runtime_error("invalid file offset");
+      int open_flags = mode == MapMode::ReadWrite ? O_RDWR | O_CREAT : O_RDONLY;
+      int fd = open(path, open_flags | O_CLOEXEC, 0644);
+      if (fd < 0)
+	throw runtime_error(string("failed to open ") + path);
+      struct stat file_stat;
+      if (fstat(fd, &file_stat) != 0) {
+	close(fd);
+	throw runtime_error(string("failed to stat ") + path);
+      }
+      if (size <= 0)
+	size = file_stat.st_size - offset;
+      if (size <= 0) {
+	close(fd);
+	throw runtime_error("nothing to map past the file offset");
+      }
+      if (offset + size > file_stat.st_size) {
+	//Shared writable mappings may extend the file; touching pages of any
+	//other mapping past the end of the file would raise SIGBUS.
+	if (mode != MapMode::ReadWrite || ftruncate(fd, offset + size) != 0) {
+	  close(fd);
+	  throw runtime_error("mapping extends past the end of the file");
+	}
+      }
+      int64_t aligned_offset = offset - (offset % page_size());
+      int64_t length = size + (offset - aligned_offset);
+      int prot = PROT_READ;
+      int flags = MAP_SHARED;
+      switch(mode) {
+      case MapMode::ReadOnly: break;
+      case MapMode::ReadWrite: prot |= PROT_WRITE; break;
+      case MapMode::CopyOnWrite: prot |= PROT_WRITE; flags = MAP_PRIVATE; break;
+      default:
+	close(fd);
+	throw runtime_error("unknown map mode");
+      }
+      void* base = mmap(nullptr, length, prot, flags, fd, aligned_offset);
+      //The mapping holds its own reference to the file.
+      close(fd);
+      if (base == MAP_FAILED)
+	throw runtime_error(string("failed to map ") + path);
+      return file_mapping { base, length,
+	  reinterpret_cast<int64_t>(base) + (offset - aligned_offset) };
+    }
+
+    //msync and madvise want page aligned addresses; widen the range to the
+    //pages it touches.
+    inline void page_range( int64_t data, int64_t offset, int64_t size,
+			    void*& start, int64_t& length )
+    {
+      int64_t begin = data + offset;
+      int64_t aligned = begin - (begin % page_size());
+      start = reinterpret_cast<void*>(aligned);
+      length = size + (begin - aligned);
+    }
+
+    //Narrow the range to the pages it covers entirely, for advice that
+    //discards pages and so must not reach bytes outside of it.  length is
+    //zero when no page is covered.
+    inline void covered_page_range( int64_t data, int64_t offset, int64_t size,
+				    void*& start, int64_t& length )
+    {
+      int64_t page = page_size();
+      int64_t begin = ((data + offset + page - 1) / page) * page;
+      int64_t end = ((data + offset + size) / page) * page;
+      start = reinterpret_cast<void*>(begin);
+      length = std::max((int64_t) 0, end - begin);
+    }
+
+    inline void flush_memory( int64_t data, int64_t offset, int64_t size, bool async )
+    {
+      void* start;
+      int64_t length;
+      page_range(data, offset, size, start, length);
+      if (msync(start, length, async ? MS_ASYNC : MS_SYNC) != 0)
+	throw runtime_error("msync failed");
+    }
+
+    //Callers check that the range lies in a file or shared mapping, and for
+    //DontNeed that the mapping's pages are not private: dropping those
+    //discards writes, where shared pages are read back from the file.
+    inline void advise_memory( int64_t data, int64_t offset, int64_t size,
+			       AccessAdvice::Enum advice )
+    {
+      int native_advice;
+      switch(advice) {
+      case AccessAdvice::Normal: native_advice = MADV_NORMAL; break;
+      case AccessAdvice::Sequential: native_advice = MADV_SEQUENTIAL; break;
+      case AccessAdvice::Random: native_advice = MADV_RANDOM; break;
+      case AccessAdvice::WillNeed: native_advice = MADV_WILLNEED; break;
+      case AccessAdvice::DontNeed: native_advice = MADV_DONTNEED; break;
+      default:
+	throw runtime_error("unknown access advice");
+      }
+      void* start;
+      int64_t length;
+      if (advice == AccessAdvice::DontNeed)
+	covered_page_range(data, offset, size, start, length);
+      else
+	page_range(data, offset, size, start, length);
+      if (length > 0 && madvise(start, length, native_advice) != 0)
+	throw runtime_error("madvise failed");
+    }
+
+    //Shared buffers start with a page holding this header so that every
+    //process attached to the buffer sees the same description of its
+    //contents.  The metadata is guarded by generation as a sequence lock:
+    //odd while a writer is updating it, bumped to the next even value when
+    //done.
+    struct shared_buffer_header
+    {
+      uint64_t magic;
+      int64_t data_size;
+      atomic<int64_t> generation;
+      atomic<int32_t> datatype;
+      atomic<int64_t> offset;
+      atomic<int64_t> elem_count;
+    };
+
+    static const uint64_t shared_buffer_magic = 0x7468696e6b627566ULL;
+
+    struct shared_mapping
+    {
+      void* base;
+      int64_t length;
+      int64_t data;
+      int fd;
+      bool read_only;
+    };
+
+    //Bytes holding n_elems elements of type, -1 for an unknown datatype.
+    inline int64_t shared_byte_count( int32_t type, int64_t n_elems )
+    {
+      switch(type) {
+      case Datatype::Byte: return n_elems;
+      case Datatype::Short: return n_elems * 2;
+      case Datatype::Int: case Datatype::Float: return n_elems * 4;
+      case Datatype::Long: case Datatype::Double: return n_elems * 8;
+      case Datatype::Bit: return (n_elems + 7) / 8;
+      default: return -1;
+      }
+    }
+
+    //The header is written by other processes, so the range it describes
+    //is checked against the data actually mapped before it is used.
+    inline void check_shared_metadata( int32_t type, int64_t offset, int64_t n_elems,
+				       int64_t data_size )
+    {
+      int64_t max_elems = data_size * 8;
+      int64_t byte_count = offset < 0 || n_elems < 0 || offset > max_elems || n_elems > max_elems
+	? -1 : shared_byte_count(type, offset + n_elems);
+      if (byte_count < 0 || byte_count > data_size)
+	throw runtime_error("invalid shared buffer metadata");
+    }
+
+    inline void write_shared_metadata( shared_buffer_header* header, int32_t type,
+				       int64_t offset, int64_t n_elems )
+    {
+      check_shared_metadata(type, offset, n_elems, header->data_size);
+      //Taking the generation from even to odd also excludes other writers.
+      int64_t generation = header->generation.load(memory_order_relaxed);
+      while((generation & 1)
+	    || !header->generation.compare_exchange_weak(generation, generation + 1,
+							 memory_order_acquire)) {
+	this_thread::yield();
+	generation = header->generation.load(memory_order_relaxed);
+      }
+      atomic_thread_fence(memory_order_release);
+      header->datatype.store(type, memory_order_relaxed);
+      header->offset.store(offset, memory_order_relaxed);
+      header->elem_count.store(n_elems, memory_order_relaxed);
+      header->generation.store(generation + 2, memory_order_release);
+    }
+
+    //Fills metadata with {datatype, offset, n_elems, byte size, generation},
+    //retrying until it reads a generation that no writer changed meanwhile.
+    inline void read_shared_metadata( shared_buffer_header* header, int64_t* metadata )
+    {
+      //A writer that died half way leaves the generation odd for good.
+      const int64_t max_attempts = 1 << 20;
+      for ( int64_t attempt = 0; attempt < max_attempts; ++attempt ) {
+	int64_t generation = header->generation.load(memory_order_acquire);
+	if (generation & 1) {
+	  this_thread::yield();
+	  continue;
+	}
+	int32_t type = header->datatype.load(memory_order_relaxed);
+	int64_t offset = header->offset.load(memory_order_relaxed);
+	int64_t n_elems = header->elem_count.load(memory_order_relaxed);
+	atomic_thread_fence(memory_order_acquire);
+	if (header->generation.load(memory_order_relaxed) != generation)
+	  continue;
+	check_shared_metadata(type, offset, n_elems, header->data_size);
+	metadata[0] = type;
+	metadata[1] = offset;
+	metadata[2] = n_elems;
+	metadata[3] = header->data_size;
+	metadata[4] = generation / 2;
+	return;
+      }
+      throw runtime_error("shared buffer metadata is never left consistent");
+    }
+
+    inline shared_mapping map_shared_fd( int fd, bool read_only )
+    {
+      struct stat file_stat;
+      if (fstat(fd, &file_stat) != 0)
+	throw runtime_error("failed to stat shared buffer");
+      int64_t length = file_stat.st_size;
+      if (length < page_size())
+	throw runtime_error("not a shared buffer");
+      int prot = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+      void* base = mmap(nullptr, length, prot, MAP_SHARED, fd, 0);
+      if (base == MAP_FAILED)
+	throw runtime_error("failed to map shared buffer");
+      shared_buffer_header* header = (shared_buffer_header*) base;
+      if (header->magic != shared_buffer_magic
+	  || header->data_size < 0
+	  || header->data_size > length - page_size()) {
+	munmap(base, length);
+	throw runtime_error("not a shared buffer");
+      }
+      try {
+	int64_t metadata[5];
+	read_shared_metadata(header, metadata);
+      }
+      catch(...) {
+	munmap(base, length);
+	throw;
+      }
+      return shared_mapping { base, length,
+	  reinterpret_cast<int64_t>(base) + page_size(), fd, read_only };
+    }
+
+    //An empty name creates an anonymous memfd whose descriptor has to be
+    //passed to the other process; otherwise the buffer is created with
+    //shm_open and can be attached by name.
+    inline shared_mapping create_shared_memory( const char* name, int64_t size )
+    {
+      if (size <= 0)
+	throw runtime_error("invalid allocation size");
+      bool anonymous = name == nullptr || name[0] == 0;
+      int fd = anonymous
+	? memfd_create("think.byte-buffer", MFD_CLOEXEC)
+	: shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+      if (fd < 0)
+	throw runtime_error("failed to create shared buffer");
+      int64_t length = page_size() + round_up_to_page(size);
+      if (ftruncate(fd, length) != 0) {
+	close(fd);
+	if (!anonymous)
+	  shm_unlink(name);
+	throw runtime_error("failed to size shared buffer");
+      }
+      void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (base == MAP_FAILED) {
+	close(fd);
+	if (!anonymous)
+	  shm_unlink(name);
+	throw runtime_error("failed to map shared buffer");
+      }
+      shared_buffer_header* header = new (base) shared_buffer_header();
+      header->data_size = size;
+      header->datatype = Datatype::Byte;
+      header->offset = 0;
+      header->elem_count = size;
+      header->generation = 0;
+      //Written last so an attaching process never sees a half built header.
+      atomic_thread_fence(memory_order_release);
+      header->magic = shared_buffer_magic;
+      return shared_mapping { base, length,
+	  reinterpret_cast<int64_t>(base) + page_size(), fd, false };
+    }
+
+    inline shared_mapping attach_shared_memory( const char* name, bool read_only )
+    {
+      int fd = shm_open(name, read_only ? O_RDONLY : O_RDWR, 0);
+      if (fd < 0)
+	throw runtime_error(string("failed to open shared buffer ") + name);
+      try {
+	return map_shared_fd(fd, read_only);
+      }
+      catch(...) {
+	close(fd);
+	throw;
+      }
+    }
+
+    inline shared_mapping attach_shared_memory( int fd, bool read_only )
+    {
+      //The caller keeps ownership of the descriptor it passed in.
+      int own_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+      if (own_fd < 0)
+	throw runtime_error("invalid shared buffer descriptor");
+      try {
+	return map_shared_fd(own_fd, read_only);
+      }
+      catch(...) {
+	close(own_fd);
+	throw;
+      }
+    }
+
+    //The header page starts the mapping.
+    inline shared_buffer_header* shared_header( void* base )
+    {
+      return reinterpret_cast<shared_buffer_header*>(base);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef BYTE_BUFFER_NONFINITE_HPP
+#define BYTE_BUFFER_NONFINITE_HPP
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <stdexcept>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_elementwise.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //A value is non-finite (NaN or either infinity) exactly when value -
+    //value is not zero.  That is a subtract and compare the compiler turns
+    //into vector compares and masks, so the loops below are branch free and
+    //work a block at a time; integer buffers have no non-finite values.
+    static const int64_t nonfinite_block = 256;
+
+    template<typename dtype>
+    inline int32_t count_nonfinite_block( const dtype* src, int64_t n_elems )
+    {
+      int32_t retval = 0;
+      for ( int64_t idx = 0; idx < n_elems; ++idx )
+	retval += (src[idx] - src[idx]) != 0;
+      return retval;
+    }
+
+    template<typename dtype>
+    inline int64_t count_nonfinite_typed( thread_pool& pool, const dtype* src, int64_t n_elems )
+    {
+      if (!is_floating_point<dtype>::value)
+	return 0;
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      vector<int64_t> counts(n_chunks, 0);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  int64_t count = 0;
+	  for ( int64_t pos = begin; pos < end; pos += nonfinite_block )
+	    count += count_nonfinite_block(src + pos, std::min(nonfinite_block, end - pos));
+	  counts[chunk] = count;
+	});
+      int64_t retval = 0;
+      for ( int64_t count : counts )
+	retval += count;
+      return retval;
+    }
+
+    //Position of the first non-finite value or -1.  Each chunk stops at its
+    //first hit, found by testing whole blocks and only then searching one.
+    template<typename dtype>
+    inline int64_t find_first_nonfinite_typed( thread_pool& pool, const dtype* src, int64_t n_elems )
+    {
+      if (!is_floating_point<dtype>::value)
+	return -1;
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      vector<int64_t> firsts(n_chunks, -1);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  for ( int64_t pos = begin; pos < end; pos += nonfinite_block ) {
+	    int64_t count = std::min(nonfinite_block, end - pos);
+	    if (count_nonfinite_block(src + pos, count) == 0)
+	      continue;
+	    for ( int64_t idx = pos; idx < pos + count; ++idx ) {
+	      if ((src[idx] - src[idx]) != 0) {
+		firsts[chunk] = idx;
+		return;
+	      }
+	    }
+	  }
+	});
+      for ( int64_t first : firsts )
+	if (first >= 0)
+	  return first;
+      return -1;
+    }
+
+    //Overwrite non-finite values with value; returns how many there were.
+    template<typename dtype>
+    inline int64_t replace_nonfinite_typed( thread_pool& pool, dtype* data, int64_t n_elems,
+					    double value )
+    {
+      if (!is_floating_point<dtype>::value)
+	return 0;
+      dtype replacement = (dtype) value;
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      vector<int64_t> counts(n_chunks, 0);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  int64_t count = 0;
+	  for ( int64_t pos = begin; pos < end; pos += nonfinite_block ) {
+	    dtype* block = data + pos;
+	    int64_t block_count = std::min(nonfinite_block, end - pos);
+	    int32_t found = count_nonfinite_block(block, block_count);
+	    if (found == 0)
+	      continue;
+	    count += found;
+	    for ( int64_t idx = 0; idx < block_count; ++idx )
+	      block[idx] = (block[idx] - block[idx]) == 0 ? block[idx] : replacement;
+	  }
+	  counts[chunk] = count;
+	});
+      int64_t retval = 0;
+      for ( int64_t count : counts )
+	retval += count;
+      return retval;
+    }
+
+    //Copy as copy does, except that when float values are converted to an
+    //integer datatype NaN becomes nan_value (Replace) or raises an error
+    //(Throw) instead of becoming zero.  Infinities saturate in every case.
+    //When Throw raises, dst may have been partly written.
+    inline void copy_with_nan_policy_range( thread_pool& pool, buffer_range src, buffer_range dst,
+					    int64_t n_elems, NanPolicy::Enum policy, double nan_value )
+    {
+      if (policy != NanPolicy::Zero && policy != NanPolicy::Replace && policy != NanPolicy::Throw)
+	throw runtime_error("unknown nan policy");
+      bool to_integer = is_float_datatype(src.type) && !is_float_datatype(dst.type);
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      if (!to_integer || policy == NanPolicy::Zero) {
+	typed_buffer_op<void>(src.data, src.type, [&](auto src_ptr) {
+	    typed_buffer_op<void>(dst.data, dst.type, [&](auto dst_ptr) {
+		parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+		    do_copy(src_ptr, src.offset + begin, dst_ptr, dst.offset + begin, end - begin);
+		  });
+	      });
+	  });
+	return;
+      }
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  double block[elementwise_block];
+	  for ( int64_t pos = begin; pos < end; pos += elementwise_block ) {
+	    int64_t count = std::min(elementwise_block, end - pos);
+	    load_block(src.data, src.type, src.offset + pos, block, count);
+	    int any_nan = 0;
+	    for ( int64_t idx = 0; idx < count; ++idx )
+	      any_nan |= block[idx] != block[idx];
+	    if (any_nan) {
+	      if (policy == NanPolicy::Throw)
+		throw runtime_error("nan in float to integer conversion");
+	      for ( int64_t idx = 0; idx < count; ++idx )
+		block[idx] = block[idx] == block[idx] ? block[idx] : nan_value;
+	    }
+	    store_block(block, dst.data, dst.type, dst.offset + pos, count);
+	  }
+	});
+    }
+  }
+}
+
+#endif
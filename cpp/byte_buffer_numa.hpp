@@ -0,0 +1,245 @@
+#ifndef BYTE_BUFFER_NUMA_HPP
+#define BYTE_BUFFER_NUMA_HPP
+#include <vector>
+#include <thread>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <algorithm>
+#include <cstdint>
+#include <cerrno>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "byte_buffer.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Node masks are passed to the kernel as bitsets of this many nodes.
+    static const int64_t max_numa_nodes = 1024;
+    static const int64_t bits_per_mask_word = sizeof(unsigned long) * 8;
+
+    typedef vector<int> cpu_list;
+
+    //Parses the sysfs list format ("0-3,8,10-11").
+    inline vector<int> parse_sysfs_list( const string& data )
+    {
+      vector<int> retval;
+      size_t pos = 0;
+      while( pos < data.size() ) {
+	size_t end = data.find(',', pos);
+	if ( end == string::npos )
+	  end = data.size();
+	string item = data.substr(pos, end - pos);
+	size_t dash = item.find('-');
+	try {
+	  if ( dash == string::npos ) {
+	    retval.push_back(stoi(item));
+	  }
+	  else {
+	    int first = stoi(item.substr(0, dash));
+	    int last = stoi(item.substr(dash + 1));
+	    for ( int idx = first; idx <= last; ++idx )
+	      retval.push_back(idx);
+	  }
+	}
+	catch( const exception& ) {
+	  //Trailing newline or empty list.
+	}
+	pos = end + 1;
+      }
+      return retval;
+    }
+
+    inline vector<int> read_sysfs_list( const string& path )
+    {
+      ifstream input(path);
+      string data;
+      if (!input || !getline(input, data))
+	return vector<int>();
+      return parse_sysfs_list(data);
+    }
+
+    inline vector<int> all_cpus()
+    {
+      vector<int> retval;
+      int n_cpus = std::max(1, (int) thread::hardware_concurrency());
+      for ( int idx = 0; idx < n_cpus; ++idx )
+	retval.push_back(idx);
+      return retval;
+    }
+
+    //Machines (or containers) without sysfs node information are treated as
+    //a single node containing every cpu.
+    inline vector<int> online_numa_nodes()
+    {
+      vector<int> retval = read_sysfs_list("/sys/devices/system/node/online");
+      if (retval.empty())
+	retval.push_back(0);
+      return retval;
+    }
+
+    inline cpu_list numa_node_cpus( int node )
+    {
+      cpu_list retval = read_sysfs_list("/sys/devices/system/node/node"
+					+ to_string(node) + "/cpulist");
+      if (retval.empty() && node == 0)
+	return all_cpus();
+      return retval;
+    }
+
+    inline int current_numa_node()
+    {
+      unsigned cpu = 0;
+      unsigned node = 0;
+      if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+	return 0;
+      return (int) node;
+    }
+
+    //Applies the memory policy to an mmap'd, page aligned range.  Kernels
+    //without NUMA support report ENOSYS (or EPERM inside some containers);
+    //there is only one node to place pages on in that case so the failure is
+    //ignored.
+    inline void bind_memory_policy( void* addr, int64_t length, int mode,
+				    const vector<int>& nodes )
+    {
+      unsigned long mask[max_numa_nodes / bits_per_mask_word] = {0};
+      for ( int node : nodes ) {
+	if (node < 0 || node >= max_numa_nodes)
+	  throw runtime_error("numa node out of range");
+	mask[node / bits_per_mask_word] |= 1UL << (node % bits_per_mask_word);
+      }
+      long result = syscall(SYS_mbind, addr, (unsigned long) length, mode,
+			    mask, (unsigned long) (max_numa_nodes + 1), 0UL);
+      if (result != 0 && errno != ENOSYS && errno != EPERM)
+	throw runtime_error("mbind failed");
+    }
+
+    inline void pin_current_thread( const cpu_list& cpus )
+    {
+      if (cpus.empty())
+	return;
+      cpu_set_t cpu_set;
+      CPU_ZERO(&cpu_set);
+      for ( int cpu : cpus ) {
+	if (cpu >= 0 && cpu < CPU_SETSIZE)
+	  CPU_SET(cpu, &cpu_set);
+      }
+      //Best effort; a restricted cpuset only costs us locality.
+      sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+    }
+
+    //Fault in every page of [data, data + length) by writing to it.  The work
+    //is split into contiguous page ranges, one per worker, and each worker is
+    //pinned to the cpus of one of the target nodes so that pages placed by
+    //first touch (and the page tables themselves) end up local to those
+    //nodes.  Anonymous mappings are already zero so touching one byte per
+    //page is enough.
+    inline void parallel_first_touch( char* data, int64_t length,
+				      const vector<cpu_list>& node_cpus )
+    {
+      const int64_t page_size = sysconf(_SC_PAGESIZE);
+      //Below this amount per worker the thread startup costs more than
+      //faulting in the pages from one thread.
+      const int64_t min_bytes_per_worker = 4 * 1024 * 1024;
+      int64_t n_pages = (length + page_size - 1) / page_size;
+      int64_t max_workers = 0;
+      for ( const cpu_list& cpus : node_cpus )
+	max_workers += (int64_t) cpus.size();
+      int64_t n_workers = std::min(max_workers, length / min_bytes_per_worker);
+      if (n_workers <= 1) {
+	for ( int64_t page = 0; page < n_pages; ++page )
+	  data[page * page_size] = 0;
+	return;
+      }
+      //Workers are dealt round robin across the nodes.
+      vector<cpu_list> worker_cpus;
+      for ( size_t cpu_idx = 0; (int64_t) worker_cpus.size() < n_workers; ++cpu_idx ) {
+	for ( const cpu_list& cpus : node_cpus ) {
+	  if (cpu_idx < cpus.size() && (int64_t) worker_cpus.size() < n_workers)
+	    worker_cpus.push_back(cpus);
+	}
+      }
+      vector<thread> workers;
+      int64_t pages_per_worker = (n_pages + n_workers - 1) / n_workers;
+      int64_t touched_pages = 0;
+      //Thread creation can fail; the pages of workers that never started
+      //are touched here after joining the ones that did, as a joinable
+      //thread must not be destroyed.
+      try {
+	for ( int64_t worker = 0; worker < n_workers; ++worker ) {
+	  int64_t first_page = worker * pages_per_worker;
+	  int64_t last_page = std::min(n_pages, first_page + pages_per_worker);
+	  const cpu_list& cpus = worker_cpus[worker];
+	  workers.emplace_back([=,&cpus]() {
+	      pin_current_thread(cpus);
+	      for ( int64_t page = first_page; page < last_page; ++page )
+		data[page * page_size] = 0;
+	    });
+	  touched_pages = last_page;
+	}
+      }
+      catch( const system_error& ) {
+      }
+      for ( thread& worker : workers )
+	worker.join();
+      for ( int64_t page = touched_pages; page < n_pages; ++page )
+	data[page * page_size] = 0;
+    }
+
+    //mmap a zeroed region placed according to the policy.  node is only
+    //meaningful for the Bind policy; Local places pages on the node of the
+    //calling thread and Interleave spreads them across every online node.
+    inline void* allocate_numa_memory( int64_t length, AllocationPolicy::Enum policy,
+				       int node )
+    {
+      if (length <= 0)
+	throw runtime_error("invalid allocation size");
+      vector<int> nodes;
+      int mode;
+      switch(policy) {
+      case AllocationPolicy::Local:
+	nodes.push_back(current_numa_node());
+	mode = MPOL_PREFERRED;
+	break;
+      case AllocationPolicy::Interleave:
+	nodes = online_numa_nodes();
+	mode = MPOL_INTERLEAVE;
+	break;
+      case AllocationPolicy::Bind: {
+	vector<int> online = online_numa_nodes();
+	if (find(online.begin(), online.end(), node) == online.end())
+	  throw runtime_error("numa node is not online");
+	nodes.push_back(node);
+	mode = MPOL_BIND;
+	break;
+      }
+      default:
+	throw runtime_error("unknown allocation policy");
+      }
+      void* data = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (data == MAP_FAILED)
+	throw runtime_error("mmap failed");
+      try {
+	bind_memory_policy(data, length, mode, nodes);
+	vector<cpu_list> node_cpus;
+	for ( int target : nodes )
+	  node_cpus.push_back(numa_node_cpus(target));
+	parallel_first_touch((char*) data, length, node_cpus);
+      }
+      catch(...) {
+	munmap(data, length);
+	throw;
+      }
+      return data;
+    }
+  }
+}
+
+#endif
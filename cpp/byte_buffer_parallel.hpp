@@ -0,0 +1,152 @@
+#ifndef BYTE_BUFFER_PARALLEL_HPP
+#define BYTE_BUFFER_PARALLEL_HPP
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <cstdint>
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Fixed set of worker threads owned by the buffer manager.  parallel_for
+    //hands out task indexes to the workers and to the calling thread; the
+    //caller keeps taking tasks until none are left so a parallel_for issued
+    //from inside a task cannot deadlock waiting on busy workers.
+    class thread_pool
+    {
+      struct job_state
+      {
+	function<void(int64_t)> fn;
+	int64_t n_tasks;
+	atomic<int64_t> next_task;
+	atomic<int64_t> finished_tasks;
+	mutex lock;
+	condition_variable done;
+	exception_ptr error;
+      };
+
+      vector<thread> m_threads;
+      deque<shared_ptr<job_state> > m_queue;
+      mutex m_lock;
+      condition_variable m_work;
+      bool m_stop;
+
+      static void run_tasks( job_state& job )
+      {
+	int64_t task;
+	while((task = job.next_task.fetch_add(1)) < job.n_tasks) {
+	  try {
+	    job.fn(task);
+	  }
+	  catch(...) {
+	    lock_guard<mutex> guard(job.lock);
+	    if (!job.error)
+	      job.error = current_exception();
+	  }
+	  if (job.finished_tasks.fetch_add(1) + 1 == job.n_tasks) {
+	    lock_guard<mutex> guard(job.lock);
+	    job.done.notify_all();
+	  }
+	}
+      }
+
+      void worker_loop()
+      {
+	while(true) {
+	  shared_ptr<job_state> job;
+	  {
+	    unique_lock<mutex> guard(m_lock);
+	    m_work.wait(guard, [this]() { return m_stop || !m_queue.empty(); });
+	    if (m_queue.empty())
+	      return;
+	    job = m_queue.front();
+	    m_queue.pop_front();
+	  }
+	  run_tasks(*job);
+	}
+      }
+
+    public:
+      explicit thread_pool( int n_threads )
+	: m_stop(false)
+      {
+	for ( int idx = 0; idx < n_threads; ++idx )
+	  m_threads.emplace_back([this]() { worker_loop(); });
+      }
+      ~thread_pool()
+      {
+	{
+	  lock_guard<mutex> guard(m_lock);
+	  m_stop = true;
+	}
+	m_work.notify_all();
+	for ( thread& worker : m_threads )
+	  worker.join();
+      }
+
+      //Workers plus the calling thread.
+      int64_t concurrency() const { return (int64_t) m_threads.size() + 1; }
+
+      template<typename TFn>
+      void parallel_for( int64_t n_tasks, TFn fn )
+      {
+	if (n_tasks <= 0)
+	  return;
+	if (n_tasks == 1 || m_threads.empty()) {
+	  for ( int64_t task = 0; task < n_tasks; ++task )
+	    fn(task);
+	  return;
+	}
+	shared_ptr<job_state> job = make_shared<job_state>();
+	job->fn = fn;
+	job->n_tasks = n_tasks;
+	job->next_task = 0;
+	job->finished_tasks = 0;
+	int64_t n_helpers = std::min((int64_t) m_threads.size(), n_tasks - 1);
+	{
+	  lock_guard<mutex> guard(m_lock);
+	  for ( int64_t idx = 0; idx < n_helpers; ++idx )
+	    m_queue.push_back(job);
+	}
+	if (n_helpers == 1)
+	  m_work.notify_one();
+	else
+	  m_work.notify_all();
+	run_tasks(*job);
+	unique_lock<mutex> guard(job->lock);
+	job->done.wait(guard, [&]() { return job->finished_tasks.load() == n_tasks; });
+	if (job->error)
+	  rethrow_exception(job->error);
+      }
+    };
+
+    //Split [0, n_elems) into contiguous chunks of at least min_chunk elements,
+    //a few per thread so uneven progress balances out, and call
+    //fn(chunk_idx, begin, end) for each.  Returns the number of chunks so
+    //callers can size per chunk result arrays with chunk_count first.
+    inline int64_t chunk_count( thread_pool& pool, int64_t n_elems, int64_t min_chunk )
+    {
+      int64_t max_chunks = pool.concurrency() * 4;
+      return std::max((int64_t) 1, std::min(max_chunks, n_elems / std::max((int64_t) 1, min_chunk)));
+    }
+
+    template<typename TFn>
+    inline void parallel_chunks( thread_pool& pool, int64_t n_elems, int64_t n_chunks, TFn fn )
+    {
+      pool.parallel_for(n_chunks, [=](int64_t chunk) {
+	  int64_t begin = n_elems * chunk / n_chunks;
+	  int64_t end = n_elems * (chunk + 1) / n_chunks;
+	  fn(chunk, begin, end);
+	});
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,309 @@
+#ifndef BYTE_BUFFER_PERMUTE_HPP
+#define BYTE_BUFFER_PERMUTE_HPP
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "byte_buffer.hpp"
+#include "byte_buffer_elementwise.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //One dimension of the destination, described by its extent and the
+    //strides (in elements) it moves through in source and destination.
+    struct permute_dim
+    {
+      int64_t extent;
+      int64_t src_stride;
+      int64_t dst_stride;
+    };
+
+    //Destination dimensions in order with unit dimensions dropped and
+    //neighbours that are also neighbours in the source merged, so e.g. a
+    //contiguous copy collapses to a single dimension.
+    inline vector<permute_dim> permuted_dims( const int64_t* shape, const int64_t* src_strides,
+					      const int32_t* permutation, int32_t n_dims )
+    {
+      vector<bool> seen(n_dims, false);
+      vector<permute_dim> dims;
+      for ( int32_t idx = 0; idx < n_dims; ++idx ) {
+	int32_t src_dim = permutation[idx];
+	if (src_dim < 0 || src_dim >= n_dims || seen[src_dim])
+	  throw runtime_error("invalid permutation");
+	seen[src_dim] = true;
+	if (shape[src_dim] < 0)
+	  throw runtime_error("invalid shape");
+	dims.push_back(permute_dim { shape[src_dim], src_strides[src_dim], 0 });
+      }
+      int64_t dst_stride = 1;
+      for ( int64_t idx = (int64_t) dims.size() - 1; idx >= 0; --idx ) {
+	dims[idx].dst_stride = dst_stride;
+	dst_stride *= dims[idx].extent;
+      }
+      vector<permute_dim> retval;
+      for ( const permute_dim& dim : dims ) {
+	if (dim.extent == 1)
+	  continue;
+	if (!retval.empty()
+	    && retval.back().src_stride == dim.src_stride * dim.extent
+	    && retval.back().dst_stride == dim.dst_stride * dim.extent) {
+	  retval.back().extent *= dim.extent;
+	  retval.back().src_stride = dim.src_stride;
+	  retval.back().dst_stride = dim.dst_stride;
+	}
+	else {
+	  retval.push_back(dim);
+	}
+      }
+      return retval;
+    }
+
+    //Tiles of permute_tile squared elements, transposed through registers.
+    static const int64_t permute_tile = 32;
+
+    template<typename dtype>
+    inline void transpose_tile_scalar( const dtype* src, int64_t src_stride,
+				       dtype* dst, int64_t dst_stride,
+				       int64_t n_rows, int64_t n_cols )
+    {
+      for ( int64_t row = 0; row < n_rows; ++row )
+	for ( int64_t col = 0; col < n_cols; ++col )
+	  dst[col * dst_stride + row] = src[row * src_stride + col];
+    }
+
+    //Transpose an n_rows x n_cols tile: dst[col][row] = src[row][col].
+    template<typename dtype>
+    inline void transpose_tile( const dtype* src, int64_t src_stride,
+				dtype* dst, int64_t dst_stride,
+				int64_t n_rows, int64_t n_cols )
+    {
+      transpose_tile_scalar(src, src_stride, dst, dst_stride, n_rows, n_cols);
+    }
+
+#ifdef __SSE2__
+    //4x4 blocks of 32 bit elements go through the unpack sequence of
+    //_MM_TRANSPOSE4_PS; only bits are moved so this is exact for any 32 bit
+    //type.  Memory is only touched through the vector loads and stores, which
+    //may alias anything, and the edges are copied as dtype.
+    template<typename dtype>
+    inline void transpose_tile_32( const dtype* src, int64_t src_stride,
+				   dtype* dst, int64_t dst_stride,
+				   int64_t n_rows, int64_t n_cols )
+    {
+      static_assert(sizeof(dtype) == 4, "transpose_tile_32 moves 32 bit elements");
+      int64_t full_rows = n_rows - n_rows % 4;
+      int64_t full_cols = n_cols - n_cols % 4;
+      for ( int64_t row = 0; row < full_rows; row += 4 ) {
+	for ( int64_t col = 0; col < full_cols; col += 4 ) {
+	  const dtype* block = src + row * src_stride + col;
+	  __m128 r0 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) (block)));
+	  __m128 r1 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) (block + src_stride)));
+	  __m128 r2 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) (block + 2 * src_stride)));
+	  __m128 r3 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) (block + 3 * src_stride)));
+	  _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	  dtype* out = dst + col * dst_stride + row;
+	  _mm_storeu_si128((__m128i*) (out), _mm_castps_si128(r0));
+	  _mm_storeu_si128((__m128i*) (out + dst_stride), _mm_castps_si128(r1));
+	  _mm_storeu_si128((__m128i*) (out + 2 * dst_stride), _mm_castps_si128(r2));
+	  _mm_storeu_si128((__m128i*) (out + 3 * dst_stride), _mm_castps_si128(r3));
+	}
+      }
+      transpose_tile_scalar(src + full_cols, src_stride, dst + full_cols * dst_stride, dst_stride,
+			    n_rows, n_cols - full_cols);
+      transpose_tile_scalar(src + full_rows * src_stride, src_stride, dst + full_rows, dst_stride,
+			    n_rows - full_rows, full_cols);
+    }
+
+    template<typename dtype>
+    inline void transpose_tile_64( const dtype* src, int64_t src_stride,
+				   dtype* dst, int64_t dst_stride,
+				   int64_t n_rows, int64_t n_cols )
+    {
+      static_assert(sizeof(dtype) == 8, "transpose_tile_64 moves 64 bit elements");
+      int64_t full_rows = n_rows - n_rows % 2;
+      int64_t full_cols = n_cols - n_cols % 2;
+      for ( int64_t row = 0; row < full_rows; row += 2 ) {
+	for ( int64_t col = 0; col < full_cols; col += 2 ) {
+	  const dtype* block = src + row * src_stride + col;
+	  __m128i r0 = _mm_loadu_si128((const __m128i*) (block));
+	  __m128i r1 = _mm_loadu_si128((const __m128i*) (block + src_stride));
+	  dtype* out = dst + col * dst_stride + row;
+	  _mm_storeu_si128((__m128i*) (out), _mm_unpacklo_epi64(r0, r1));
+	  _mm_storeu_si128((__m128i*) (out + dst_stride), _mm_unpackhi_epi64(r0, r1));
+	}
+      }
+      transpose_tile_scalar(src + full_cols, src_stride, dst + full_cols * dst_stride, dst_stride,
+			    n_rows, n_cols - full_cols);
+      transpose_tile_scalar(src + full_rows * src_stride, src_stride, dst + full_rows, dst_stride,
+			    n_rows - full_rows, full_cols);
+    }
+
+    template<> inline void transpose_tile( const int32_t* src, int64_t src_stride,
+					   int32_t* dst, int64_t dst_stride,
+					   int64_t n_rows, int64_t n_cols )
+    {
+      transpose_tile_32(src, src_stride, dst, dst_stride, n_rows, n_cols);
+    }
+    template<> inline void transpose_tile( const float* src, int64_t src_stride,
+					   float* dst, int64_t dst_stride,
+					   int64_t n_rows, int64_t n_cols )
+    {
+      transpose_tile_32(src, src_stride, dst, dst_stride, n_rows, n_cols);
+    }
+    template<> inline void transpose_tile( const int64_t* src, int64_t src_stride,
+					   int64_t* dst, int64_t dst_stride,
+					   int64_t n_rows, int64_t n_cols )
+    {
+      transpose_tile_64(src, src_stride, dst, dst_stride, n_rows, n_cols);
+    }
+    template<> inline void transpose_tile( const double* src, int64_t src_stride,
+					   double* dst, int64_t dst_stride,
+					   int64_t n_rows, int64_t n_cols )
+    {
+      transpose_tile_64(src, src_stride, dst, dst_stride, n_rows, n_cols);
+    }
+#endif
+
+    //Offsets of the task'th combination of the outer dimensions.
+    inline void outer_offsets( const vector<permute_dim>& outer, int64_t task,
+			       int64_t& src_offset, int64_t& dst_offset )
+    {
+      src_offset = 0;
+      dst_offset = 0;
+      for ( int64_t idx = (int64_t) outer.size() - 1; idx >= 0; --idx ) {
+	int64_t index = task % outer[idx].extent;
+	task /= outer[idx].extent;
+	src_offset += index * outer[idx].src_stride;
+	dst_offset += index * outer[idx].dst_stride;
+      }
+    }
+
+    inline int64_t outer_count( const vector<permute_dim>& outer )
+    {
+      int64_t retval = 1;
+      for ( const permute_dim& dim : outer )
+	retval *= dim.extent;
+      return retval;
+    }
+
+    //The innermost destination dimension is contiguous in the source as well
+    //so every destination row is a converting copy of a source row.
+    template<typename src_type, typename dst_type>
+    inline void permute_rows( thread_pool& pool, const src_type* src, dst_type* dst,
+			      vector<permute_dim> dims )
+    {
+      int64_t row_length = dims.back().extent;
+      dims.pop_back();
+      int64_t n_rows = outer_count(dims);
+      int64_t n_chunks = chunk_count(pool, n_rows * row_length, parallel_elementwise_chunk);
+      parallel_chunks(pool, n_rows, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  for ( int64_t row = begin; row < end; ++row ) {
+	    int64_t src_offset, dst_offset;
+	    outer_offsets(dims, row, src_offset, dst_offset);
+	    do_copy(src, src_offset, dst, dst_offset, row_length);
+	  }
+	});
+    }
+
+    //General case: tile the innermost destination dimension against the
+    //dimension with the smallest source stride.  Each tile is read along
+    //source rows, transposed in the source type and written out along
+    //destination rows, converting as it goes.
+    template<typename src_type, typename dst_type>
+    inline void permute_tiles( thread_pool& pool, const src_type* src, dst_type* dst,
+			       vector<permute_dim> dims )
+    {
+      permute_dim cols = dims.back();
+      dims.pop_back();
+      size_t row_dim = 0;
+      for ( size_t idx = 1; idx < dims.size(); ++idx ) {
+	if (llabs(dims[idx].src_stride) < llabs(dims[row_dim].src_stride))
+	  row_dim = idx;
+      }
+      permute_dim rows = dims[row_dim];
+      dims.erase(dims.begin() + row_dim);
+      //Narrow destination rows (e.g. 3 or 4 channels) get taller tiles so
+      //each tile still moves a full tile's worth of elements.
+      int64_t tile_cols = std::min(permute_tile, cols.extent);
+      int64_t tile_rows = (permute_tile * permute_tile) / tile_cols;
+      int64_t row_tiles = (rows.extent + tile_rows - 1) / tile_rows;
+      int64_t col_tiles = (cols.extent + tile_cols - 1) / tile_cols;
+      int64_t n_tasks = outer_count(dims) * row_tiles * col_tiles;
+      int64_t n_chunks = chunk_count(pool, n_tasks * permute_tile * permute_tile,
+				     parallel_elementwise_chunk);
+      parallel_chunks(pool, n_tasks, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  src_type gathered[permute_tile * permute_tile];
+	  src_type transposed[permute_tile * permute_tile];
+	  for ( int64_t task = begin; task < end; ++task ) {
+	    int64_t col_tile = task % col_tiles;
+	    int64_t row_tile = (task / col_tiles) % row_tiles;
+	    int64_t src_offset, dst_offset;
+	    outer_offsets(dims, task / (col_tiles * row_tiles), src_offset, dst_offset);
+	    int64_t row_begin = row_tile * tile_rows;
+	    int64_t col_begin = col_tile * tile_cols;
+	    int64_t n_rows = std::min(tile_rows, rows.extent - row_begin);
+	    int64_t n_cols = std::min(tile_cols, cols.extent - col_begin);
+	    src_offset += row_begin * rows.src_stride + col_begin * cols.src_stride;
+	    dst_offset += row_begin * rows.dst_stride + col_begin * cols.dst_stride;
+	    if (rows.src_stride == 1) {
+	      transpose_tile(src + src_offset, cols.src_stride, transposed, n_cols,
+			     n_cols, n_rows);
+	    }
+	    else {
+	      //Gather the tile so that rows are contiguous, as they would be
+	      //with a unit row stride, then transpose that.
+	      for ( int64_t col = 0; col < n_cols; ++col ) {
+		const src_type* src_col = src + src_offset + col * cols.src_stride;
+		for ( int64_t row = 0; row < n_rows; ++row )
+		  gathered[col * n_rows + row] = src_col[row * rows.src_stride];
+	      }
+	      transpose_tile(gathered, n_rows, transposed, n_cols, n_cols, n_rows);
+	    }
+	    //Tiles spanning whole destination rows are contiguous in the
+	    //destination.
+	    if (rows.dst_stride == n_cols) {
+	      do_copy(transposed, 0, dst, dst_offset, n_rows * n_cols);
+	    }
+	    else {
+	      for ( int64_t row = 0; row < n_rows; ++row )
+		do_copy(transposed + row * n_cols, 0,
+			dst, dst_offset + row * rows.dst_stride, n_cols);
+	    }
+	  }
+	});
+    }
+
+    template<typename src_type, typename dst_type>
+    inline void permute_copy_typed( thread_pool& pool, const src_type* src, dst_type* dst,
+				    const vector<permute_dim>& dims )
+    {
+      if (dims.empty()) {
+	do_copy(src, 0, dst, 0, 1);
+	return;
+      }
+      for ( const permute_dim& dim : dims ) {
+	if (dim.extent == 0)
+	  return;
+      }
+      if (dims.back().src_stride == 1) {
+	permute_rows(pool, src, dst, dims);
+      }
+      else if (dims.size() == 1) {
+	//A strided gather; the innermost destination stride is always 1.
+	const permute_dim& dim = dims[0];
+	for_each_block(pool, dim.extent, [&](int64_t pos, int64_t count) {
+	    for ( int64_t idx = pos; idx < pos + count; ++idx )
+	      dst[idx] = convert_value<dst_type>(src[idx * dim.src_stride]);
+	  });
+      }
+      else {
+	permute_tiles(pool, src, dst, dims);
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,347 @@
+#ifndef BYTE_BUFFER_QUANTIZE_HPP
+#define BYTE_BUFFER_QUANTIZE_HPP
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_elementwise.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Quantized values live in Byte buffers, read as int8 or uint8.  Element
+    //idx of a range belongs to channel (idx / inner_size) % n_channels, so a
+    //row major tensor quantized along axis k has inner_size equal to the
+    //product of the dimensions after k; per tensor quantization is a single
+    //channel.  real = (quantized - zero_point) * scale.
+    struct quant_layout
+    {
+      int64_t n_channels;
+      int64_t inner_size;
+    };
+
+    //Histogram bins used when calibrating to a percentile.
+    static const int64_t calibration_bins = 2048;
+
+    inline void check_quant_layout( const quant_layout& layout )
+    {
+      if (layout.n_channels <= 0 || layout.inner_size <= 0)
+	throw runtime_error("invalid quantization channels");
+    }
+
+    inline void check_real_datatype( Datatype::Enum type )
+    {
+      if (!is_float_datatype(type))
+	throw runtime_error("quantization needs a float or double buffer");
+    }
+
+    inline int64_t quant_min( bool is_signed ) { return is_signed ? -128 : 0; }
+    inline int64_t quant_max( bool is_signed ) { return is_signed ? 127 : 255; }
+
+    //Call fn(pos, count, channel, contiguous) over [begin, end).  With an
+    //inner size of one consecutive elements are consecutive channels and
+    //runs cover up to a row of channels starting at channel (contiguous is
+    //true); otherwise every element of a run shares one channel.
+    template<typename TFn>
+    inline void for_each_channel_run( const quant_layout& layout, int64_t begin, int64_t end, TFn fn )
+    {
+      if (layout.n_channels == 1) {
+	fn(begin, end - begin, (int64_t) 0, false);
+	return;
+      }
+      int64_t pos = begin;
+      while (pos < end) {
+	int64_t channel = (pos / layout.inner_size) % layout.n_channels;
+	if (layout.inner_size == 1) {
+	  int64_t count = std::min(end - pos, layout.n_channels - channel);
+	  fn(pos, count, channel, true);
+	  pos += count;
+	}
+	else {
+	  int64_t count = std::min(end - pos, layout.inner_size - pos % layout.inner_size);
+	  fn(pos, count, channel, false);
+	  pos += count;
+	}
+      }
+    }
+
+    //Adding and subtracting this rounds values of magnitude below 2^(digits-2)
+    //to the nearest integer, ties to even, without a libm call, so the
+    //quantize loops vectorize on the baseline instruction set.
+    template<typename dtype>
+    inline dtype round_bias() { return (dtype) 1.5 * (dtype) (1ULL << (numeric_limits<dtype>::digits - 1)); }
+
+    template<typename dtype, typename qtype>
+    inline qtype quantize_value( dtype value, dtype inv_scale, dtype zero_point,
+				 dtype low, dtype high, dtype bias )
+    {
+      dtype retval = value * inv_scale + zero_point;
+      retval = retval < low ? low : retval;
+      retval = retval > high ? high : retval;
+      //NaN quantizes to the zero point rather than to an undefined cast.
+      retval = retval != retval ? zero_point : retval;
+      return (qtype) ((retval + bias) - bias);
+    }
+
+    template<typename dtype, typename qtype>
+    inline void quantize_typed( thread_pool& pool, const dtype* src, qtype* dst, int64_t n_elems,
+				const quant_layout& layout, const double* scales,
+				const int32_t* zero_points )
+    {
+      int64_t n_channels = layout.n_channels;
+      vector<dtype> inv_scales(n_channels);
+      vector<dtype> zeros(n_channels);
+      for ( int64_t channel = 0; channel < n_channels; ++channel ) {
+	if (!(scales[channel] > 0))
+	  throw runtime_error("quantization scales must be positive");
+	inv_scales[channel] = (dtype) (1.0 / scales[channel]);
+	zeros[channel] = (dtype) zero_points[channel];
+      }
+      dtype low = (dtype) numeric_limits<qtype>::min();
+      dtype high = (dtype) numeric_limits<qtype>::max();
+      dtype bias = round_bias<dtype>();
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  for_each_channel_run(layout, begin, end, [&](int64_t pos, int64_t count, int64_t channel,
+						       bool contiguous) {
+	      const dtype* inv = inv_scales.data() + channel;
+	      const dtype* zero = zeros.data() + channel;
+	      if (contiguous) {
+		for ( int64_t idx = 0; idx < count; ++idx )
+		  dst[pos + idx] = quantize_value<dtype, qtype>(src[pos + idx], inv[idx], zero[idx],
+								 low, high, bias);
+	      }
+	      else {
+		for ( int64_t idx = 0; idx < count; ++idx )
+		  dst[pos + idx] = quantize_value<dtype, qtype>(src[pos + idx], *inv, *zero,
+								 low, high, bias);
+	      }
+	    });
+	});
+    }
+
+    template<typename qtype, typename dtype>
+    inline void dequantize_typed( thread_pool& pool, const qtype* src, dtype* dst, int64_t n_elems,
+				  const quant_layout& layout, const double* scales,
+				  const int32_t* zero_points )
+    {
+      int64_t n_channels = layout.n_channels;
+      vector<dtype> channel_scales(n_channels);
+      vector<dtype> zeros(n_channels);
+      for ( int64_t channel = 0; channel < n_channels; ++channel ) {
+	channel_scales[channel] = (dtype) scales[channel];
+	zeros[channel] = (dtype) zero_points[channel];
+      }
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  for_each_channel_run(layout, begin, end, [&](int64_t pos, int64_t count, int64_t channel,
+						       bool contiguous) {
+	      const dtype* scale = channel_scales.data() + channel;
+	      const dtype* zero = zeros.data() + channel;
+	      if (contiguous) {
+		for ( int64_t idx = 0; idx < count; ++idx )
+		  dst[pos + idx] = ((dtype) src[pos + idx] - zero[idx]) * scale[idx];
+	      }
+	      else {
+		for ( int64_t idx = 0; idx < count; ++idx )
+		  dst[pos + idx] = ((dtype) src[pos + idx] - *zero) * *scale;
+	      }
+	    });
+	});
+    }
+
+    //Per channel minimum and maximum, ignoring NaN.  Channels without any
+    //values get [0, 0].
+    template<typename dtype>
+    inline void channel_extremes( thread_pool& pool, const dtype* src, int64_t n_elems,
+				  const quant_layout& layout, vector<double>& lows,
+				  vector<double>& highs )
+    {
+      int64_t n_channels = layout.n_channels;
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      vector<dtype> chunk_lows(n_chunks * n_channels, numeric_limits<dtype>::infinity());
+      vector<dtype> chunk_highs(n_chunks * n_channels, -numeric_limits<dtype>::infinity());
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  dtype* low = chunk_lows.data() + chunk * n_channels;
+	  dtype* high = chunk_highs.data() + chunk * n_channels;
+	  for_each_channel_run(layout, begin, end, [&](int64_t pos, int64_t count, int64_t channel,
+						       bool contiguous) {
+	      //NaN fails both comparisons and so never replaces an extreme.
+	      for ( int64_t idx = 0; idx < count; ++idx ) {
+		int64_t target = contiguous ? channel + idx : channel;
+		dtype value = src[pos + idx];
+		low[target] = value < low[target] ? value : low[target];
+		high[target] = value > high[target] ? value : high[target];
+	      }
+	    });
+	});
+      lows.assign(n_channels, 0);
+      highs.assign(n_channels, 0);
+      for ( int64_t channel = 0; channel < n_channels; ++channel ) {
+	double low = numeric_limits<double>::infinity();
+	double high = -numeric_limits<double>::infinity();
+	for ( int64_t chunk = 0; chunk < n_chunks; ++chunk ) {
+	  low = std::min(low, (double) chunk_lows[chunk * n_channels + channel]);
+	  high = std::max(high, (double) chunk_highs[chunk * n_channels + channel]);
+	}
+	if (low <= high) {
+	  lows[channel] = low;
+	  highs[channel] = high;
+	}
+      }
+    }
+
+    //Value below which fraction of the histogram's counts fall, interpolating
+    //within the bin.
+    inline double histogram_quantile( const int64_t* bins, int64_t total, double low, double high,
+				      double fraction )
+    {
+      double target = fraction * (double) total;
+      double width = (high - low) / calibration_bins;
+      double seen = 0;
+      for ( int64_t bin = 0; bin < calibration_bins; ++bin ) {
+	if (bins[bin] > 0 && seen + (double) bins[bin] >= target) {
+	  double within = (target - seen) / (double) bins[bin];
+	  return low + ((double) bin + within) * width;
+	}
+	seen += (double) bins[bin];
+      }
+      return high;
+    }
+
+    //Narrow each channel's [low, high] to the given percentile: two sided for
+    //asymmetric schemes, of the magnitudes for symmetric ones (which then
+    //have low = -high).  Each channel's values are histogrammed over its
+    //range in one pass.
+    template<typename dtype>
+    inline void calibrate_percentile( thread_pool& pool, const dtype* src, int64_t n_elems,
+				      const quant_layout& layout, bool symmetric, double percentile,
+				      vector<double>& lows, vector<double>& highs )
+    {
+      int64_t n_channels = layout.n_channels;
+      vector<double> bin_lows(n_channels), bin_scales(n_channels);
+      for ( int64_t channel = 0; channel < n_channels; ++channel ) {
+	double low = symmetric ? 0 : lows[channel];
+	double high = symmetric ? std::max(fabs(lows[channel]), fabs(highs[channel])) : highs[channel];
+	bin_lows[channel] = low;
+	bin_scales[channel] = high > low ? calibration_bins / (high - low) : 0;
+      }
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      //Chunks keep their own histograms unless that would take too much
+      //memory, in which case the pass runs as a single chunk.
+      if (n_chunks * n_channels * calibration_bins > ((int64_t) 1 << 24))
+	n_chunks = 1;
+      vector<int64_t> bins(n_chunks * n_channels * calibration_bins, 0);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  int64_t* chunk_bins = bins.data() + chunk * n_channels * calibration_bins;
+	  for_each_channel_run(layout, begin, end, [&](int64_t pos, int64_t count, int64_t channel,
+						       bool contiguous) {
+	      for ( int64_t idx = 0; idx < count; ++idx ) {
+		int64_t target = contiguous ? channel + idx : channel;
+		double value = (double) src[pos + idx];
+		if (value != value)
+		  continue;
+		if (symmetric)
+		  value = fabs(value);
+		int64_t bin = (int64_t) ((value - bin_lows[target]) * bin_scales[target]);
+		bin = std::max((int64_t) 0, std::min(calibration_bins - 1, bin));
+		++chunk_bins[target * calibration_bins + bin];
+	      }
+	    });
+	});
+      double fraction = percentile / 100.0;
+      for ( int64_t channel = 0; channel < n_channels; ++channel ) {
+	vector<int64_t> merged(calibration_bins, 0);
+	int64_t total = 0;
+	for ( int64_t chunk = 0; chunk < n_chunks; ++chunk ) {
+	  const int64_t* chunk_bins = bins.data() + (chunk * n_channels + channel) * calibration_bins;
+	  for ( int64_t bin = 0; bin < calibration_bins; ++bin ) {
+	    merged[bin] += chunk_bins[bin];
+	    total += chunk_bins[bin];
+	  }
+	}
+	if (total == 0 || bin_scales[channel] == 0)
+	  continue;
+	double low = bin_lows[channel];
+	double high = low + calibration_bins / bin_scales[channel];
+	if (symmetric) {
+	  highs[channel] = histogram_quantile(merged.data(), total, low, high, fraction);
+	  lows[channel] = -highs[channel];
+	}
+	else {
+	  lows[channel] = histogram_quantile(merged.data(), total, low, high, 1.0 - fraction);
+	  highs[channel] = histogram_quantile(merged.data(), total, low, high, fraction);
+	}
+      }
+    }
+
+    //Scale and zero point mapping [low, high] onto the quantized range.
+    //Symmetric schemes center on zero (zero point 0 for int8, 128 for uint8);
+    //asymmetric ones widen the range to include zero so it stays exact.
+    inline void quant_params( double low, double high, QuantScheme::Enum scheme, bool is_signed,
+			      double& scale, int32_t& zero_point )
+    {
+      double qmin = (double) quant_min(is_signed);
+      double qmax = (double) quant_max(is_signed);
+      if (scheme == QuantScheme::Symmetric) {
+	double magnitude = std::max(fabs(low), fabs(high));
+	scale = magnitude / 127.0;
+	zero_point = is_signed ? 0 : 128;
+      }
+      else if (scheme == QuantScheme::Asymmetric) {
+	low = std::min(low, 0.0);
+	high = std::max(high, 0.0);
+	scale = (high - low) / (qmax - qmin);
+	double zero = scale > 0 ? nearbyint(qmin - low / scale) : 0;
+	zero_point = (int32_t) std::max(qmin, std::min(qmax, zero));
+      }
+      else {
+	throw runtime_error("unknown quantization scheme");
+      }
+      if (!(scale > 0) || std::isinf(scale))
+	scale = 1.0;
+    }
+
+    template<typename dtype>
+    inline void calibrate_typed( thread_pool& pool, const dtype* src, int64_t n_elems,
+				 const quant_layout& layout, QuantScheme::Enum scheme,
+				 bool is_signed, double percentile,
+				 double* scales, int32_t* zero_points )
+    {
+      if (!(percentile > 0 && percentile <= 100))
+	throw runtime_error("calibration percentile must be in (0, 100]");
+      vector<double> lows, highs;
+      channel_extremes(pool, src, n_elems, layout, lows, highs);
+      if (percentile < 100)
+	calibrate_percentile(pool, src, n_elems, layout, scheme == QuantScheme::Symmetric,
+			     percentile, lows, highs);
+      for ( int64_t channel = 0; channel < layout.n_channels; ++channel )
+	quant_params(lows[channel], highs[channel], scheme, is_signed,
+		     scales[channel], zero_points[channel]);
+    }
+
+    template<typename TOpType>
+    inline void quantized_buffer_op( int64_t data, bool is_signed, TOpType op )
+    {
+      if (is_signed)
+	op(reinterpret_cast<int8_t*>(data));
+      else
+	op(reinterpret_cast<uint8_t*>(data));
+    }
+
+    template<typename TOpType>
+    inline void real_buffer_op( int64_t data, Datatype::Enum type, TOpType op )
+    {
+      check_real_datatype(type);
+      if (type == Datatype::Float)
+	op(reinterpret_cast<float*>(data));
+      else
+	op(reinterpret_cast<double*>(data));
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef BYTE_BUFFER_REDUCE_HPP
+#define BYTE_BUFFER_REDUCE_HPP
+#include <vector>
+#include <limits>
+#include <stdexcept>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Integers are summed in 64 bits; floats are summed in double.
+    //Integer sums accumulate unsigned so that overflow wraps rather than
+    //being undefined, and are read back with sum_value as int64.
+    template<typename dtype>
+    struct sum_type { typedef uint64_t TType; };
+    template<> struct sum_type<float> { typedef double TType; };
+    template<> struct sum_type<double> { typedef double TType; };
+
+    inline int64_t sum_value( uint64_t sum ) { return (int64_t) sum; }
+    inline double sum_value( double sum ) { return sum; }
+
+    //Independent accumulators per block so the compiler can keep them in
+    //vector registers; blocks are then combined pairwise which keeps the
+    //rounding error of float sums growing with log(n) rather than n.
+    static const int64_t reduce_lanes = 8;
+    static const int64_t pairwise_block = 256;
+
+    template<typename dtype>
+    inline typename sum_type<dtype>::TType block_sum( const dtype* src, int64_t n_elems )
+    {
+      typedef typename sum_type<dtype>::TType acc_type;
+      acc_type lanes[reduce_lanes] = {0};
+      int64_t n_full = n_elems - n_elems % reduce_lanes;
+      for ( int64_t idx = 0; idx < n_full; idx += reduce_lanes ) {
+	for ( int64_t lane = 0; lane < reduce_lanes; ++lane )
+	  lanes[lane] += (acc_type) src[idx + lane];
+      }
+      acc_type retval = 0;
+      for ( int64_t idx = n_full; idx < n_elems; ++idx )
+	retval += (acc_type) src[idx];
+      for ( int64_t lane = 0; lane < reduce_lanes; ++lane )
+	retval += lanes[lane];
+      return retval;
+    }
+
+    template<typename dtype>
+    inline typename sum_type<dtype>::TType pairwise_sum( const dtype* src, int64_t n_elems )
+    {
+      if (n_elems <= pairwise_block)
+	return block_sum(src, n_elems);
+      //Split on a block boundary so the leaves stay full blocks.
+      int64_t n_blocks = (n_elems + pairwise_block - 1) / pairwise_block;
+      int64_t half = (n_blocks / 2) * pairwise_block;
+      return pairwise_sum(src, half) + pairwise_sum(src + half, n_elems - half);
+    }
+
+    template<typename dtype>
+    inline bool is_nan( dtype value ) { return value != value; }
+
+    //min/max propagate NaN the way the float comparison operators do not;
+    //the NaN check is a separate or-reduction so the comparison loop still
+    //vectorizes.
+    template<typename dtype, bool is_min>
+    inline dtype block_extreme( const dtype* src, int64_t n_elems, bool& saw_nan )
+    {
+      dtype retval = src[0];
+      bool nan_found = false;
+      for ( int64_t idx = 0; idx < n_elems; ++idx ) {
+	dtype value = src[idx];
+	nan_found |= is_nan(value);
+	if (is_min)
+	  retval = value < retval ? value : retval;
+	else
+	  retval = value > retval ? value : retval;
+      }
+      saw_nan = nan_found;
+      return retval;
+    }
+
+    //Reductions below this many elements run on the calling thread.
+    static const int64_t parallel_reduce_chunk = 1 << 16;
+
+    template<typename dtype>
+    inline double reduce_sum( thread_pool& pool, const dtype* src, int64_t n_elems )
+    {
+      typedef typename sum_type<dtype>::TType acc_type;
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_reduce_chunk);
+      vector<acc_type> partials(n_chunks);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  partials[chunk] = pairwise_sum(src + begin, end - begin);
+	});
+      return (double) sum_value(pairwise_sum(partials.data(), n_chunks));
+    }
+
+    template<typename dtype, bool is_min>
+    inline dtype reduce_extreme( thread_pool& pool, const dtype* src, int64_t n_elems, bool& saw_nan )
+    {
+      if (n_elems <= 0)
+	throw runtime_error("reduction over an empty range");
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_reduce_chunk);
+      vector<dtype> partials(n_chunks);
+      vector<char> nans(n_chunks);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  bool chunk_nan;
+	  partials[chunk] = block_extreme<dtype, is_min>(src + begin, end - begin, chunk_nan);
+	  nans[chunk] = chunk_nan;
+	});
+      bool partial_nan;
+      dtype retval = block_extreme<dtype, is_min>(partials.data(), n_chunks, partial_nan);
+      saw_nan = partial_nan;
+      for ( char chunk_nan : nans )
+	saw_nan |= chunk_nan != 0;
+      return retval;
+    }
+
+    template<typename dtype>
+    inline double reduce_range( thread_pool& pool, const dtype* src, int64_t n_elems,
+				ReduceOp::Enum op )
+    {
+      bool saw_nan = false;
+      double retval;
+      switch(op) {
+      case ReduceOp::Sum:
+	return reduce_sum(pool, src, n_elems);
+      case ReduceOp::Mean:
+	if (n_elems <= 0)
+	  return numeric_limits<double>::quiet_NaN();
+	return reduce_sum(pool, src, n_elems) / (double) n_elems;
+      case ReduceOp::Min:
+	retval = (double) reduce_extreme<dtype, true>(pool, src, n_elems, saw_nan);
+	break;
+      case ReduceOp::Max:
+	retval = (double) reduce_extreme<dtype, false>(pool, src, n_elems, saw_nan);
+	break;
+      default:
+	throw runtime_error("unknown reduction");
+      }
+      return saw_nan ? numeric_limits<double>::quiet_NaN() : retval;
+    }
+
+    //Index of the first minimum (or maximum), or of the first NaN if there is
+    //one.  The extreme value is found with the vectorized reduction and then
+    //located with a scan that stops at the first match.
+    template<typename dtype, bool is_min>
+    inline int64_t reduce_arg_extreme( thread_pool& pool, const dtype* src, int64_t n_elems )
+    {
+      bool saw_nan;
+      dtype target = reduce_extreme<dtype, is_min>(pool, src, n_elems, saw_nan);
+      for ( int64_t idx = 0; idx < n_elems; ++idx ) {
+	if (saw_nan ? is_nan(src[idx]) : src[idx] == target)
+	  return idx;
+      }
+      return 0;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef BYTE_BUFFER_SCAN_HPP
+#define BYTE_BUFFER_SCAN_HPP
+#include <vector>
+#include <type_traits>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_reduce.hpp"
+#include "byte_buffer_elementwise.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Prefix sums run in the compute type of the source and destination, so
+    //an int destination accumulates in int64 and a double destination widens
+    //a float source.  Large ranges take two passes: chunk totals first, then
+    //every chunk scans from the sum of the chunks before it.
+    static const int64_t scan_lanes = 4;
+
+    //Scan a block in place starting from carry and return the carry for the
+    //next block.  Float blocks are scanned as scan_lanes interleaved segments
+    //so the additions form independent dependency chains, hiding their
+    //latency, and each segment is then offset by the totals of the ones
+    //before it.  Integer additions are cheap enough to chain directly.
+    template<typename ctype, bool exclusive>
+    inline ctype scan_block( ctype* block, int64_t n_elems, ctype carry )
+    {
+      int64_t lane_size = is_floating_point<ctype>::value ? n_elems / scan_lanes : 0;
+      ctype sums[scan_lanes] = {0};
+      for ( int64_t idx = 0; idx < lane_size; ++idx ) {
+	for ( int64_t lane = 0; lane < scan_lanes; ++lane ) {
+	  ctype& value = block[lane * lane_size + idx];
+	  ctype previous = sums[lane];
+	  sums[lane] += value;
+	  value = exclusive ? previous : sums[lane];
+	}
+      }
+      for ( int64_t lane = 0; lane < scan_lanes; ++lane ) {
+	ctype* segment = block + lane * lane_size;
+	for ( int64_t idx = 0; idx < lane_size; ++idx )
+	  segment[idx] += carry;
+	carry += sums[lane];
+      }
+      for ( int64_t idx = scan_lanes * lane_size; idx < n_elems; ++idx ) {
+	ctype previous = carry;
+	carry += block[idx];
+	block[idx] = exclusive ? previous : carry;
+      }
+      return carry;
+    }
+
+    template<typename ctype>
+    inline void scan_kernel( thread_pool& pool, buffer_range src, buffer_range dst,
+			     int64_t n_elems, bool exclusive )
+    {
+      //The totals pass only pays for itself when chunks run concurrently.
+      int64_t n_chunks = pool.concurrency() > 1
+	? chunk_count(pool, n_elems, parallel_elementwise_chunk) : 1;
+      vector<ctype> carries(n_chunks, 0);
+      if (n_chunks > 1) {
+	parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	    typed_buffer_op<void>(src.data, src.type, [&](auto src_ptr) {
+		carries[chunk] = (ctype) sum_value(pairwise_sum(src_ptr + src.offset + begin,
+								end - begin));
+	      });
+	  });
+	ctype carry = 0;
+	for ( ctype& chunk_carry : carries ) {
+	  ctype total = chunk_carry;
+	  chunk_carry = carry;
+	  carry += total;
+	}
+      }
+      //A destination of the compute type is scanned where it lies rather
+      //than through a block.
+      ctype* direct = typed_buffer_op<ctype*>(dst.data, dst.type, [&](auto dst_ptr) {
+	  typedef typename remove_pointer<decltype(dst_ptr)>::type dst_type;
+	  return is_same<dst_type, ctype>::value
+	    ? reinterpret_cast<ctype*>(dst_ptr + dst.offset) : (ctype*) nullptr;
+	});
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  ctype block[elementwise_block];
+	  ctype carry = carries[chunk];
+	  for ( int64_t pos = begin; pos < end; pos += elementwise_block ) {
+	    int64_t count = std::min(elementwise_block, end - pos);
+	    ctype* target = direct ? direct + pos : block;
+	    load_block(src.data, src.type, src.offset + pos, target, count);
+	    carry = exclusive ? scan_block<ctype, true>(target, count, carry)
+	      : scan_block<ctype, false>(target, count, carry);
+	    if (!direct)
+	      store_block(block, dst.data, dst.type, dst.offset + pos, count);
+	  }
+	});
+    }
+  }
+}
+
+#endif
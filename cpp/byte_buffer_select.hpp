@@ -0,0 +1,146 @@
+#ifndef BYTE_BUFFER_SELECT_HPP
+#define BYTE_BUFFER_SELECT_HPP
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <stdexcept>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_elementwise.hpp"
+#include "byte_buffer_sort.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Top k selection ranks values by their sort keys (smallest key best, so
+    //largest selection uses descending keys) and breaks ties by position.
+    //Each chunk keeps at most 2k candidates and a threshold key, the worst of
+    //its best k so far.  Blocks are first checked for any value reaching the
+    //threshold with a branch free loop the compiler vectorizes; once the
+    //threshold settles almost every block is rejected by that check alone.
+    static const int64_t select_block = 256;
+
+    template<typename key_type>
+    struct select_candidate
+    {
+      key_type key;
+      int64_t index;
+      bool operator<( const select_candidate& other ) const
+      {
+	return key < other.key || (key == other.key && index < other.index);
+      }
+    };
+
+    //Keep the best k candidates in any order.
+    template<typename key_type>
+    inline void truncate_candidates( vector<select_candidate<key_type> >& candidates, int64_t k )
+    {
+      if ((int64_t) candidates.size() <= k)
+	return;
+      std::nth_element(candidates.begin(), candidates.begin() + (k - 1), candidates.end());
+      candidates.resize(k);
+    }
+
+    template<typename dtype>
+    inline void select_chunk( const dtype* src, int64_t begin, int64_t end, int64_t k,
+			      bool largest,
+			      vector<select_candidate<typename bits_type<sizeof(dtype)>::TType> >& candidates )
+    {
+      typedef typename bits_type<sizeof(dtype)>::TType key_type;
+      candidates.reserve(2 * k);
+      int64_t pos = begin;
+      //Fill the first k unconditionally.
+      for ( ; pos < end && (int64_t) candidates.size() < k; ++pos )
+	candidates.push_back(select_candidate<key_type> { to_sort_key(src[pos], largest), pos });
+      if (pos == end)
+	return;
+      key_type threshold = std::max_element(candidates.begin(), candidates.end())->key;
+      dtype bound = from_sort_key<dtype>(threshold, largest);
+      for ( ; pos < end; pos += select_block ) {
+	int64_t count = std::min(select_block, end - pos);
+	const dtype* block = src + pos;
+	//The check compares values against the threshold's value, inclusively
+	//so signed zeros cannot slip past; a NaN threshold admits everything.
+	int any = bound != bound;
+	if (largest) {
+	  for ( int64_t idx = 0; idx < count; ++idx )
+	    any |= block[idx] >= bound;
+	}
+	else {
+	  for ( int64_t idx = 0; idx < count; ++idx )
+	    any |= block[idx] <= bound;
+	}
+	if (!any)
+	  continue;
+	//Keys equal to the threshold lose to the earlier candidates holding it.
+	for ( int64_t idx = 0; idx < count; ++idx ) {
+	  key_type key = to_sort_key(block[idx], largest);
+	  if (key < threshold)
+	    candidates.push_back(select_candidate<key_type> { key, pos + idx });
+	}
+	if ((int64_t) candidates.size() >= 2 * k) {
+	  truncate_candidates(candidates, k);
+	  threshold = candidates[k - 1].key;
+	  bound = from_sort_key<dtype>(threshold, largest);
+	}
+      }
+      truncate_candidates(candidates, k);
+    }
+
+    //Positions of the best k, best first, into indices.
+    template<typename dtype>
+    inline void top_k_typed( thread_pool& pool, const dtype* src, int64_t n_elems, int64_t k,
+			     bool largest, vector<int64_t>& indices )
+    {
+      typedef typename bits_type<sizeof(dtype)>::TType key_type;
+      typedef select_candidate<key_type> candidate;
+      int64_t n_chunks = chunk_count(pool, n_elems, std::max(parallel_sort_chunk, 4 * k));
+      vector<vector<candidate> > chunk_candidates(n_chunks);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  select_chunk(src, begin, end, k, largest, chunk_candidates[chunk]);
+	});
+      vector<candidate> merged;
+      merged.reserve(n_chunks * k);
+      for ( const auto& candidates : chunk_candidates )
+	merged.insert(merged.end(), candidates.begin(), candidates.end());
+      truncate_candidates(merged, k);
+      std::sort(merged.begin(), merged.end());
+      indices.resize(merged.size());
+      for ( size_t idx = 0; idx < merged.size(); ++idx )
+	indices[idx] = merged[idx].index;
+    }
+
+    //Select from the range and write the values (converted as copy does) and
+    //positions of the best k; either destination data may be 0 to skip it.
+    inline void top_k_range( thread_pool& pool, buffer_range src, int64_t n_elems, int64_t k,
+			     bool largest, buffer_range values, buffer_range indices )
+    {
+      if (k < 0 || k > n_elems)
+	throw runtime_error("k must be between 0 and the number of elements");
+      if (k == 0)
+	return;
+      vector<int64_t> selected;
+      typed_buffer_op<void>(src.data, src.type, [&](auto* src_ptr) {
+	  const auto* src_values = src_ptr + src.offset;
+	  top_k_typed(pool, src_values, n_elems, k, largest, selected);
+	  if (values.data == 0)
+	    return;
+	  typed_buffer_op<void>(values.data, values.type, [&](auto* dst_ptr) {
+	      typedef typename remove_pointer<decltype(dst_ptr)>::type dst_type;
+	      for ( int64_t idx = 0; idx < k; ++idx )
+		dst_ptr[values.offset + idx] = convert_value<dst_type>(src_values[selected[idx]]);
+	    });
+	});
+      if (indices.data == 0)
+	return;
+      index_buffer_op(indices.data, indices.type, n_elems, [&](auto* dst_ptr) {
+	  typedef typename remove_pointer<decltype(dst_ptr)>::type index_type;
+	  for ( int64_t idx = 0; idx < k; ++idx )
+	    dst_ptr[indices.offset + idx] = (index_type) selected[idx];
+	});
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef BYTE_BUFFER_SORT_HPP
+#define BYTE_BUFFER_SORT_HPP
+#include <vector>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_bits.hpp"
+#include "byte_buffer_interleave.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Sorting maps every value to an unsigned key of the same width whose
+    //order is the value order, LSD radix sorts the keys a byte at a time and
+    //maps them back.  Each pass histograms chunks in parallel and scatters
+    //them in parallel to per chunk offsets, which keeps the sort stable.
+    static const int64_t radix_bits = 8;
+    static const int64_t radix_buckets = 1 << radix_bits;
+    //Elements per chunk below which a pass runs on the calling thread.
+    static const int64_t parallel_sort_chunk = 1 << 16;
+
+    //Signed integers have their sign bit flipped; floats have it set when
+    //positive and all bits flipped when negative.  Descending sorts flip the
+    //whole key.  NaN always maps to the largest key so it sorts last.
+    template<typename dtype>
+    inline typename bits_type<sizeof(dtype)>::TType to_sort_key( dtype value, bool descending )
+    {
+      typedef typename bits_type<sizeof(dtype)>::TType key_type;
+      const key_type sign = (key_type) ((key_type) 1 << (sizeof(dtype) * 8 - 1));
+      key_type bits;
+      memcpy(&bits, &value, sizeof(bits));
+      key_type retval = bits;
+      if (is_floating_point<dtype>::value)
+	retval = (bits & sign) ? (key_type) ~bits : (key_type) (bits | sign);
+      else if (is_signed<dtype>::value)
+	retval = (key_type) (bits ^ sign);
+      retval = descending ? (key_type) ~retval : retval;
+      if (is_floating_point<dtype>::value && value != value)
+	retval = numeric_limits<key_type>::max();
+      return retval;
+    }
+
+    template<typename dtype>
+    inline dtype from_sort_key( typename bits_type<sizeof(dtype)>::TType key, bool descending )
+    {
+      typedef typename bits_type<sizeof(dtype)>::TType key_type;
+      const key_type sign = (key_type) ((key_type) 1 << (sizeof(dtype) * 8 - 1));
+      if (is_floating_point<dtype>::value && key == numeric_limits<key_type>::max())
+	return numeric_limits<dtype>::quiet_NaN();
+      key = descending ? (key_type) ~key : key;
+      key_type bits = key;
+      if (is_floating_point<dtype>::value)
+	bits = (key & sign) ? (key_type) (key & ~sign) : (key_type) ~key;
+      else if (is_signed<dtype>::value)
+	bits = (key_type) (key ^ sign);
+      dtype retval;
+      memcpy(&retval, &bits, sizeof(retval));
+      return retval;
+    }
+
+    template<typename dtype>
+    inline void parallel_copy( thread_pool& pool, const dtype* src, dtype* dst, int64_t n_elems )
+    {
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_sort_chunk);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  memcpy(dst + begin, src + begin, (end - begin) * sizeof(dtype));
+	});
+    }
+
+    //Sort keys, using key_scratch (and index_scratch) of the same length.
+    //When indices is not null it receives the permutation applied: indices[i]
+    //is the original position of the key that ends up at i.  Passes where
+    //every key has the same byte are skipped, so narrow ranges of wide types
+    //cost only the passes their values need.
+    template<typename key_type, typename index_type>
+    inline void radix_sort_keys( thread_pool& pool, key_type* keys, key_type* key_scratch,
+				 int64_t n_elems, index_type* indices, index_type* index_scratch )
+    {
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_sort_chunk);
+      vector<int64_t> offsets(n_chunks * radix_buckets);
+      key_type* src_keys = keys;
+      key_type* dst_keys = key_scratch;
+      index_type* src_indices = indices;
+      index_type* dst_indices = index_scratch;
+      bool have_indices = false;
+      for ( int64_t shift = 0; shift < (int64_t) sizeof(key_type) * 8; shift += radix_bits ) {
+	parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	    int64_t* counts = offsets.data() + chunk * radix_buckets;
+	    std::fill(counts, counts + radix_buckets, 0);
+	    for ( int64_t idx = begin; idx < end; ++idx )
+	      ++counts[(src_keys[idx] >> shift) & (radix_buckets - 1)];
+	  });
+	//Bucket major, chunk minor prefix sums give each chunk its first
+	//output slot per bucket.
+	bool skip = false;
+	int64_t total = 0;
+	for ( int64_t bucket = 0; bucket < radix_buckets; ++bucket ) {
+	  int64_t bucket_total = 0;
+	  for ( int64_t chunk = 0; chunk < n_chunks; ++chunk ) {
+	    int64_t& slot = offsets[chunk * radix_buckets + bucket];
+	    int64_t count = slot;
+	    slot = total;
+	    total += count;
+	    bucket_total += count;
+	  }
+	  skip = skip || bucket_total == n_elems;
+	}
+	if (skip)
+	  continue;
+	parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	    int64_t* slots = offsets.data() + chunk * radix_buckets;
+	    if (!indices) {
+	      for ( int64_t idx = begin; idx < end; ++idx ) {
+		key_type key = src_keys[idx];
+		dst_keys[slots[(key >> shift) & (radix_buckets - 1)]++] = key;
+	      }
+	    }
+	    else {
+	      for ( int64_t idx = begin; idx < end; ++idx ) {
+		key_type key = src_keys[idx];
+		int64_t slot = slots[(key >> shift) & (radix_buckets - 1)]++;
+		dst_keys[slot] = key;
+		dst_indices[slot] = have_indices ? src_indices[idx] : (index_type) idx;
+	      }
+	    }
+	  });
+	std::swap(src_keys, dst_keys);
+	std::swap(src_indices, dst_indices);
+	have_indices = true;
+      }
+      if (src_keys != keys) {
+	parallel_copy(pool, src_keys, keys, n_elems);
+	if (indices)
+	  parallel_copy(pool, src_indices, indices, n_elems);
+      }
+      else if (indices && !have_indices) {
+	int64_t n_chunks = chunk_count(pool, n_elems, parallel_sort_chunk);
+	parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	    for ( int64_t idx = begin; idx < end; ++idx )
+	      indices[idx] = (index_type) idx;
+	  });
+      }
+    }
+
+    template<typename index_type>
+    inline void check_index_capacity( int64_t n_elems )
+    {
+      if (n_elems > (int64_t) numeric_limits<index_type>::max())
+	throw runtime_error("too many elements for int indices");
+    }
+
+    //Sort in place.  The keys live in their own array, as writing them over
+    //the values would access the buffer through a type it does not hold.
+    template<typename dtype, typename index_type>
+    inline void sort_typed( thread_pool& pool, dtype* data, int64_t n_elems, bool descending,
+			    index_type* indices )
+    {
+      typedef typename bits_type<sizeof(dtype)>::TType key_type;
+      vector<key_type> keys(n_elems);
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_sort_chunk);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  for ( int64_t idx = begin; idx < end; ++idx )
+	    keys[idx] = to_sort_key(data[idx], descending);
+	});
+      vector<key_type> key_scratch(n_elems);
+      vector<index_type> index_scratch(indices ? n_elems : 0);
+      radix_sort_keys(pool, keys.data(), key_scratch.data(), n_elems, indices,
+		      index_scratch.data());
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  for ( int64_t idx = begin; idx < end; ++idx )
+	    data[idx] = from_sort_key<dtype>(keys[idx], descending);
+	});
+    }
+
+    template<typename dtype, typename index_type>
+    inline void argsort_typed( thread_pool& pool, const dtype* data, int64_t n_elems,
+			       bool descending, index_type* indices )
+    {
+      typedef typename bits_type<sizeof(dtype)>::TType key_type;
+      vector<key_type> keys(n_elems);
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_sort_chunk);
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t, int64_t begin, int64_t end) {
+	  for ( int64_t idx = begin; idx < end; ++idx )
+	    keys[idx] = to_sort_key(data[idx], descending);
+	});
+      vector<key_type> key_scratch(n_elems);
+      vector<index_type> index_scratch(n_elems);
+      radix_sort_keys(pool, keys.data(), key_scratch.data(), n_elems, indices,
+		      index_scratch.data());
+    }
+
+    //Bits sort by counting; their permutation comes from sorting them
+    //unpacked to bytes.
+    template<typename index_type>
+    inline void sort_bits( thread_pool& pool, uint8_t* data, int64_t bit_offset, int64_t n_bits,
+			   bool descending, bool in_place, index_type* indices )
+    {
+      if (indices) {
+	vector<uint8_t> unpacked(n_bits);
+	unpack_bits(pool, data, bit_offset, unpacked.data(), n_bits);
+	argsort_typed(pool, unpacked.data(), n_bits, descending, indices);
+      }
+      if (in_place) {
+	int64_t n_ones = popcount_bits(pool, data, bit_offset, n_bits);
+	int64_t n_first = descending ? n_ones : n_bits - n_ones;
+	fill_bits(pool, data, bit_offset, descending, n_first);
+	fill_bits(pool, data, bit_offset + n_first, !descending, n_bits - n_first);
+      }
+    }
+
+    template<typename TOpType>
+    inline void index_buffer_op( int64_t index_data, Datatype::Enum index_type, int64_t n_elems,
+				 TOpType op )
+    {
+      if (index_type == Datatype::Int) {
+	check_index_capacity<int32_t>(n_elems);
+	op(reinterpret_cast<int32_t*>(index_data));
+      }
+      else if (index_type == Datatype::Long) {
+	op(reinterpret_cast<int64_t*>(index_data));
+      }
+      else {
+	throw runtime_error("sort indices must be int or long");
+      }
+    }
+
+    //Sort the range in place, or when in_place is false only compute the
+    //permutation; indices may be null when sorting in place.
+    template<typename index_type>
+    inline void sort_range( thread_pool& pool, int64_t data, Datatype::Enum type, int64_t offset,
+			    int64_t n_elems, bool descending, bool in_place, index_type* indices )
+    {
+      if (type == Datatype::Bit) {
+	sort_bits(pool, reinterpret_cast<uint8_t*>(data), offset, n_elems, descending, in_place,
+		  indices);
+	return;
+      }
+      typed_buffer_op<void>(data, type, [&](auto* ptr) {
+	  if (in_place)
+	    sort_typed(pool, ptr + offset, n_elems, descending, indices);
+	  else
+	    argsort_typed(pool, ptr + offset, n_elems, descending, indices);
+	});
+    }
+  }
+}
+
+#endif
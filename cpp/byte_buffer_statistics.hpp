@@ -0,0 +1,136 @@
+#ifndef BYTE_BUFFER_STATISTICS_HPP
+#define BYTE_BUFFER_STATISTICS_HPP
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include "byte_buffer.hpp"
+#include "byte_buffer_parallel.hpp"
+#include "byte_buffer_reduce.hpp"
+#include "byte_buffer_elementwise.hpp"
+
+namespace think { namespace byte_buffer {
+    using namespace std;
+
+    //Streaming statistics keep the count, mean and sum of squared
+    //differences from the mean (M2) in the form of Welford's algorithm, and
+    //combine partial results with Chan's pairwise update, so any split of
+    //the data merges to the same answer up to rounding.  NaN values are
+    //counted on their own and excluded from everything else.  The layout
+    //matches the double state arrays of the interface, where all zeros is
+    //the empty state.
+    struct running_statistics
+    {
+      double count;
+      double mean;
+      double m2;
+      double min;
+      double max;
+      double nan_count;
+    };
+    static_assert(sizeof(running_statistics) == 6 * sizeof(double),
+		  "statistics state arrays are six doubles");
+
+    inline void merge_statistics( running_statistics& into, const running_statistics& other )
+    {
+      double nan_count = into.nan_count + other.nan_count;
+      if (other.count == 0) {
+	into.nan_count = nan_count;
+	return;
+      }
+      if (into.count == 0) {
+	into = other;
+	into.nan_count = nan_count;
+	return;
+      }
+      double count = into.count + other.count;
+      double delta = other.mean - into.mean;
+      into.mean += delta * (other.count / count);
+      into.m2 += other.m2 + delta * delta * (into.count * other.count / count);
+      into.min = std::min(into.min, other.min);
+      into.max = std::max(into.max, other.max);
+      into.count = count;
+      into.nan_count = nan_count;
+    }
+
+    //Statistics of a block still in L1: the sum, extremes and NaN count in
+    //one branch free pass, then M2 about the block mean in a second.
+    inline running_statistics block_statistics( const double* block, int64_t n_elems )
+    {
+      double sums[reduce_lanes] = {0};
+      double counts[reduce_lanes] = {0};
+      double mins[reduce_lanes];
+      double maxes[reduce_lanes];
+      std::fill(mins, mins + reduce_lanes, numeric_limits<double>::infinity());
+      std::fill(maxes, maxes + reduce_lanes, -numeric_limits<double>::infinity());
+      int64_t n_full = n_elems - n_elems % reduce_lanes;
+      for ( int64_t idx = 0; idx < n_full; idx += reduce_lanes ) {
+	for ( int64_t lane = 0; lane < reduce_lanes; ++lane ) {
+	  double value = block[idx + lane];
+	  bool valid = value == value;
+	  sums[lane] += valid ? value : 0.0;
+	  counts[lane] += valid ? 1.0 : 0.0;
+	  mins[lane] = value < mins[lane] ? value : mins[lane];
+	  maxes[lane] = value > maxes[lane] ? value : maxes[lane];
+	}
+      }
+      for ( int64_t idx = n_full; idx < n_elems; ++idx ) {
+	double value = block[idx];
+	bool valid = value == value;
+	sums[0] += valid ? value : 0.0;
+	counts[0] += valid ? 1.0 : 0.0;
+	mins[0] = value < mins[0] ? value : mins[0];
+	maxes[0] = value > maxes[0] ? value : maxes[0];
+      }
+      running_statistics retval = { 0, 0, 0, mins[0], maxes[0], 0 };
+      double sum = 0;
+      for ( int64_t lane = 0; lane < reduce_lanes; ++lane ) {
+	sum += sums[lane];
+	retval.count += counts[lane];
+	retval.min = std::min(retval.min, mins[lane]);
+	retval.max = std::max(retval.max, maxes[lane]);
+      }
+      retval.nan_count = (double) n_elems - retval.count;
+      if (retval.count == 0)
+	return retval;
+      retval.mean = sum / retval.count;
+      double m2s[reduce_lanes] = {0};
+      for ( int64_t idx = 0; idx < n_full; idx += reduce_lanes ) {
+	for ( int64_t lane = 0; lane < reduce_lanes; ++lane ) {
+	  double value = block[idx + lane];
+	  double delta = value - retval.mean;
+	  m2s[lane] += value == value ? delta * delta : 0.0;
+	}
+      }
+      for ( int64_t idx = n_full; idx < n_elems; ++idx ) {
+	double delta = block[idx] - retval.mean;
+	m2s[0] += block[idx] == block[idx] ? delta * delta : 0.0;
+      }
+      for ( int64_t lane = 0; lane < reduce_lanes; ++lane )
+	retval.m2 += m2s[lane];
+      return retval;
+    }
+
+    //Fold a range into state, reading it once.
+    inline void accumulate_statistics_range( thread_pool& pool, buffer_range src, int64_t n_elems,
+					     double* state )
+    {
+      int64_t n_chunks = chunk_count(pool, n_elems, parallel_elementwise_chunk);
+      vector<running_statistics> partials(n_chunks, running_statistics {});
+      parallel_chunks(pool, n_elems, n_chunks, [&](int64_t chunk, int64_t begin, int64_t end) {
+	  double block[elementwise_block];
+	  running_statistics& partial = partials[chunk];
+	  for ( int64_t pos = begin; pos < end; pos += elementwise_block ) {
+	    int64_t count = std::min(elementwise_block, end - pos);
+	    load_block(src.data, src.type, src.offset + pos, block, count);
+	    merge_statistics(partial, block_statistics(block, count));
+	  }
+	});
+      running_statistics& total = *reinterpret_cast<running_statistics*>(state);
+      for ( const running_statistics& partial : partials )
+	merge_statistics(total, partial);
+    }
+  }
+}
+
+#endif
@@ -5,7 +5,8 @@ import org.bytedeco.javacpp.tools.*;
 
 @Properties(target="think.byte_buffer.ByteBuffer",
 	    value={@Platform(include={"<byte_buffer.hpp>", "<byte_buffer_export.hpp>"},
-			     includepath={"cpp"})})
+			     includepath={"cpp"},
+			     link={"rt"})})
 
 public class ByteBuffer implements InfoMapper {
     public void map(InfoMap infoMap) {
@@ -8,9 +8,23 @@
   (:import [think.byte_buffer ByteBuffer
             ByteBuffer$EndianType
             ByteBuffer$Datatype
+            ByteBuffer$AllocationPolicy
+            ByteBuffer$MapMode
+            ByteBuffer$AccessAdvice
+            ByteBuffer$ReduceOp
+            ByteBuffer$BinaryOp
+            ByteBuffer$UnaryOp
+            ByteBuffer$ExprOp
+            ByteBuffer$BitOp
+            ByteBuffer$IntegerCodec
+            ByteBuffer$QuantScheme
+            ByteBuffer$ChecksumType
+            ByteBuffer$NormType
+            ByteBuffer$NanPolicy
             ByteBuffer$BufferManager]
            [think.datatype DoubleArrayView FloatArrayView
             LongArrayView IntArrayView ShortArrayView ByteArrayView]
+           [java.io File]
            [java.nio ShortBuffer IntBuffer LongBuffer
             FloatBuffer DoubleBuffer Buffer]
            [org.bytedeco.javacpp DoublePointer FloatPointer]))
@@ -32,7 +46,29 @@
     :int ByteBuffer$Datatype/Int
     :long ByteBuffer$Datatype/Long
     :float ByteBuffer$Datatype/Float
-    :double ByteBuffer$Datatype/Double))
+    :double ByteBuffer$Datatype/Double
+    :bit ByteBuffer$Datatype/Bit))
+
+
+(defn cpp-datatype->
+  [^long cpp-datatype]
+  (condp = cpp-datatype
+    ByteBuffer$Datatype/Byte :byte
+    ByteBuffer$Datatype/Short :short
+    ByteBuffer$Datatype/Int :int
+    ByteBuffer$Datatype/Long :long
+    ByteBuffer$Datatype/Float :float
+    ByteBuffer$Datatype/Double :double
+    ByteBuffer$Datatype/Bit :bit))
+
+
+(defn datatype->byte-count
+  "Bytes taken by elem-count elements of datatype.  :bit buffers pack eight
+elements to a byte."
+  ^long [datatype ^long elem-count]
+  (if (= datatype :bit)
+    (quot (+ elem-count 7) 8)
+    (* elem-count (long (dtype/datatype->byte-size datatype)))))
 
 
 (defprotocol CopyToTypedBuffer
@@ -76,7 +112,8 @@ onto other datatypes."
       :int (.get_value_int32 manager data (->cpp-datatype datatype) offset)
       :long (.get_value_int64 manager data (->cpp-datatype datatype) offset)
       :float (.get_value_float manager data (->cpp-datatype datatype) offset)
-      :double (.get_value_double manager data (->cpp-datatype datatype) offset)))
+      :double (.get_value_double manager data (->cpp-datatype datatype) offset)
+      :bit (.get_value_int8 manager data (->cpp-datatype datatype) offset)))
   dtype/PCopyQueryDirect
   (get-direct-copy-fn [this dest-offset]
     #(do
@@ -100,8 +137,15 @@ onto other datatypes."
   dtype/PView
   (->view-impl [this offset elem-count]
     (check-buffer-access size offset elem-count)
-    (->TypedBuffer (+ data (* offset (dtype/datatype->byte-size datatype)))
-                   elem-count datatype manager))
+    ;;Views own a reference to the buffer they point into so releasing the
+    ;;parent does not free memory the view still uses.
+    ;;Bit views have to start on a byte.
+    (when (and (= datatype :bit) (not= 0 (rem (long offset) 8)))
+      (throw (ex-info "Bit buffer views must start at a multiple of 8"
+                      {:offset offset})))
+    (let [view-data (+ data (datatype->byte-count datatype offset))]
+      (.retain_buffer manager view-data)
+      (resource/track (->TypedBuffer view-data elem-count datatype manager))))
   CopyToTypedBuffer
   (copy-to-typed-buffer! [src src-offset dest dest-offset elem-count]
     (let [^TypedBuffer dest dest]
@@ -118,6 +162,16 @@ onto other datatypes."
   ^TypedBuffer [obj] obj)
 
 
+(defn retain!
+  "Add a reference to the buffer (or view) and return it.  The caller owns the
+new reference and hands it back with resource/release-resource; this lets a view
+outlive the resource context it was created in, e.g. when passed to another
+thread."
+  [^TypedBuffer buf]
+  (.retain_buffer ^ByteBuffer$BufferManager (.manager buf) (.data buf))
+  buf)
+
+
 (defmacro typed-buffer->array-impl
   [ary-type ary-type-fn copy-to-fn cast-fn]
   `[(keyword (name ~copy-to-fn))
@@ -207,28 +261,1302 @@ onto other datatypes."
   @*manager*)
 
 
+(defn ->cpp-allocation-policy
+  ^long [policy]
+  (condp = policy
+    :local ByteBuffer$AllocationPolicy/Local
+    :interleave ByteBuffer$AllocationPolicy/Interleave
+    :bind ByteBuffer$AllocationPolicy/Bind))
+
+
 (defn make-typed-buffer
-  [datatype size-or-seq]
+  "Make a typed buffer of the given datatype from either an element count or
+a sequence of values.  Options:
+:placement - one of :local, :interleave or :bind.  Places the buffer's pages on
+  numa nodes and faults them in with threads pinned to those nodes; the
+  memory is zero initialized by the allocation itself.
+:node - numa node used by the :bind placement."
+  ([datatype size-or-seq {:keys [placement node]
+                          :or {node 0}}]
+   (let [manager (default-manager)
+         allocate (fn [^long data-len]
+                    (let [byte-len (datatype->byte-count datatype data-len)]
+                      (if placement
+                        (.allocate_buffer manager byte-len
+                                          (int (->cpp-allocation-policy placement))
+                                          (int node)
+                                          "byte-buffer.clj" 235)
+                        (.allocate_buffer manager byte-len
+                                          "byte-buffer.clj" 237))))
+         retval
+         (if (number? size-or-seq)
+           ;;If just a number then we can allocate directly
+           ;;data is expected to be zero initialized.
+           (let [data-len (long size-or-seq)
+                 buf-data (long (allocate data-len))
+                 retval (->TypedBuffer buf-data data-len datatype manager)]
+             (when-not placement
+               (.set_value ^ByteBuffer$BufferManager manager
+                           (long buf-data) (int (->cpp-datatype datatype)) (long 0)
+                           (byte 0) (long data-len)))
+             retval)
+           (let [src-data (dtype/make-array-of-type (if (= datatype :bit) :double datatype)
+                                                    size-or-seq)
+                 data-len (m/ecount src-data)
+                 buf-data (long (allocate data-len))
+                 retval (->TypedBuffer buf-data data-len datatype manager)]
+             (dtype/copy! src-data 0 retval 0 data-len)
+             retval))]
+     (resource/track retval)))
+  ([datatype size-or-seq]
+   (make-typed-buffer datatype size-or-seq {})))
+
+
+
+(defn- ->cpp-map-mode
+  ^long [mode]
+  (condp = mode
+    :read-only ByteBuffer$MapMode/ReadOnly
+    :read-write ByteBuffer$MapMode/ReadWrite
+    :copy-on-write ByteBuffer$MapMode/CopyOnWrite))
+
+
+(defn- ->cpp-access-advice
+  ^long [advice]
+  (condp = advice
+    :normal ByteBuffer$AccessAdvice/Normal
+    :sequential ByteBuffer$AccessAdvice/Sequential
+    :random ByteBuffer$AccessAdvice/Random
+    :will-need ByteBuffer$AccessAdvice/WillNeed
+    :dont-need ByteBuffer$AccessAdvice/DontNeed))
+
+
+(defn map-file
+  "Map a file as a typed buffer.  Options:
+:mode - :read-only (default), :read-write (shared with the file, extended to fit
+  if needed) or :copy-on-write (private writable copy).  Writing to a read-only
+  mapping faults the process.
+:offset - byte offset into the file.
+:elem-count - number of elements to map, defaults to the rest of the file."
+  [datatype path & {:keys [mode offset elem-count]
+                    :or {mode :read-only
+                         offset 0}}]
   (let [manager (default-manager)
-        retval
-        (if (number? size-or-seq)
-          ;;If just a number then we can allocate directly
-          ;;data is expected to be zero initialized.
-          (let [data-len (long size-or-seq)
-                buf-data (.allocate_buffer manager (* data-len
-                                                      (dtype/datatype->byte-size datatype))
-                                           "byte-buffer.clj" 286)
-                retval (->TypedBuffer buf-data data-len datatype manager)]
-            (.set_value ^ByteBuffer$BufferManager manager
-                        (long buf-data) (int (->cpp-datatype datatype)) (long 0)
-                        (byte 0) (long data-len))
-            retval)
-          (let [src-data (dtype/make-array-of-type datatype size-or-seq)
-                data-len (m/ecount src-data)
-                buf-data (.allocate_buffer ^ByteBuffer$BufferManager manager
-                                           (long (* data-len (dtype/datatype->byte-size datatype)))
-                                           "byte-buffer.clj" 295)
-                retval (->TypedBuffer buf-data data-len datatype manager)]
-            (dtype/copy! src-data 0 retval 0 data-len)
-            retval))]
+        elem-count (long (or elem-count
+                             (let [file-bytes (- (.length (File. (str path))) (long offset))]
+                               (if (= datatype :bit)
+                                 (* 8 file-bytes)
+                                 (quot file-bytes (datatype->byte-count datatype 1))))))
+        ;;A zero size asks the native side for the rest of the file
+        _ (when-not (pos? elem-count)
+            (throw (ex-info "Nothing to map"
+                            {:path (str path)
+                             :offset offset
+                             :elem-count elem-count})))
+        data (.map_file manager (str path) (int (->cpp-map-mode mode))
+                        (long offset) (datatype->byte-count datatype elem-count))]
+    (resource/track (->TypedBuffer data elem-count datatype manager))))
+
+
+(defn- element-byte-range
+  "[byte-offset byte-count] of the bytes holding elements [offset, offset +
+elem-count) of a buffer of datatype."
+  [datatype ^long offset ^long elem-count]
+  (let [begin (if (= datatype :bit)
+                (quot offset 8)
+                (datatype->byte-count datatype offset))]
+    [begin (- (datatype->byte-count datatype (+ offset elem-count)) begin)]))
+
+
+(defn flush-buffer!
+  "Write modified pages of a file or shared buffer back to its file."
+  ([^TypedBuffer buf offset elem-count async?]
+   (check-buffer-access (.size buf) offset elem-count)
+   (let [[byte-offset byte-count] (element-byte-range (.datatype buf) offset elem-count)]
+     (.flush_buffer ^ByteBuffer$BufferManager (.manager buf) (.data buf)
+                    (long byte-offset) (long byte-count) (boolean async?))))
+  ([^TypedBuffer buf]
+   (flush-buffer! buf 0 (.size buf) false)))
+
+
+(defn advise-buffer!
+  "Hint the expected access pattern (:normal :sequential :random :will-need
+:dont-need) for a range of a file or shared buffer.  :dont-need only drops
+pages lying entirely inside the range and is refused for :copy-on-write
+mappings."
+  ([^TypedBuffer buf advice offset elem-count]
+   (check-buffer-access (.size buf) offset elem-count)
+   (let [[byte-offset byte-count] (element-byte-range (.datatype buf) offset elem-count)]
+     (.advise_buffer ^ByteBuffer$BufferManager (.manager buf) (.data buf)
+                     (long byte-offset) (long byte-count)
+                     (int (->cpp-access-advice advice)))))
+  ([^TypedBuffer buf advice]
+   (advise-buffer! buf advice 0 (.size buf))))
+
+
+(defn set-shared-metadata!
+  "Publish the datatype and the element range of a shared buffer to every
+process attached to it."
+  [^TypedBuffer buf offset elem-count]
+  (.set_shared_metadata ^ByteBuffer$BufferManager (.manager buf) (.data buf)
+                        (int (->cpp-datatype (.datatype buf)))
+                        (long offset) (long elem-count)))
+
+
+(defn make-shared-buffer
+  "Make a typed buffer in shared memory.  Without a :name the buffer is an
+anonymous memfd; pass (shared-buffer-fd buf) to the other process.  With a
+:name other processes attach to it by name."
+  [datatype elem-count & {:keys [name]}]
+  (let [manager (default-manager)
+        elem-count (long elem-count)
+        data (.allocate_shared_buffer manager (str name)
+                                      (datatype->byte-count datatype elem-count))
+        retval (->TypedBuffer data elem-count datatype manager)]
+    (set-shared-metadata! retval 0 elem-count)
     (resource/track retval)))
+
+
+(defn shared-buffer-fd
+  ^long [^TypedBuffer buf]
+  (.shared_buffer_fd ^ByteBuffer$BufferManager (.manager buf) (.data buf)))
+
+
+(defn attach-shared-buffer
+  "Attach to a shared buffer by name or file descriptor.  The returned typed
+buffer covers the range described by the buffer's shared metadata."
+  [name-or-fd & {:keys [read-only?]}]
+  (let [manager (default-manager)
+        data (if (number? name-or-fd)
+               (.attach_shared_buffer manager (int name-or-fd) (boolean read-only?))
+               (.attach_shared_buffer manager (str name-or-fd) (boolean read-only?)))
+        metadata (long-array 5)
+        _ (.get_shared_metadata manager data metadata)
+        datatype (cpp-datatype-> (aget metadata 0))
+        offset (aget metadata 1)
+        elem-count (aget metadata 2)
+        parent (resource/track (->TypedBuffer data (+ offset elem-count) datatype manager))]
+    (dtype/->view-impl parent offset elem-count)))
+
+
+(defn unlink-shared-buffer
+  [name]
+  (.unlink_shared_buffer (default-manager) (str name)))
+
+
+(defn- ->cpp-reduce-op
+  ^long [op]
+  (condp = op
+    :sum ByteBuffer$ReduceOp/Sum
+    :min ByteBuffer$ReduceOp/Min
+    :max ByteBuffer$ReduceOp/Max
+    :mean ByteBuffer$ReduceOp/Mean))
+
+
+(defn reduce-buffer
+  "Reduce a range of a typed buffer natively; op is one of :sum :min :max :mean."
+  (^double [^TypedBuffer buf op offset elem-count]
+   (check-buffer-access (.size buf) offset elem-count)
+   (.reduce ^ByteBuffer$BufferManager (.manager buf) (.data buf)
+            (int (->cpp-datatype (.datatype buf))) (long offset) (long elem-count)
+            (int (->cpp-reduce-op op))))
+  (^double [^TypedBuffer buf op]
+   (reduce-buffer buf op 0 (.size buf))))
+
+
+(defn argmin
+  "Index of the first minimum in the range (relative to offset)."
+  (^long [^TypedBuffer buf offset elem-count]
+   (check-buffer-access (.size buf) offset elem-count)
+   (.argmin ^ByteBuffer$BufferManager (.manager buf) (.data buf)
+            (int (->cpp-datatype (.datatype buf))) (long offset) (long elem-count)))
+  (^long [^TypedBuffer buf]
+   (argmin buf 0 (.size buf))))
+
+
+(defn argmax
+  "Index of the first maximum in the range (relative to offset)."
+  (^long [^TypedBuffer buf offset elem-count]
+   (check-buffer-access (.size buf) offset elem-count)
+   (.argmax ^ByteBuffer$BufferManager (.manager buf) (.data buf)
+            (int (->cpp-datatype (.datatype buf))) (long offset) (long elem-count)))
+  (^long [^TypedBuffer buf]
+   (argmax buf 0 (.size buf))))
+
+
+(defn- ->cpp-binary-op
+  ^long [op]
+  (condp = op
+    :add ByteBuffer$BinaryOp/Add
+    :sub ByteBuffer$BinaryOp/Sub
+    :mul ByteBuffer$BinaryOp/Mul
+    :div ByteBuffer$BinaryOp/Div
+    :min ByteBuffer$BinaryOp/Min
+    :max ByteBuffer$BinaryOp/Max))
+
+
+(defn- ->cpp-unary-op
+  ^long [op]
+  (condp = op
+    :abs ByteBuffer$UnaryOp/Abs
+    :sqrt ByteBuffer$UnaryOp/Sqrt
+    :exp ByteBuffer$UnaryOp/Exp
+    :negate ByteBuffer$UnaryOp/Negate))
+
+
+(defn binary-op!
+  "dst = lhs op rhs element-wise where op is one of :add :sub :mul :div :min :max
+and rhs is either a typed buffer or a number.  dst may be lhs or rhs.  Mixed
+datatypes are promoted and the result cast into dst like copy! does."
+  [op ^TypedBuffer lhs rhs ^TypedBuffer dst]
+  (let [n-elems (.size dst)]
+    (check-buffer-access (.size lhs) 0 n-elems)
+    (if (number? rhs)
+      (.scalar_op ^ByteBuffer$BufferManager (.manager dst)
+                  (.data lhs) (int (->cpp-datatype (.datatype lhs))) 0
+                  (double rhs)
+                  (.data dst) (int (->cpp-datatype (.datatype dst))) 0
+                  n-elems (int (->cpp-binary-op op)))
+      (let [^TypedBuffer rhs rhs]
+        (check-buffer-access (.size rhs) 0 n-elems)
+        (.binary_op ^ByteBuffer$BufferManager (.manager dst)
+                    (.data lhs) (int (->cpp-datatype (.datatype lhs))) 0
+                    (.data rhs) (int (->cpp-datatype (.datatype rhs))) 0
+                    (.data dst) (int (->cpp-datatype (.datatype dst))) 0
+                    n-elems (int (->cpp-binary-op op)))))
+    dst))
+
+
+(defn add! [lhs rhs dst] (binary-op! :add lhs rhs dst))
+(defn sub! [lhs rhs dst] (binary-op! :sub lhs rhs dst))
+(defn mul! [lhs rhs dst] (binary-op! :mul lhs rhs dst))
+(defn div! [lhs rhs dst] (binary-op! :div lhs rhs dst))
+(defn scale! [buf scalar] (binary-op! :mul buf scalar buf))
+
+
+(defn unary-op!
+  "dst = (op src) element-wise where op is one of :abs :sqrt :exp :negate."
+  [op ^TypedBuffer src ^TypedBuffer dst]
+  (let [n-elems (.size dst)]
+    (check-buffer-access (.size src) 0 n-elems)
+    (.unary_op ^ByteBuffer$BufferManager (.manager dst)
+               (.data src) (int (->cpp-datatype (.datatype src))) 0
+               (.data dst) (int (->cpp-datatype (.datatype dst))) 0
+               n-elems (int (->cpp-unary-op op)))
+    dst))
+
+
+(defn clamp!
+  [^TypedBuffer src low high ^TypedBuffer dst]
+  (let [n-elems (.size dst)]
+    (check-buffer-access (.size src) 0 n-elems)
+    (.clamp ^ByteBuffer$BufferManager (.manager dst)
+            (.data src) (int (->cpp-datatype (.datatype src))) 0
+            (double low) (double high)
+            (.data dst) (int (->cpp-datatype (.datatype dst))) 0
+            n-elems)
+    dst))
+
+
+(defn axpy!
+  "y += alpha * x"
+  [alpha ^TypedBuffer x ^TypedBuffer y]
+  (let [n-elems (.size y)]
+    (check-buffer-access (.size x) 0 n-elems)
+    (.axpy ^ByteBuffer$BufferManager (.manager y) (double alpha)
+           (.data x) (int (->cpp-datatype (.datatype x))) 0
+           (.data y) (int (->cpp-datatype (.datatype y))) 0
+           n-elems)
+    y))
+
+
+;;Lazy element-wise expressions.  An expression is a source buffer plus a
+;;chain of stages; nothing is computed until eval-expr! runs the whole chain
+;;natively in a single pass into the destination.
+(defrecord Expression [inputs stages])
+
+
+(defn expr
+  "Start an expression reading from the typed buffer src."
+  [src]
+  (->Expression [src] []))
+
+
+(defn- add-stage
+  [expression op a b]
+  (update expression :stages conj [op (double a) (double b)]))
+
+
+(defn- add-operand-stage
+  [expression scalar-op input-op operand]
+  (if (number? operand)
+    (add-stage expression scalar-op operand 0)
+    (-> expression
+        (add-stage input-op (count (:inputs expression)) 0)
+        (update :inputs conj operand))))
+
+
+(defn expr-add [e operand] (add-operand-stage e ByteBuffer$ExprOp/Add ByteBuffer$ExprOp/AddInput operand))
+(defn expr-sub [e operand] (add-operand-stage e ByteBuffer$ExprOp/Sub ByteBuffer$ExprOp/SubInput operand))
+(defn expr-mul [e operand] (add-operand-stage e ByteBuffer$ExprOp/Mul ByteBuffer$ExprOp/MulInput operand))
+(defn expr-div [e operand] (add-operand-stage e ByteBuffer$ExprOp/Div ByteBuffer$ExprOp/DivInput operand))
+(defn expr-min [e scalar] (add-stage e ByteBuffer$ExprOp/Min scalar 0))
+(defn expr-max [e scalar] (add-stage e ByteBuffer$ExprOp/Max scalar 0))
+(defn expr-mul-add [e scale bias] (add-stage e ByteBuffer$ExprOp/MulAdd scale bias))
+(defn expr-clamp [e low high] (add-stage e ByteBuffer$ExprOp/Clamp low high))
+(defn expr-abs [e] (add-stage e ByteBuffer$ExprOp/Abs 0 0))
+(defn expr-sqrt [e] (add-stage e ByteBuffer$ExprOp/Sqrt 0 0))
+(defn expr-exp [e] (add-stage e ByteBuffer$ExprOp/Exp 0 0))
+(defn expr-negate [e] (add-stage e ByteBuffer$ExprOp/Negate 0 0))
+(defn expr-cast
+  "Round values through datatype, as storing into and reading back from a buffer
+of that type would."
+  [e datatype]
+  (add-stage e ByteBuffer$ExprOp/Cast (->cpp-datatype datatype) 0))
+
+
+(defn eval-expr!
+  "Evaluate the expression into the typed buffer dst."
+  [{:keys [inputs stages]} ^TypedBuffer dst]
+  (let [n-elems (.size dst)]
+    (doseq [^TypedBuffer input inputs]
+      (check-buffer-access (.size input) 0 n-elems))
+    (.evaluate_expression ^ByteBuffer$BufferManager (.manager dst)
+                          (long-array (map #(.data ^TypedBuffer %) inputs))
+                          (int-array (map #(->cpp-datatype (.datatype ^TypedBuffer %)) inputs))
+                          (long-array (count inputs))
+                          (int (count inputs))
+                          (int-array (map first stages))
+                          (double-array (mapcat rest stages))
+                          (int (count stages))
+                          (.data dst) (int (->cpp-datatype (.datatype dst))) 0
+                          n-elems)
+    dst))
+
+
+(defn hash-range
+  "xxHash64 of the bytes of a range of a typed buffer."
+  (^long [^TypedBuffer buf offset elem-count seed]
+   (check-buffer-access (.size buf) offset elem-count)
+   (.hash_range ^ByteBuffer$BufferManager (.manager buf) (.data buf)
+                (int (->cpp-datatype (.datatype buf))) (long offset) (long elem-count)
+                (long seed)))
+  (^long [^TypedBuffer buf]
+   (hash-range buf 0 (.size buf) 0)))
+
+
+(defn equals-range?
+  "Value equality of two typed buffer ranges, across datatypes.  NaN equals NaN
+when nan-equal? is true."
+  ([^TypedBuffer lhs lhs-offset ^TypedBuffer rhs rhs-offset elem-count nan-equal?]
+   (check-buffer-access (.size lhs) lhs-offset elem-count)
+   (check-buffer-access (.size rhs) rhs-offset elem-count)
+   (.equals_range ^ByteBuffer$BufferManager (.manager lhs)
+                  (.data lhs) (int (->cpp-datatype (.datatype lhs))) (long lhs-offset)
+                  (.data rhs) (int (->cpp-datatype (.datatype rhs))) (long rhs-offset)
+                  (long elem-count) (boolean nan-equal?)))
+  ([^TypedBuffer lhs ^TypedBuffer rhs]
+   (and (= (.size lhs) (.size rhs))
+        (equals-range? lhs 0 rhs 0 (.size lhs) true))))
+
+(defn permute-copy!
+  "Copy the tensor of the given shape and element strides starting at src-offset
+in src into dst (from dst-offset) with its dimensions reordered; dimension j of
+the result is dimension (nth permutation j) of the source.  NCHW -> NHWC is
+[0 2 3 1]."
+  [^TypedBuffer src src-offset shape src-strides permutation ^TypedBuffer dst dst-offset]
+  (let [n-dims (count shape)
+        elem-count (long (reduce * 1 shape))
+        max-src-offset (long (reduce + 0 (map (fn [dim stride]
+                                                (* (max 0 (dec (long dim))) (long stride)))
+                                              shape src-strides)))]
+    (when-not (and (= n-dims (count src-strides)) (= n-dims (count permutation)))
+      (throw (ex-info "Shape, strides and permutation must have the same length"
+                      {:shape shape :src-strides src-strides :permutation permutation})))
+    (when (some neg? src-strides)
+      (throw (ex-info "Negative strides are not supported" {:src-strides src-strides})))
+    (when (> elem-count 0)
+      (check-buffer-access (.size src) src-offset (inc max-src-offset)))
+    (check-buffer-access (.size dst) dst-offset elem-count)
+    (.permute_copy ^ByteBuffer$BufferManager (.manager src)
+                   (.data src) (int (->cpp-datatype (.datatype src))) (long src-offset)
+                   (long-array shape) (long-array src-strides) (int-array permutation)
+                   (int n-dims)
+                   (.data dst) (int (->cpp-datatype (.datatype dst))) (long dst-offset))
+    dst))
+
+
+(defn- check-planes
+  [planes elem-count]
+  (when (empty? planes)
+    (throw (ex-info "At least one plane is required" {})))
+  (when-not (apply = (map #(.datatype ^TypedBuffer %) planes))
+    (throw (ex-info "Planes must share a datatype"
+                    {:datatypes (map #(.datatype ^TypedBuffer %) planes)})))
+  (doseq [^TypedBuffer plane planes]
+    (check-buffer-access (.size plane) 0 elem-count)))
+
+
+(defn deinterleave!
+  "Split elem-count groups of (count planes) interleaved values in src, starting
+at element src-offset, into the planes (typed buffers of one datatype).  RGBRGB...
+becomes RR..., GG..., BB...  Values are converted as copy! does."
+  ([^TypedBuffer src src-offset planes elem-count]
+   (let [n-channels (count planes)
+         ^TypedBuffer plane (first planes)]
+     (check-planes planes elem-count)
+     (check-buffer-access (.size src) src-offset (* (long elem-count) n-channels))
+     (.deinterleave ^ByteBuffer$BufferManager (.manager src)
+                    (.data src) (int (->cpp-datatype (.datatype src))) (long src-offset)
+                    (int n-channels) (long-array (map #(.data ^TypedBuffer %) planes))
+                    (long-array n-channels) (int (->cpp-datatype (.datatype plane)))
+                    (long elem-count))
+     planes))
+  ([^TypedBuffer src planes]
+   (deinterleave! src 0 planes (quot (.size src) (count planes)))))
+
+
+(defn interleave!
+  "Merge elem-count values from each of the planes into dst as interleaved groups
+starting at element dst-offset; the inverse of deinterleave!."
+  ([planes ^TypedBuffer dst dst-offset elem-count]
+   (let [n-channels (count planes)
+         ^TypedBuffer plane (first planes)]
+     (check-planes planes elem-count)
+     (check-buffer-access (.size dst) dst-offset (* (long elem-count) n-channels))
+     (.interleave ^ByteBuffer$BufferManager (.manager dst)
+                  (long-array (map #(.data ^TypedBuffer %) planes)) (long-array n-channels)
+                  (int (->cpp-datatype (.datatype plane))) (int n-channels)
+                  (.data dst) (int (->cpp-datatype (.datatype dst))) (long dst-offset)
+                  (long elem-count))
+     dst))
+  ([planes ^TypedBuffer dst]
+   (interleave! planes dst 0 (quot (.size dst) (count planes)))))
+
+
+(defn- ->cpp-bit-op
+  ^long [op]
+  (condp = op
+    :and ByteBuffer$BitOp/And
+    :or ByteBuffer$BitOp/Or
+    :xor ByteBuffer$BitOp/Xor
+    :and-not ByteBuffer$BitOp/AndNot
+    :not ByteBuffer$BitOp/Not))
+
+
+(defn- check-bit-buffer
+  [^TypedBuffer buf]
+  (when-not (= :bit (.datatype buf))
+    (throw (ex-info "Expected a :bit buffer" {:datatype (.datatype buf)}))))
+
+
+(defn bit-op!
+  "dst = lhs op rhs over whole :bit buffers of one size, op one of :and :or :xor
+:and-not.  (bit-op! :not src dst) inverts src into dst."
+  ([op ^TypedBuffer lhs ^TypedBuffer rhs ^TypedBuffer dst]
+   (doseq [buf [lhs rhs dst]]
+     (check-bit-buffer buf))
+   (check-buffer-access (.size lhs) 0 (.size dst))
+   (check-buffer-access (.size rhs) 0 (.size dst))
+   (.bit_op ^ByteBuffer$BufferManager (.manager dst)
+            (.data lhs) 0 (.data rhs) 0 (.data dst) 0
+            (.size dst) (int (->cpp-bit-op op)))
+   dst)
+  ([op ^TypedBuffer src ^TypedBuffer dst]
+   (when-not (= op :not)
+     (throw (ex-info "Only :not takes a single operand" {:op op})))
+   (check-bit-buffer src)
+   (check-bit-buffer dst)
+   (check-buffer-access (.size src) 0 (.size dst))
+   (.bit_op ^ByteBuffer$BufferManager (.manager dst)
+            (.data src) 0 0 0 (.data dst) 0
+            (.size dst) (int (->cpp-bit-op op)))
+   dst))
+
+
+(defn popcount
+  "Number of set bits in a range of a :bit buffer."
+  (^long [^TypedBuffer buf offset elem-count]
+   (check-bit-buffer buf)
+   (check-buffer-access (.size buf) offset elem-count)
+   (.popcount ^ByteBuffer$BufferManager (.manager buf) (.data buf)
+              (long offset) (long elem-count)))
+  (^long [^TypedBuffer buf]
+   (popcount buf 0 (.size buf))))
+
+
+(defn- ->cpp-integer-codec
+  ^long [codec]
+  (condp = codec
+    :delta-varint ByteBuffer$IntegerCodec/DeltaVarint
+    :frame-of-reference ByteBuffer$IntegerCodec/FrameOfReference
+    :delta-frame-of-reference ByteBuffer$IntegerCodec/DeltaFrameOfReference))
+
+
+(defn encode-integers
+  "Compress an integer typed buffer into a new :byte typed buffer.  codec is one
+of :delta-varint (sorted or slowly changing values such as timestamps),
+:frame-of-reference (values in a narrow range such as ids) or
+:delta-frame-of-reference."
+  ([^TypedBuffer src offset elem-count codec]
+   (check-buffer-access (.size src) offset elem-count)
+   (let [manager ^ByteBuffer$BufferManager (.manager src)
+         cpp-codec (int (->cpp-integer-codec codec))
+         capacity (.max_encoded_size manager cpp-codec (long elem-count))
+         scratch (.allocate_buffer manager capacity "byte-buffer.clj" 784)
+         n-bytes (try
+                   (.encode_integers manager (.data src) (int (->cpp-datatype (.datatype src)))
+                                     (long offset) (long elem-count) cpp-codec
+                                     scratch capacity)
+                   (catch Throwable e
+                     (.release_buffer manager scratch)
+                     (throw e)))
+         data (.resize_buffer manager scratch (max 1 n-bytes))]
+     (resource/track (->TypedBuffer data n-bytes :byte manager))))
+  ([^TypedBuffer src codec]
+   (encode-integers src 0 (.size src) codec)))
+
+
+(defn decoded-count
+  "Number of values held by an encoded :byte buffer."
+  ^long [^TypedBuffer encoded]
+  (.decoded_count ^ByteBuffer$BufferManager (.manager encoded) (.data encoded) (.size encoded)))
+
+
+(defn decode-integers!
+  "Decode an encoded :byte buffer into dst starting at dst-offset.  Returns dst."
+  ([^TypedBuffer encoded ^TypedBuffer dst dst-offset]
+   (check-buffer-access (.size dst) dst-offset (decoded-count encoded))
+   (.decode_integers ^ByteBuffer$BufferManager (.manager encoded)
+                     (.data encoded) (.size encoded)
+                     (.data dst) (int (->cpp-datatype (.datatype dst))) (long dst-offset)
+                     (- (.size dst) (long dst-offset)))
+   dst)
+  ([^TypedBuffer encoded ^TypedBuffer dst]
+   (decode-integers! encoded dst 0)))
+
+
+(defn decode-integers
+  "Decode an encoded :byte buffer into a new typed buffer of datatype."
+  [^TypedBuffer encoded datatype]
+  (decode-integers! encoded (make-typed-buffer datatype (decoded-count encoded))))
+
+
+(defn compress-buffer
+  "Compress a range of a typed buffer into a new :byte typed buffer.  Options:
+:shuffle? - byte shuffle each block first (default true); numeric data usually
+  compresses much better shuffled.
+:block-bytes - uncompressed bytes per independently compressed block."
+  [^TypedBuffer src & {:keys [offset elem-count shuffle? block-bytes]
+                       :or {offset 0 shuffle? true block-bytes 0}}]
+  (let [elem-count (long (or elem-count (- (.size src) (long offset))))
+        _ (check-buffer-access (.size src) offset elem-count)
+        manager ^ByteBuffer$BufferManager (.manager src)
+        cpp-type (int (->cpp-datatype (.datatype src)))
+        capacity (.max_compressed_size manager cpp-type elem-count (long block-bytes))
+        scratch (.allocate_buffer manager capacity "byte-buffer.clj" 835)
+        n-bytes (try
+                  (.compress_buffer manager (.data src) cpp-type (long offset) elem-count
+                                    (long block-bytes) (boolean shuffle?) scratch capacity)
+                  (catch Throwable e
+                    (.release_buffer manager scratch)
+                    (throw e)))
+        data (.resize_buffer manager scratch n-bytes)]
+    (resource/track (->TypedBuffer data n-bytes :byte manager))))
+
+
+(defn compressed-datatype
+  [^TypedBuffer compressed]
+  (cpp-datatype-> (.compressed_datatype ^ByteBuffer$BufferManager (.manager compressed)
+                                        (.data compressed) (.size compressed))))
+
+
+(defn compressed-count
+  ^long [^TypedBuffer compressed]
+  (.compressed_count ^ByteBuffer$BufferManager (.manager compressed)
+                     (.data compressed) (.size compressed)))
+
+
+(defn decompress-buffer!
+  "Decompress into dst starting at dst-offset, converting to dst's datatype if
+needed.  Returns dst."
+  ([^TypedBuffer compressed ^TypedBuffer dst dst-offset]
+   (check-buffer-access (.size dst) dst-offset (compressed-count compressed))
+   (.decompress_buffer ^ByteBuffer$BufferManager (.manager compressed)
+                       (.data compressed) (.size compressed)
+                       (.data dst) (int (->cpp-datatype (.datatype dst))) (long dst-offset)
+                       (- (.size dst) (long dst-offset)))
+   dst)
+  ([^TypedBuffer compressed ^TypedBuffer dst]
+   (decompress-buffer! compressed dst 0)))
+
+
+(defn decompress-buffer
+  "Decompress into a new typed buffer of the original datatype."
+  [^TypedBuffer compressed]
+  (decompress-buffer! compressed (make-typed-buffer (compressed-datatype compressed)
+                                                    (compressed-count compressed))))
+
+
+(defn- ->cpp-quant-scheme
+  ^long [scheme]
+  (condp = scheme
+    :symmetric ByteBuffer$QuantScheme/Symmetric
+    :asymmetric ByteBuffer$QuantScheme/Asymmetric))
+
+
+(defn- check-quant-params
+  [{:keys [scales zero-points channels inner-size]}]
+  (when-not (and (pos? (long channels)) (pos? (long inner-size))
+                 (= (long channels) (count scales) (count zero-points)))
+    (throw (ex-info "Quantization needs a scale and zero point per channel"
+                    {:channels channels :inner-size inner-size}))))
+
+
+(defn calibrate-quantization
+  "Fit int8 quantization parameters to a range of a :float or :double typed
+buffer.  Returns a map of :scales, :zero-points (one per channel), :signed?,
+:channels and :inner-size for quantize and dequantize.  Options:
+:scheme - :symmetric (zero maps to zero, the usual choice for weights) or
+  :asymmetric (the range is mapped onto all 256 values, for activations).
+:signed? - int8 (default) rather than uint8 values.
+:percentile - clip to this percentile of the values instead of their min/max
+  (default 100), trading outliers for resolution.
+:channels, :inner-size - per channel parameters: element i belongs to channel
+  (i / inner-size) % channels.  For a row major tensor quantized along axis k
+  inner-size is the product of the dimensions after k."
+  [^TypedBuffer src & {:keys [offset elem-count scheme signed? percentile channels inner-size]
+                       :or {offset 0 scheme :symmetric signed? true percentile 100
+                            channels 1 inner-size 1}}]
+  (let [elem-count (long (or elem-count (- (.size src) (long offset))))
+        _ (check-buffer-access (.size src) offset elem-count)
+        scales (double-array channels)
+        zero-points (int-array channels)]
+    (.calibrate_quantization ^ByteBuffer$BufferManager (.manager src)
+                             (.data src) (int (->cpp-datatype (.datatype src))) (long offset)
+                             elem-count (long channels) (long inner-size)
+                             (int (->cpp-quant-scheme scheme)) (boolean signed?)
+                             (double percentile) scales zero-points)
+    {:scales (vec scales)
+     :zero-points (vec zero-points)
+     :signed? (boolean signed?)
+     :channels (long channels)
+     :inner-size (long inner-size)}))
+
+
+(defn quantize!
+  "Quantize elem-count values of a :float or :double buffer from src-offset into
+the :byte buffer dst at dst-offset.  Values outside the representable range
+saturate and NaN becomes the zero point.  Returns dst."
+  [^TypedBuffer src src-offset {:keys [scales zero-points signed? channels inner-size]
+                                :as params}
+   ^TypedBuffer dst dst-offset elem-count]
+  (check-quant-params params)
+  (check-buffer-access (.size src) src-offset elem-count)
+  (check-buffer-access (.size dst) dst-offset elem-count)
+  (when-not (= :byte (.datatype dst))
+    (throw (ex-info "Quantized values are stored in :byte buffers" {:datatype (.datatype dst)})))
+  (.quantize ^ByteBuffer$BufferManager (.manager src)
+             (.data src) (int (->cpp-datatype (.datatype src))) (long src-offset)
+             (long elem-count) (long channels) (long inner-size)
+             (double-array scales) (int-array zero-points)
+             (.data dst) (long dst-offset) (boolean signed?))
+  dst)
+
+
+(defn quantize
+  "Quantize all of src into a new :byte typed buffer."
+  [^TypedBuffer src params]
+  (quantize! src 0 params (make-typed-buffer :byte (.size src)) 0 (.size src)))
+
+
+(defn dequantize!
+  "Inverse of quantize!: (value - zero point) * scale into the :float or :double
+buffer dst.  Returns dst."
+  [^TypedBuffer src src-offset {:keys [scales zero-points signed? channels inner-size]
+                                :as params}
+   ^TypedBuffer dst dst-offset elem-count]
+  (check-quant-params params)
+  (check-buffer-access (.size src) src-offset elem-count)
+  (check-buffer-access (.size dst) dst-offset elem-count)
+  (when-not (= :byte (.datatype src))
+    (throw (ex-info "Quantized values are stored in :byte buffers" {:datatype (.datatype src)})))
+  (.dequantize ^ByteBuffer$BufferManager (.manager src)
+               (.data src) (long src-offset) (boolean signed?)
+               (long elem-count) (long channels) (long inner-size)
+               (double-array scales) (int-array zero-points)
+               (.data dst) (int (->cpp-datatype (.datatype dst))) (long dst-offset))
+  dst)
+
+
+(defn dequantize
+  "Dequantize all of src into a new typed buffer of datatype (default :float)."
+  ([^TypedBuffer src params datatype]
+   (dequantize! src 0 params (make-typed-buffer datatype (.size src)) 0 (.size src)))
+  ([^TypedBuffer src params]
+   (dequantize src params :float)))
+
+
+(defn- check-sort-indices
+  [^TypedBuffer indices elem-count]
+  (when-not (#{:int :long} (.datatype indices))
+    (throw (ex-info "Sort indices must be :int or :long" {:datatype (.datatype indices)})))
+  (check-buffer-access (.size indices) 0 elem-count))
+
+
+(defn sort-buffer!
+  "Stable native radix sort of a range of buf in place.  NaN sorts last.
+Options:
+:descending? - largest first.
+:indices - an :int or :long typed buffer that receives the permutation applied;
+  (nth indices i) is the original position (relative to offset) of the value
+  that ends up at i.
+Returns buf."
+  [^TypedBuffer buf & {:keys [offset elem-count descending? indices]
+                       :or {offset 0 descending? false}}]
+  (let [elem-count (long (or elem-count (- (.size buf) (long offset))))
+        _ (check-buffer-access (.size buf) offset elem-count)
+        ^TypedBuffer indices indices]
+    (when indices
+      (check-sort-indices indices elem-count))
+    (.sort ^ByteBuffer$BufferManager (.manager buf)
+           (.data buf) (int (->cpp-datatype (.datatype buf))) (long offset) elem-count
+           (boolean descending?)
+           (if indices (.data indices) 0)
+           (int (->cpp-datatype (if indices (.datatype indices) :long)))
+           0)
+    buf))
+
+
+(defn argsort
+  "Permutation that would sort a range of buf, as a new typed buffer of
+index-datatype (:int unless the range is too long for it).  buf is left
+unchanged.  Options as sort-buffer!."
+  [^TypedBuffer buf & {:keys [offset elem-count descending? index-datatype]
+                       :or {offset 0 descending? false}}]
+  (let [elem-count (long (or elem-count (- (.size buf) (long offset))))
+        _ (check-buffer-access (.size buf) offset elem-count)
+        index-datatype (or index-datatype
+                           (if (> elem-count Integer/MAX_VALUE) :long :int))
+        ^TypedBuffer indices (make-typed-buffer index-datatype elem-count)]
+    (check-sort-indices indices elem-count)
+    (.argsort ^ByteBuffer$BufferManager (.manager buf)
+              (.data buf) (int (->cpp-datatype (.datatype buf))) (long offset) elem-count
+              (boolean descending?)
+              (.data indices) (int (->cpp-datatype index-datatype)) 0)
+    indices))
+
+
+(defn top-k
+  "The k largest values of a range of buf without sorting it, best first with
+ties going to the earlier element.  Returns {:values :indices} as new typed
+buffers; :values has buf's datatype and :indices holds positions relative to
+offset.  Options:
+:largest? - false selects the k smallest instead.
+:index-datatype - :int (default) or :long."
+  [^TypedBuffer buf k & {:keys [offset elem-count largest? index-datatype]
+                         :or {offset 0 largest? true index-datatype :int}}]
+  (let [elem-count (long (or elem-count (- (.size buf) (long offset))))
+        _ (check-buffer-access (.size buf) offset elem-count)
+        k (long k)
+        _ (when-not (<= 0 k elem-count)
+            (throw (ex-info "k must be between 0 and the element count"
+                            {:k k :elem-count elem-count})))
+        ^TypedBuffer values (make-typed-buffer (.datatype buf) k)
+        ^TypedBuffer indices (make-typed-buffer index-datatype k)]
+    (check-sort-indices indices k)
+    (.top_k ^ByteBuffer$BufferManager (.manager buf)
+            (.data buf) (int (->cpp-datatype (.datatype buf))) (long offset) elem-count
+            k (boolean largest?)
+            (.data values) (int (->cpp-datatype (.datatype values))) 0
+            (.data indices) (int (->cpp-datatype index-datatype)) 0)
+    {:values values
+     :indices indices}))
+
+
+(defn scan!
+  "Prefix sums of src into dst (which may be src) over dst's length.  Element i
+of dst is the sum of src[0..i], or of src[0..i) when exclusive? (offsets from
+counts).  Sums accumulate in the wider of the two datatypes, so an :int
+source can be scanned into a :long destination without overflow.  Returns
+dst."
+  [^TypedBuffer src ^TypedBuffer dst & {:keys [exclusive?] :or {exclusive? false}}]
+  (let [n-elems (.size dst)]
+    (check-buffer-access (.size src) 0 n-elems)
+    (.scan ^ByteBuffer$BufferManager (.manager dst)
+           (.data src) (int (->cpp-datatype (.datatype src))) 0
+           (.data dst) (int (->cpp-datatype (.datatype dst))) 0
+           n-elems (boolean exclusive?))
+    dst))
+
+
+(defn scan
+  "Prefix sums of src into a new typed buffer of datatype, by default :long for
+integer sources and :double for float ones."
+  [^TypedBuffer src & {:keys [exclusive? datatype] :or {exclusive? false}}]
+  (let [datatype (or datatype (if (#{:float :double} (.datatype src)) :double :long))]
+    (scan! src (make-typed-buffer datatype (.size src)) :exclusive? exclusive?)))
+
+
+(defn histogram
+  "Counts of a range of buf as a long array.  Bins are either :bins equal bins
+over :range [low high] or the bins between increasing :edges; the last bin
+includes its upper edge.  NaN and values outside the bins are not counted.
+The default range is the min and max of the values that are not NaN, widened
+to [v, v + 1] when they are all v; without any such values every bin is
+empty."
+  [^TypedBuffer buf & {:keys [offset elem-count bins edges] value-range :range
+                       :or {offset 0}}]
+  (let [elem-count (long (or elem-count (- (.size buf) (long offset))))
+        _ (check-buffer-access (.size buf) offset elem-count)
+        manager ^ByteBuffer$BufferManager (.manager buf)
+        cpp-type (int (->cpp-datatype (.datatype buf)))]
+    (if edges
+      (let [counts (long-array (max 0 (dec (count edges))))]
+        (.histogram manager (.data buf) cpp-type (long offset) elem-count
+                    (double-array edges) (long (count edges)) counts)
+        counts)
+      (let [bins (long (or bins (throw (ex-info "Either :bins or :edges is required" {}))))
+            ;;One statistics pass gives the bounds without the NaN values
+            state (when-not value-range
+                    (let [state (double-array 6)]
+                      (.accumulate_statistics manager (.data buf) cpp-type (long offset)
+                                              elem-count state)
+                      state))
+            [low high] (or value-range
+                           (let [low (aget ^doubles state 3)
+                                 high (aget ^doubles state 4)]
+                             [low (if (= low high) (+ low 1.0) high)]))
+            counts (long-array bins)]
+        (when (or value-range (pos? (aget ^doubles state 0)))
+          (.histogram manager (.data buf) cpp-type (long offset) elem-count
+                      bins (double low) (double high) counts))
+        counts))))
+
+
+(defn bincount
+  "Occurrences of each integer in [0, n-bins) in an integer buffer, as a long
+array.  Values outside that range are ignored."
+  [^TypedBuffer buf n-bins & {:keys [offset elem-count] :or {offset 0}}]
+  (let [elem-count (long (or elem-count (- (.size buf) (long offset))))
+        _ (check-buffer-access (.size buf) offset elem-count)
+        counts (long-array n-bins)]
+    (.bincount ^ByteBuffer$BufferManager (.manager buf)
+               (.data buf) (int (->cpp-datatype (.datatype buf))) (long offset) elem-count
+               (long n-bins) counts)
+    counts))
+
+
+(defn- ->cpp-checksum-type
+  ^long [algorithm]
+  (condp = algorithm
+    :crc32c ByteBuffer$ChecksumType/Crc32c
+    :xxhash64 ByteBuffer$ChecksumType/XxHash64))
+
+
+(defn checksum
+  "Checksum of the bytes of a range of buf.  Options:
+:algorithm - :crc32c (default; standard CRC32C, hardware accelerated) or
+  :xxhash64.
+:seed - for :crc32c the checksum of preceding bytes to continue from, for
+  :xxhash64 the hash seed."
+  ^long [^TypedBuffer buf & {:keys [offset elem-count algorithm seed]
+                             :or {offset 0 algorithm :crc32c seed 0}}]
+  (let [elem-count (long (or elem-count (- (.size buf) (long offset))))]
+    (check-buffer-access (.size buf) offset elem-count)
+    (.checksum_range ^ByteBuffer$BufferManager (.manager buf)
+                     (.data buf) (int (->cpp-datatype (.datatype buf))) (long offset) elem-count
+                     (int (->cpp-checksum-type algorithm)) (long seed))))
+
+
+(defn copy-with-checksum!
+  "Copy elem-count values from src to dst (converting as copy does) and return
+the checksum of the bytes written to dst, computed during the copy.  Options
+as checksum.  The ranges must not overlap."
+  ^long [^TypedBuffer src src-offset ^TypedBuffer dst dst-offset elem-count
+         & {:keys [algorithm seed] :or {algorithm :crc32c seed 0}}]
+  (check-buffer-access (.size src) src-offset elem-count)
+  (check-buffer-access (.size dst) dst-offset elem-count)
+  (.copy_with_checksum ^ByteBuffer$BufferManager (.manager dst)
+                       (.data src) (int (->cpp-datatype (.datatype src))) (long src-offset)
+                       (.data dst) (int (->cpp-datatype (.datatype dst))) (long dst-offset)
+                       (long elem-count) (int (->cpp-checksum-type algorithm)) (long seed)))
+
+
+;;Vector products accept buffers of any datatypes; integer pairs accumulate in
+;;int64, wrapping on overflow, and everything else in double.  Results are
+;;doubles so integer products above 2^53 are rounded.
+(defn- vector-pair-count
+  ^long [^TypedBuffer lhs lhs-offset ^TypedBuffer rhs rhs-offset elem-count]
+  (let [elem-count (long (or elem-count (- (.size lhs) (long lhs-offset))))]
+    (check-buffer-access (.size lhs) lhs-offset elem-count)
+    (check-buffer-access (.size rhs) rhs-offset elem-count)
+    elem-count))
+
+
+(defn dot
+  "Dot product of elem-count values (default the rest of lhs) of lhs and rhs."
+  ^double [^TypedBuffer lhs ^TypedBuffer rhs & {:keys [lhs-offset rhs-offset elem-count]
+                                                :or {lhs-offset 0 rhs-offset 0}}]
+  (let [elem-count (vector-pair-count lhs lhs-offset rhs rhs-offset elem-count)]
+    (.dot ^ByteBuffer$BufferManager (.manager lhs)
+          (.data lhs) (int (->cpp-datatype (.datatype lhs))) (long lhs-offset)
+          (.data rhs) (int (->cpp-datatype (.datatype rhs))) (long rhs-offset)
+          elem-count)))
+
+
+(defn- ->cpp-norm-type
+  ^long [norm-type]
+  (condp = norm-type
+    :l1 ByteBuffer$NormType/L1
+    :l2 ByteBuffer$NormType/L2
+    :linf ByteBuffer$NormType/LInf))
+
+
+(defn norm
+  "Norm of a range of buf; norm-type is :l1, :l2 (default) or :linf."
+  ^double [^TypedBuffer buf & {:keys [offset elem-count norm-type]
+                               :or {offset 0 norm-type :l2}}]
+  (let [elem-count (long (or elem-count (- (.size buf) (long offset))))]
+    (check-buffer-access (.size buf) offset elem-count)
+    (.norm ^ByteBuffer$BufferManager (.manager buf)
+           (.data buf) (int (->cpp-datatype (.datatype buf))) (long offset) elem-count
+           (int (->cpp-norm-type norm-type)))))
+
+
+(defn cosine-similarity
+  "Cosine of the angle between two ranges, NaN when either is all zeros.
+Options as dot."
+  ^double [^TypedBuffer lhs ^TypedBuffer rhs & {:keys [lhs-offset rhs-offset elem-count]
+                                                :or {lhs-offset 0 rhs-offset 0}}]
+  (let [elem-count (vector-pair-count lhs lhs-offset rhs rhs-offset elem-count)]
+    (.cosine_similarity ^ByteBuffer$BufferManager (.manager lhs)
+                        (.data lhs) (int (->cpp-datatype (.datatype lhs))) (long lhs-offset)
+                        (.data rhs) (int (->cpp-datatype (.datatype rhs))) (long rhs-offset)
+                        elem-count)))
+
+
+(defn gemv!
+  "y = A x for the row major n-rows x n-cols matrix A, or y = x A when
+transpose? is set.  Options:
+:lda - elements between rows of A, default n-cols.
+:a-offset, :x-offset, :y-offset - where A and the first x and y start.
+:n-vectors - number of products, default 1; the i'th reads x at
+  x-offset + i * x-stride and writes y at y-offset + i * y-stride.
+:x-stride, :y-stride - default the length of x and y.
+Returns y."
+  [^TypedBuffer a n-rows n-cols ^TypedBuffer x ^TypedBuffer y
+   & {:keys [lda transpose? a-offset x-offset y-offset n-vectors x-stride y-stride]
+      :or {transpose? false a-offset 0 x-offset 0 y-offset 0 n-vectors 1}}]
+  (let [n-rows (long n-rows)
+        n-cols (long n-cols)
+        lda (long (or lda n-cols))
+        n-vectors (long n-vectors)
+        x-size (if transpose? n-rows n-cols)
+        y-size (if transpose? n-cols n-rows)
+        x-stride (long (or x-stride x-size))
+        y-stride (long (or y-stride y-size))
+        extent (fn ^long [^long n ^long stride ^long size]
+                 (if (and (pos? n) (pos? size)) (+ (* (dec n) stride) size) 0))]
+    (when (< lda n-cols)
+      (throw (ex-info "lda must be at least n-cols" {:lda lda :n-cols n-cols})))
+    (check-buffer-access (.size a) a-offset (extent n-rows lda n-cols))
+    (check-buffer-access (.size x) x-offset (extent n-vectors x-stride x-size))
+    (check-buffer-access (.size y) y-offset (extent n-vectors y-stride y-size))
+    (.gemv ^ByteBuffer$BufferManager (.manager y)
+           (.data a) (int (->cpp-datatype (.datatype a))) (long a-offset)
+           n-rows n-cols lda (boolean transpose?)
+           (.data x) (int (->cpp-datatype (.datatype x))) (long x-offset) x-stride
+           (.data y) (int (->cpp-datatype (.datatype y))) (long y-offset) y-stride
+           n-vectors)
+    y))
+
+
+(defn gemm!
+  "c = alpha op(a) op(b) + beta c for row major matrices in float or double
+buffers of one datatype: c is m x n, op(a) m x k and op(b) k x n, op
+transposing when trans-a? or trans-b? is set.  Options:
+:alpha, :beta - default 1 and 0; a zero beta ignores the prior contents of c.
+:lda, :ldb, :ldc - elements between stored rows, default the row lengths.
+:a-offset, :b-offset, :c-offset - where each matrix starts.
+Returns c."
+  [^TypedBuffer a ^TypedBuffer b ^TypedBuffer c m n k
+   & {:keys [trans-a? trans-b? alpha beta lda ldb ldc a-offset b-offset c-offset]
+      :or {trans-a? false trans-b? false alpha 1.0 beta 0.0
+           a-offset 0 b-offset 0 c-offset 0}}]
+  (let [m (long m)
+        n (long n)
+        k (long k)
+        [a-rows a-cols] (if trans-a? [k m] [m k])
+        [b-rows b-cols] (if trans-b? [n k] [k n])
+        lda (long (or lda a-cols))
+        ldb (long (or ldb b-cols))
+        ldc (long (or ldc n))
+        extent (fn ^long [^long n-rows ^long n-cols ^long ld]
+                 (if (and (pos? n-rows) (pos? n-cols)) (+ (* (dec n-rows) ld) n-cols) 0))]
+    (check-buffer-access (.size a) a-offset (extent a-rows a-cols lda))
+    (check-buffer-access (.size b) b-offset (extent b-rows b-cols ldb))
+    (check-buffer-access (.size c) c-offset (extent m n ldc))
+    (.gemm ^ByteBuffer$BufferManager (.manager c)
+           (boolean trans-a?) (boolean trans-b?) m n k (double alpha)
+           (.data a) (int (->cpp-datatype (.datatype a))) (long a-offset) lda
+           (.data b) (int (->cpp-datatype (.datatype b))) (long b-offset) ldb
+           (double beta)
+           (.data c) (int (->cpp-datatype (.datatype c))) (long c-offset) ldc)
+    c))
+
+
+;;Running statistics are a double array of count, mean, sum of squared
+;;differences from the mean, min, max and NaN count, updated natively in one
+;;pass per range and mergeable across threads.
+(defn make-statistics
+  "An empty running statistics state."
+  ^doubles []
+  (double-array 6))
+
+
+(defn accumulate-statistics!
+  "Fold elem-count values (default the rest) of src, a typed buffer or a
+primitive array, into state.  Returns state."
+  ^doubles [^doubles state src & {:keys [offset elem-count] :or {offset 0}}]
+  (if (instance? TypedBuffer src)
+    (let [^TypedBuffer src src
+          elem-count (long (or elem-count (- (.size src) (long offset))))]
+      (check-buffer-access (.size src) offset elem-count)
+      (.accumulate_statistics ^ByteBuffer$BufferManager (.manager src)
+                              (.data src) (int (->cpp-datatype (.datatype src))) (long offset)
+                              elem-count state))
+    (let [manager (default-manager)
+          offset (long offset)
+          checked-count (fn ^long [^long size]
+                          (let [elem-count (long (or elem-count (- size offset)))]
+                            (check-buffer-access size offset elem-count)
+                            elem-count))]
+      (condp instance? src
+        (Class/forName "[B")
+        (let [^bytes src src]
+          (.accumulate_statistics manager src offset (checked-count (alength src)) state))
+        (Class/forName "[S")
+        (let [^shorts src src]
+          (.accumulate_statistics manager src offset (checked-count (alength src)) state))
+        (Class/forName "[I")
+        (let [^ints src src]
+          (.accumulate_statistics manager src offset (checked-count (alength src)) state))
+        (Class/forName "[J")
+        (let [^longs src src]
+          (.accumulate_statistics manager src offset (checked-count (alength src)) state))
+        (Class/forName "[F")
+        (let [^floats src src]
+          (.accumulate_statistics manager src offset (checked-count (alength src)) state))
+        (Class/forName "[D")
+        (let [^doubles src src]
+          (.accumulate_statistics manager src offset (checked-count (alength src)) state)))))
+  state)
+
+
+(defn merge-statistics!
+  "Fold the state other into state.  Returns state."
+  ^doubles [^doubles state ^doubles other]
+  (.merge_statistics (default-manager) state other)
+  state)
+
+
+(defn statistics
+  "The statistics of a state as a map.  :variance is the population variance
+and :sample-variance divides by count - 1; both are NaN without enough
+values, as are :mean, :min and :max when empty."
+  [^doubles state]
+  (let [n (aget state 0)
+        m2 (aget state 2)
+        empty? (zero? n)]
+    {:count (long n)
+     :mean (if empty? Double/NaN (aget state 1))
+     :variance (if empty? Double/NaN (/ m2 n))
+     :sample-variance (if (> n 1.0) (/ m2 (- n 1.0)) Double/NaN)
+     :min (if empty? Double/NaN (aget state 3))
+     :max (if empty? Double/NaN (aget state 4))
+     :nan-count (long (aget state 5))}))
+
+
+(defn count-nonfinite
+  "Number of NaN and infinite values in a range of buf."
+  ^long [^TypedBuffer buf & {:keys [offset elem-count] :or {offset 0}}]
+  (let [elem-count (long (or elem-count (- (.size buf) (long offset))))]
+    (check-buffer-access (.size buf) offset elem-count)
+    (.count_nonfinite ^ByteBuffer$BufferManager (.manager buf)
+                      (.data buf) (int (->cpp-datatype (.datatype buf))) (long offset) elem-count)))
+
+
+(defn find-first-nonfinite
+  "Index, relative to offset, of the first NaN or infinite value in a range of
+buf, or nil when all are finite."
+  [^TypedBuffer buf & {:keys [offset elem-count] :or {offset 0}}]
+  (let [elem-count (long (or elem-count (- (.size buf) (long offset))))
+        _ (check-buffer-access (.size buf) offset elem-count)
+        index (.find_first_nonfinite ^ByteBuffer$BufferManager (.manager buf)
+                                     (.data buf) (int (->cpp-datatype (.datatype buf)))
+                                     (long offset) elem-count)]
+    (when-not (neg? index)
+      index)))
+
+
+(defn replace-nonfinite!
+  "Replace NaN and infinite values in a range of buf with value.  Returns the
+number replaced."
+  ^long [^TypedBuffer buf value & {:keys [offset elem-count] :or {offset 0}}]
+  (let [elem-count (long (or elem-count (- (.size buf) (long offset))))]
+    (check-buffer-access (.size buf) offset elem-count)
+    (.replace_nonfinite ^ByteBuffer$BufferManager (.manager buf)
+                        (.data buf) (int (->cpp-datatype (.datatype buf))) (long offset) elem-count
+                        (double value))))
+
+
+(defn copy-with-nan-policy!
+  "Copy as copy! does, choosing what NaN becomes when float values are
+converted to an integer datatype (out of range values always saturate).
+nan-policy is :zero (what copy! does), :throw, or a number to write instead.
+Returns dst."
+  [^TypedBuffer src src-offset ^TypedBuffer dst dst-offset elem-count nan-policy]
+  (check-buffer-access (.size src) src-offset elem-count)
+  (check-buffer-access (.size dst) dst-offset elem-count)
+  (let [[policy nan-value] (condp = nan-policy
+                             :zero [ByteBuffer$NanPolicy/Zero 0.0]
+                             :throw [ByteBuffer$NanPolicy/Throw 0.0]
+                             [ByteBuffer$NanPolicy/Replace (double nan-policy)])]
+    (.copy_with_nan_policy ^ByteBuffer$BufferManager (.manager dst)
+                           (.data src) (int (->cpp-datatype (.datatype src))) (long src-offset)
+                           (.data dst) (int (->cpp-datatype (.datatype dst))) (long dst-offset)
+                           (long elem-count) (int policy) (double nan-value))
+    dst))
+
+
+;;Masked operations select with a :bit buffer, bit i selecting element i, over
+;;the length of the mask.  Values convert between datatypes as copy! does.
+(defn- check-mask
+  [^TypedBuffer mask & bufs]
+  (check-bit-buffer mask)
+  (doseq [^TypedBuffer buf bufs]
+    (check-buffer-access (.size buf) 0 (.size mask))))
+
+
+(defn copy-masked!
+  "Copy the selected elements of src to the same positions of dst, leaving the
+others unread and unwritten.  Returns dst."
+  [^TypedBuffer src ^TypedBuffer mask ^TypedBuffer dst]
+  (check-mask mask src dst)
+  (.copy_masked ^ByteBuffer$BufferManager (.manager dst)
+                (.data src) (int (->cpp-datatype (.datatype src))) 0
+                (.data mask) 0
+                (.data dst) (int (->cpp-datatype (.datatype dst))) 0
+                (.size mask))
+  dst)
+
+
+(defn compress!
+  "Pack the selected elements of src to the front of dst, which needs room for
+(popcount mask) elements.  dst may be src, or overlap it starting at or before
+src with elements no wider; other overlaps throw.  Returns how many were
+written."
+  ^long [^TypedBuffer src ^TypedBuffer mask ^TypedBuffer dst]
+  (check-mask mask src)
+  (check-buffer-access (.size dst) 0 (popcount mask))
+  (.compress ^ByteBuffer$BufferManager (.manager dst)
+             (.data src) (int (->cpp-datatype (.datatype src))) 0
+             (.data mask) 0
+             (.data dst) (int (->cpp-datatype (.datatype dst))) 0
+             (.size mask)))
+
+
+(defn compress
+  "The selected elements of src as a new buffer of its datatype."
+  [^TypedBuffer src ^TypedBuffer mask]
+  (let [dst (make-typed-buffer (.datatype src) (popcount mask))]
+    (compress! src mask dst)
+    dst))
+
+
+(defn expand!
+  "The inverse of compress!: write consecutive elements of src to the selected
+positions of dst, leaving the others alone.  Returns how many were read."
+  ^long [^TypedBuffer src ^TypedBuffer mask ^TypedBuffer dst]
+  (check-mask mask dst)
+  (check-buffer-access (.size src) 0 (popcount mask))
+  (.expand ^ByteBuffer$BufferManager (.manager dst)
+           (.data src) (int (->cpp-datatype (.datatype src))) 0
+           (.data mask) 0
+           (.data dst) (int (->cpp-datatype (.datatype dst))) 0
+           (.size mask)))
+
+
+(defn where!
+  "dst = lhs where the mask bit is set, rhs elsewhere.  dst may be lhs or rhs.
+Returns dst."
+  [^TypedBuffer mask ^TypedBuffer lhs ^TypedBuffer rhs ^TypedBuffer dst]
+  (check-mask mask lhs rhs dst)
+  (.where ^ByteBuffer$BufferManager (.manager dst)
+          (.data mask) 0
+          (.data lhs) (int (->cpp-datatype (.datatype lhs))) 0
+          (.data rhs) (int (->cpp-datatype (.datatype rhs))) 0
+          (.data dst) (int (->cpp-datatype (.datatype dst))) 0
+          (.size mask))
+  dst)
+
+
+(defprotocol PGrowableBuffer
+  (reserve! [buf elem-count]
+    "Ensure room for at least elem-count elements past the current end.")
+  (push! [buf value]
+    "Append a single value to the end of the buffer.")
+  (append! [buf src src-offset elem-count]
+    "Append elem-count values from src (array or typed buffer) starting at src-offset.")
+  (growable->typed-buffer [buf]
+    "Typed buffer view of the current contents.  The view is only valid until the
+next push or append as those may move the storage."))
+
+
+(deftype GrowableBuffer [datatype ^ByteBuffer$BufferManager manager
+                         ^:volatile-mutable ^long data
+                         ^:volatile-mutable ^long capacity
+                         ^:volatile-mutable ^long size]
+  PGrowableBuffer
+  (reserve! [this elem-count]
+    (let [required (+ size (long elem-count))]
+      (when (> required capacity)
+        ;;Doubling keeps pushes amortized O(1); resize_buffer grows large
+        ;;buffers by remapping so the existing contents are not copied.
+        (let [new-capacity (max required (* 2 capacity) 16)]
+          (set! data (.resize_buffer manager data
+                                     (datatype->byte-count datatype new-capacity)))
+          (set! capacity (long new-capacity))))
+      this))
+  (push! [this value]
+    (reserve! this 1)
+    (set-typed-buffer-value! value (->TypedBuffer data capacity datatype manager) size 1)
+    (set! size (inc size))
+    this)
+  (append! [this src src-offset elem-count]
+    (reserve! this elem-count)
+    (dtype/copy! src src-offset (->TypedBuffer data capacity datatype manager) size elem-count)
+    (set! size (+ size (long elem-count)))
+    this)
+  (growable->typed-buffer [this]
+    (->TypedBuffer data size datatype manager))
+  dtype/PDatatype
+  (get-datatype [this] datatype)
+  mp/PElementCount
+  (element-count [this] size)
+  resource/PResource
+  (release-resource [this]
+    (.release_buffer manager data)))
+
+
+(defn make-growable-buffer
+  "Make an empty append only buffer of the given datatype."
+  ([datatype initial-capacity]
+   (let [manager (default-manager)
+         capacity (max 1 (long initial-capacity))
+         data (.allocate_buffer manager (datatype->byte-count datatype capacity)
+                                "byte-buffer.clj" 315)]
+     (resource/track (->GrowableBuffer datatype manager data capacity 0))))
+  ([datatype]
+   (make-growable-buffer datatype 16)))
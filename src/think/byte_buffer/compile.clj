@@ -19,6 +19,8 @@
                                          "/cpp")
                                     "-Xcompiler"
                                     "-std=c++14"
+                                    "-Xcompiler"
+                                    "-pthread"
                                     ])))
 
 (defn -main
@@ -2,6 +2,7 @@
   (:require [think.byte-buffer :as bb]
             [think.datatype.core :as dtype]
             [clojure.test :refer :all]
+            [clojure.core.matrix :as m]
             [think.resource.core :as resource]
             [think.datatype.time-test :as time-test])
   (:import [org.bytedeco.javacpp DoublePointer FloatPointer]))
@@ -87,3 +88,561 @@
     (time-test/datatype-copy-time-test)
     (println "float array -> double array view fast path")
     (time-test/array-into-view-time-test)))
+
+
+(deftest growable-buffer-test
+  (resource/with-resource-context
+    (let [buf (bb/make-growable-buffer :int 4)
+          result (int-array 200)]
+      (dotimes [idx 100]
+        (bb/push! buf (int idx)))
+      (bb/append! buf (int-array (range 100 200)) 0 100)
+      (is (= 200 (m/ecount buf)))
+      (dtype/copy! (bb/growable->typed-buffer buf) 0 result 0 200)
+      (is (= (vec (range 200)) (vec result))))))
+
+
+(deftest view-outlives-parent-test
+  (let [view (resource/with-resource-context
+               (let [buf (bb/make-typed-buffer :double (range 10))]
+                 (bb/retain! (dtype/->view-impl buf 5 5))))
+        result (double-array 5)]
+    (dtype/copy! view 0 result 0 5)
+    (is (= [5.0 6.0 7.0 8.0 9.0] (vec result)))
+    (resource/release-resource view)))
+
+
+(deftest reduction-test
+  (resource/with-resource-context
+    (let [buf (bb/make-typed-buffer :float [3 1 4 1 5 9 2 6])]
+      (is (= 31.0 (bb/reduce-buffer buf :sum)))
+      (is (= 1.0 (bb/reduce-buffer buf :min)))
+      (is (= 9.0 (bb/reduce-buffer buf :max)))
+      (is (= 3.0 (bb/reduce-buffer buf :mean 0 4)))
+      (is (= 0.0 (bb/reduce-buffer buf :sum 0 0)))
+      (is (thrown? Exception (bb/reduce-buffer buf :min 0 0)))
+      (is (= 1 (bb/argmin buf)))
+      (is (= 5 (bb/argmax buf))))))
+
+
+(deftest elementwise-test
+  (resource/with-resource-context
+    (let [ints (bb/make-typed-buffer :int [1 -2 3 -4])
+          floats (bb/make-typed-buffer :float [0.5 0.5 0.5 0.5])
+          dst (bb/make-typed-buffer :double 4)
+          result (double-array 4)]
+      (bb/add! ints floats dst)
+      (dtype/copy! dst 0 result 0 4)
+      (is (= [1.5 -1.5 3.5 -3.5] (vec result)))
+      ;;In place, into a narrower type with a fractional scalar
+      (bb/mul! ints 2.5 ints)
+      (dtype/copy! ints 0 result 0 4)
+      (is (= [2.0 -5.0 7.0 -10.0] (vec result)))
+      (bb/binary-op! :max ints 0 ints)
+      (bb/div! ints 0 dst)
+      (dtype/copy! dst 0 result 0 4)
+      (is (= [0.0 0.0 0.0 0.0] (vec result)))
+      (bb/unary-op! :negate ints dst)
+      (bb/axpy! 2 floats dst)
+      (dtype/copy! dst 0 result 0 4)
+      (is (= [-1.0 1.0 -6.0 1.0] (vec result)))
+      (bb/clamp! dst -2 0.5 floats)
+      (dtype/copy! floats 0 result 0 4)
+      (is (= [-1.0 0.5 -2.0 0.5] (vec result))))))
+
+
+(deftest expression-test
+  (resource/with-resource-context
+    (let [src (bb/make-typed-buffer :byte [0 10 100 200])
+          bias (bb/make-typed-buffer :float [1 1 1 1])
+          dst (bb/make-typed-buffer :float 4)
+          result (float-array 4)]
+      (-> (bb/expr src)
+          (bb/expr-mul 0.5)
+          (bb/expr-add bias)
+          (bb/expr-clamp 0 60)
+          (bb/eval-expr! dst))
+      (dtype/copy! dst 0 result 0 4)
+      (is (= [1.0 6.0 51.0 60.0] (map double result)))
+      ;;Casts saturate as stores into the datatype do
+      (-> (bb/expr (bb/make-typed-buffer :float [300 -5 Double/NaN 7.6]))
+          (bb/expr-cast :byte)
+          (bb/eval-expr! dst))
+      (dtype/copy! dst 0 result 0 4)
+      (is (= [255.0 0.0 0.0 7.0] (map double result))))))
+
+
+(deftest hash-equality-test
+  (resource/with-resource-context
+    (let [abc (bb/make-typed-buffer :byte [97 98 99])
+          ints (bb/make-typed-buffer :int [16777217 -3 0 7])
+          floats (bb/make-typed-buffer :float [16777216 -3 -0.0 7])
+          doubles (bb/make-typed-buffer :double [16777217 -3 0 7])
+          nans (bb/make-typed-buffer :double [1 Double/NaN])]
+      ;;Published XXH64 values of "abc" and of no bytes, seed 0
+      (is (= 0x44BC2CF5AD770999 (bb/hash-range abc)))
+      (is (= -1205034819632174695 (bb/hash-range abc 0 0 0)))
+      (is (not= (bb/hash-range abc) (bb/hash-range abc 0 3 1)))
+      (is (= (bb/hash-range ints 1 3 0) (bb/hash-range (dtype/->view-impl ints 1 3))))
+      ;;Integers compare exactly against floats that cannot hold them
+      (is (not (bb/equals-range? ints floats)))
+      (is (bb/equals-range? ints 1 floats 1 3 false))
+      (is (bb/equals-range? ints doubles))
+      (is (bb/equals-range? floats 1 doubles 1 3 false))
+      (is (bb/equals-range? nans nans))
+      (is (not (bb/equals-range? nans 0 nans 0 2 false))))))
+
+
+(deftest permute-test
+  (resource/with-resource-context
+    (let [src (bb/make-typed-buffer :float (range 24))
+          dst (bb/make-typed-buffer :double 24)
+          gathered (bb/make-typed-buffer :int 3)
+          result (double-array 24)
+          int-result (int-array 3)]
+      ;;NCHW -> NHWC of a 1x2x3x4 tensor
+      (bb/permute-copy! src 0 [1 2 3 4] [24 12 4 1] [0 2 3 1] dst 0)
+      (dtype/copy! dst 0 result 0 24)
+      (is (= (map double (for [h (range 3) w (range 4) c (range 2)] (+ (* c 12) (* h 4) w)))
+             (vec result)))
+      ;;A strided gather converts as copy! does
+      (bb/permute-copy! (bb/make-typed-buffer :float [1e10 0 Double/NaN 0 -2.5]) 0 [3] [2] [0]
+                        gathered 0)
+      (dtype/copy! gathered 0 int-result 0 3)
+      (is (= [Integer/MAX_VALUE 0 -2] (vec int-result))))))
+
+
+(deftest interleave-test
+  (resource/with-resource-context
+    ;;Enough groups for the shuffles plus a scalar tail
+    (let [n-groups 37]
+      (doseq [n-channels [2 3 4]
+              [datatype ->array] [[:byte byte-array] [:float float-array] [:long long-array]]]
+        (let [values (map #(- (mod (* 7 %) 256) 128) (range (* n-channels n-groups)))
+              src (bb/make-typed-buffer datatype values)
+              planes (vec (repeatedly n-channels #(bb/make-typed-buffer datatype n-groups)))
+              dst (bb/make-typed-buffer datatype (* n-channels n-groups))
+              result (->array (* n-channels n-groups))
+              plane-result (->array n-groups)]
+          (bb/deinterleave! src planes)
+          (doseq [channel (range n-channels)]
+            (dtype/copy! (planes channel) 0 plane-result 0 n-groups)
+            (is (= (map long (take-nth n-channels (drop channel values)))
+                   (map long plane-result))))
+          (bb/interleave! planes dst)
+          (dtype/copy! dst 0 result 0 (* n-channels n-groups))
+          (is (= (map long values) (map long result))))))
+    ;;Planes of another datatype are converted on the way through
+    (let [src (bb/make-typed-buffer :byte [1 2 3 4 5 6])
+          planes [(bb/make-typed-buffer :double 2) (bb/make-typed-buffer :double 2)
+                  (bb/make-typed-buffer :double 2)]
+          result (double-array 2)]
+      (bb/deinterleave! src planes)
+      (dtype/copy! (planes 1) 0 result 0 2)
+      (is (= [2.0 5.0] (vec result))))))
+
+
+(deftest bit-buffer-test
+  (resource/with-resource-context
+    (let [mask (bb/make-typed-buffer :bit [0 2 0 -1 0.5 0 0 0 1 1])
+          other (bb/make-typed-buffer :bit [1 1 1 1 1 0 0 0 0 0])
+          dst (bb/make-typed-buffer :bit 10)
+          result (int-array 10)]
+      (is (= 5 (bb/popcount mask)))
+      (dtype/copy! mask 0 result 0 10)
+      (is (= [0 1 0 1 1 0 0 0 1 1] (vec result)))
+      (bb/bit-op! :and mask other dst)
+      (is (= 3 (bb/popcount dst)))
+      (bb/bit-op! :not mask dst)
+      (is (= 5 (bb/popcount dst)))
+      (is (= 2 (bb/popcount (dtype/->view-impl mask 8 2)))))))
+
+
+(deftest compression-test
+  (resource/with-resource-context
+    (let [src (bb/make-typed-buffer :float (map #(Math/sin (* 0.01 %)) (range 10000)))
+          compressed (bb/compress-buffer src :block-bytes 4096)
+          restored (bb/decompress-buffer compressed)]
+      (is (< (.size compressed) (* 4 10000)))
+      (is (= :float (bb/compressed-datatype compressed)))
+      (is (bb/equals-range? src restored)))))
+
+
+(deftest integer-codec-test
+  (resource/with-resource-context
+    (let [values (concat [Long/MIN_VALUE Long/MAX_VALUE 0 -1]
+                         (map #(+ 1600000000000 (* 37 %) (mod % 5)) (range 3000))
+                         [42])
+          n-elems (count values)
+          src (bb/make-typed-buffer :long values)
+          result (long-array n-elems)]
+      (doseq [codec [:delta-varint :frame-of-reference :delta-frame-of-reference]]
+        (let [encoded (bb/encode-integers src codec)
+              n-bytes (.size encoded)
+              encoded-bytes (byte-array n-bytes)]
+          (is (= n-elems (bb/decoded-count encoded)))
+          (dtype/copy! (bb/decode-integers encoded :long) 0 result 0 n-elems)
+          (is (= values (vec result)))
+          ;;Streams cut short anywhere are rejected rather than read past
+          (dtype/copy! encoded 0 encoded-bytes 0 n-bytes)
+          (doseq [n-kept [4 (quot n-bytes 2) (dec n-bytes)]]
+            (is (thrown? Exception
+                         (bb/decode-integers (bb/make-typed-buffer :byte (take n-kept encoded-bytes))
+                                             :long)))))))))
+
+
+(deftest quantization-test
+  (resource/with-resource-context
+    (let [src (bb/make-typed-buffer :float (map #(* (inc (quot % 100)) (Math/sin %)) (range 400)))
+          params (bb/calibrate-quantization src :scheme :asymmetric :channels 4 :inner-size 100)
+          restored (bb/dequantize (bb/quantize src params) params)
+          error (bb/make-typed-buffer :float 400)]
+      (is (= 4 (count (:scales params))))
+      (bb/sub! restored src error)
+      (bb/unary-op! :abs error error)
+      (is (<= (bb/reduce-buffer error :max) (* 0.5001 (apply max (:scales params))))))))
+
+
+(deftest sort-test
+  (resource/with-resource-context
+    (let [buf (bb/make-typed-buffer :float [3 -1 4 Double/NaN 1 -5 9])
+          indices (bb/argsort buf)
+          index-result (int-array 7)
+          result (float-array 7)]
+      (dtype/copy! indices 0 index-result 0 7)
+      (is (= [5 1 4 0 2 6 3] (vec index-result)))
+      (bb/sort-buffer! buf :descending? true)
+      (dtype/copy! buf 0 result 0 7)
+      (is (= [9.0 4.0 3.0 1.0 -1.0 -5.0] (map double (take 6 result))))
+      (is (Float/isNaN (aget result 6))))))
+
+
+(deftest top-k-test
+  (resource/with-resource-context
+    (let [buf (bb/make-typed-buffer :float [3 Double/NaN 5 5 -1 Double/NaN 5 0])
+          selection (fn [k & options]
+                      (let [{:keys [values indices]} (apply bb/top-k buf k options)
+                            value-result (float-array k)
+                            index-result (int-array k)]
+                        (dtype/copy! values 0 value-result 0 k)
+                        (dtype/copy! indices 0 index-result 0 k)
+                        [(mapv #(if (Float/isNaN %) :nan (double %)) value-result)
+                         (vec index-result)]))]
+      ;;Ties go to the earlier element
+      (is (= [[5.0 5.0 5.0 3.0] [2 3 6 0]] (selection 4)))
+      (is (= [[-1.0 0.0 3.0] [4 7 0]] (selection 3 :largest? false)))
+      ;;k equal to the element count selects everything, NaN last either way
+      (is (= [[5.0 5.0 5.0 3.0 0.0 -1.0 :nan :nan] [2 3 6 0 7 4 1 5]] (selection 8)))
+      (is (= [[-1.0 0.0 3.0 5.0 5.0 5.0 :nan :nan] [4 7 0 2 3 6 1 5]]
+             (selection 8 :largest? false)))
+      (is (= [[] []] (selection 0)))
+      (is (thrown? Exception (selection 9))))))
+
+
+(deftest scan-test
+  (resource/with-resource-context
+    ;;Long enough to be split into chunks, each starting from the carry of the
+    ;;ones before it
+    (let [n-elems 200000
+          values (map #(- (mod % 7) 3) (range n-elems))
+          src (bb/make-typed-buffer :int values)
+          inclusive (vec (rest (reductions + 0 values)))
+          exclusive (vec (butlast (reductions + 0 values)))
+          result (long-array n-elems)]
+      (dtype/copy! (bb/scan src) 0 result 0 n-elems)
+      (is (= inclusive (vec result)))
+      (dtype/copy! (bb/scan src :exclusive? true) 0 result 0 n-elems)
+      (is (= exclusive (vec result)))
+      ;;In place
+      (let [buf (bb/make-typed-buffer :double values)
+            double-result (double-array n-elems)]
+        (bb/scan! buf buf :exclusive? true)
+        (dtype/copy! buf 0 double-result 0 n-elems)
+        (is (= (map double exclusive) (vec double-result)))))
+    ;;An :int source sums into a :long destination without overflowing
+    (let [n-elems 100000
+          result (long-array n-elems)]
+      (dtype/copy! (bb/scan (bb/make-typed-buffer :int (repeat n-elems Integer/MAX_VALUE)))
+                   0 result 0 n-elems)
+      (is (= (* n-elems (long Integer/MAX_VALUE)) (aget result (dec n-elems)))))))
+
+
+(deftest histogram-test
+  (resource/with-resource-context
+    (let [buf (bb/make-typed-buffer :double [0 1 2 3 Double/NaN 4 -1 9])]
+      ;;The default range ignores NaN
+      (is (= [2 2 2 0 1] (vec (bb/histogram buf :bins 5))))
+      (is (= [2 2] (vec (bb/histogram buf :bins 2 :range [0 3]))))
+      (is (= [1 2 2] (vec (bb/histogram buf :edges [0 1 3 4])))))
+    ;;A single distinct value is widened to a range holding it
+    (is (= [3 0] (vec (bb/histogram (bb/make-typed-buffer :int [7 7 7]) :bins 2))))
+    ;;Nothing to bound the range leaves every bin empty
+    (is (= [0 0 0] (vec (bb/histogram (bb/make-typed-buffer :float 0) :bins 3))))
+    (is (= [0 0 0] (vec (bb/histogram (bb/make-typed-buffer :float [Double/NaN]) :bins 3))))
+    (is (= [1 0 0 2] (vec (bb/bincount (bb/make-typed-buffer :int [0 3 3 7]) 4))))))
+
+
+(deftest checksum-test
+  (resource/with-resource-context
+    (let [digits (bb/make-typed-buffer :byte (map int "123456789"))
+          ;;Several copy blocks and parallel chunks long, in an odd number of
+          ;;elements
+          n-elems 300001
+          ints (bb/make-typed-buffer :int (map #(- (mod (* 31 %) 251) 125) (range n-elems)))
+          floats (bb/make-typed-buffer :float n-elems)]
+      ;;The CRC32C check value
+      (is (= 0xE3069283 (bb/checksum digits)))
+      ;;Continuing from the CRC of the preceding bytes
+      (is (= 0xE3069283 (bb/checksum digits :offset 4 :seed (bb/checksum digits :elem-count 4))))
+      (is (= (bb/checksum ints)
+             (bb/checksum ints :offset 100000 :seed (bb/checksum ints :elem-count 100000))))
+      ;;XXH64 hashed block by block equals the one shot hash
+      (is (= (bb/hash-range ints 0 n-elems 7) (bb/checksum ints :algorithm :xxhash64 :seed 7)))
+      (is (= (bb/hash-range digits) (bb/checksum digits :algorithm :xxhash64)))
+      ;;Checksums computed during a converting copy are those of the bytes written
+      (let [crc (bb/copy-with-checksum! ints 0 floats 0 n-elems)]
+        (is (= (bb/checksum floats) crc)))
+      (let [hash (bb/copy-with-checksum! ints 0 floats 0 n-elems :algorithm :xxhash64 :seed 3)]
+        (is (= (bb/hash-range floats 0 n-elems 3) hash))))))
+
+
+(deftest gemm-test
+  (resource/with-resource-context
+    (let [a (bb/make-typed-buffer :double [1 2 3
+                                           4 5 6])
+          b (bb/make-typed-buffer :double [7 8
+                                           9 10
+                                           11 12])
+          c (bb/make-typed-buffer :double 4)
+          result (double-array 4)]
+      (bb/gemm! a b c 2 2 3)
+      (dtype/copy! c 0 result 0 4)
+      (is (= [58.0 64.0 139.0 154.0] (vec result)))
+      ;;The transposed leading 2x2 block of a (rows 3 apart) times the first
+      ;;four values of a, added to c
+      (bb/gemm! a a c 2 2 2 :trans-a? true :lda 3 :beta 1.0)
+      (dtype/copy! c 0 result 0 4)
+      (is (= [71.0 82.0 156.0 178.0] (vec result)))))
+  ;;k spans two kc blocks of 256, m two mc panels of 96, and neither m nor n
+  ;;is a multiple of the micro tile so edge tiles are exercised.  c has rows
+  ;;ldc apart, and the columns past n must be left alone.  Small integer
+  ;;values keep every sum exact in float and double.
+  (resource/with-resource-context
+    (let [m 101 n 37 k 300 ldc 41
+          a-value (fn [row col] (- (mod (+ (* 3 row) col) 7) 3))
+          b-value (fn [row col] (- (mod (+ row (* 5 col)) 5) 2))
+          c-value (fn [row col] (- (mod (+ row col) 3) 1))
+          product (vec (for [row (range m) col (range n)]
+                         (reduce + (map #(* (a-value row %) (b-value % col)) (range k)))))
+          ;;Stored row major, or transposed when op transposes
+          stored (fn [datatype value-fn n-rows n-cols transpose?]
+                   (bb/make-typed-buffer datatype
+                                         (if transpose?
+                                           (for [col (range n-cols) row (range n-rows)]
+                                             (value-fn row col))
+                                           (for [row (range n-rows) col (range n-cols)]
+                                             (value-fn row col)))))]
+      (doseq [datatype [:double :float]
+              trans-a? [false true]
+              trans-b? [false true]
+              beta [0.0 2.0]]
+        (let [a (stored datatype a-value m k trans-a?)
+              b (stored datatype b-value k n trans-b?)
+              ;;beta 0 must ignore what c holds, NaN included
+              c (bb/make-typed-buffer datatype
+                                      (for [row (range m) col (range ldc)]
+                                        (if (and (< col n) (= 0.0 beta))
+                                          Double/NaN
+                                          (c-value row col))))
+              result (double-array (* m ldc))
+              expected (vec (for [row (range m) col (range ldc)]
+                              (double
+                               (if (< col n)
+                                 (+ (* 3 (product (+ (* row n) col)))
+                                    (* beta (c-value row col)))
+                                 (c-value row col)))))]
+          (bb/gemm! a b c m n k :trans-a? trans-a? :trans-b? trans-b?
+                    :alpha 3.0 :beta beta :ldc ldc)
+          (dtype/copy! c 0 result 0 (* m ldc))
+          (is (= expected (vec result))
+              (str datatype " trans-a? " trans-a? " trans-b? " trans-b? " beta " beta)))))))
+
+
+(deftest vector-test
+  (resource/with-resource-context
+    ;;Small integer values keep every sum exact, so the kernels must match
+    ;;the naive loops to the last bit
+    (let [n-elems 5000
+          lhs-values (mapv #(- (mod (* 7 %) 13) 6) (range n-elems))
+          rhs-values (mapv #(- (mod (* 3 %) 11) 5) (range n-elems))
+          lhs (bb/make-typed-buffer :int lhs-values)
+          rhs (bb/make-typed-buffer :float rhs-values)
+          naive-dot (fn [xs ys] (double (reduce + (map * xs ys))))
+          abs-values (map #(Math/abs (long %)) lhs-values)]
+      (is (= (naive-dot lhs-values rhs-values) (bb/dot lhs rhs)))
+      (is (= (naive-dot (drop 3 lhs-values) (take 10 rhs-values))
+             (bb/dot lhs rhs :lhs-offset 3 :elem-count 10)))
+      (is (= (double (reduce + abs-values)) (bb/norm lhs :norm-type :l1)))
+      (is (= (Math/sqrt (naive-dot lhs-values lhs-values)) (bb/norm lhs)))
+      (is (= (double (reduce max abs-values)) (bb/norm lhs :norm-type :linf)))
+      (is (Double/isNaN (bb/norm (bb/make-typed-buffer :double [1 Double/NaN 3]) :norm-type :linf)))
+      (is (< (Math/abs (- (/ (naive-dot lhs-values rhs-values)
+                             (Math/sqrt (naive-dot lhs-values lhs-values))
+                             (Math/sqrt (naive-dot rhs-values rhs-values)))
+                          (bb/cosine-similarity lhs rhs)))
+             1e-12))
+      (is (Double/isNaN (bb/cosine-similarity lhs (bb/make-typed-buffer :float n-elems)))))
+    ;;Three products of a 4x3 matrix stored with rows 5 apart, both ways
+    (let [n-rows 4
+          n-cols 3
+          lda 5
+          n-vectors 3
+          a-values (mapv #(- (mod (* 5 %) 9) 4) (range (* n-rows lda)))
+          a (bb/make-typed-buffer :float a-values)
+          x (bb/make-typed-buffer :int (range -6 6))
+          row (fn [r] (subvec a-values (* r lda) (+ (* r lda) n-cols)))
+          column (fn [c] (map #(nth a-values (+ (* % lda) c)) (range n-rows)))]
+      (let [y (bb/make-typed-buffer :double (* n-vectors n-rows))
+            result (double-array (* n-vectors n-rows))]
+        (bb/gemv! a n-rows n-cols x y :lda lda :n-vectors n-vectors)
+        (dtype/copy! y 0 result 0 (* n-vectors n-rows))
+        (is (= (for [v (range n-vectors) r (range n-rows)]
+                 (double (reduce + (map * (row r) (range (- (* v n-cols) 6) 6)))))
+               (vec result))))
+      (let [y (bb/make-typed-buffer :long (* n-vectors n-cols))
+            result (long-array (* n-vectors n-cols))]
+        (bb/gemv! a n-rows n-cols x y :lda lda :transpose? true :n-vectors n-vectors)
+        (dtype/copy! y 0 result 0 (* n-vectors n-cols))
+        (is (= (for [v (range n-vectors) c (range n-cols)]
+                 (long (reduce + (map * (column c) (range (- (* v n-rows) 6) 6)))))
+               (vec result)))))))
+
+
+(deftest statistics-test
+  (resource/with-resource-context
+    (let [buf (bb/make-typed-buffer :float [2 4 Double/NaN 4])
+          state (bb/accumulate-statistics! (bb/make-statistics) buf)
+          other (bb/accumulate-statistics! (bb/make-statistics) (double-array [4 5 5 7]))
+          result (bb/statistics (bb/merge-statistics! state other))]
+      (is (= 7 (:count result)))
+      (is (= 1 (:nan-count result)))
+      (is (< (Math/abs (- 31/7 (:mean result))) 1e-12))
+      (is (= 2.0 (:min result)))
+      (is (= 7.0 (:max result))))))
+
+
+(deftest nonfinite-test
+  (resource/with-resource-context
+    (let [buf (bb/make-typed-buffer :double [1 Double/NaN 2 Double/POSITIVE_INFINITY 1e300])
+          ints (bb/make-typed-buffer :int 5)
+          result (int-array 5)]
+      (is (= 2 (bb/count-nonfinite buf)))
+      (is (= 1 (bb/find-first-nonfinite buf)))
+      (is (nil? (bb/find-first-nonfinite buf :offset 4)))
+      (bb/copy-with-nan-policy! buf 0 ints 0 5 -1)
+      (dtype/copy! ints 0 result 0 5)
+      (is (= [1 -1 2 Integer/MAX_VALUE Integer/MAX_VALUE] (vec result)))
+      (is (thrown? Exception (bb/copy-with-nan-policy! buf 0 ints 0 5 :throw)))
+      (is (= 2 (bb/replace-nonfinite! buf 0)))
+      (is (= 0 (bb/count-nonfinite buf))))))
+
+
+(deftest mask-test
+  (resource/with-resource-context
+    (let [mask (bb/make-typed-buffer :bit [1 0 0 1 1 0])
+          src (bb/make-typed-buffer :int [10 20 30 40 50 60])
+          packed (bb/compress src mask)
+          dst (bb/make-typed-buffer :double 6)
+          result (double-array 6)]
+      (is (= 3 (:size packed)))
+      (is (= 3 (bb/expand! packed mask dst)))
+      (dtype/copy! dst 0 result 0 6)
+      (is (= [10.0 0.0 0.0 40.0 50.0 0.0] (vec result)))
+      (bb/where! mask (bb/make-typed-buffer :double 6) src dst)
+      (dtype/copy! dst 0 result 0 6)
+      (is (= [0.0 20.0 30.0 0.0 0.0 60.0] (vec result)))
+      (bb/copy-masked! (bb/make-typed-buffer :float [1 2 3 4 5 6]) mask dst)
+      (dtype/copy! dst 0 result 0 6)
+      (is (= [1.0 20.0 30.0 4.0 5.0 60.0] (vec result))))
+    ;;Compacting in place, across parallel chunks
+    (let [n-elems 300000
+          selected (map #(if (zero? (mod % 3)) 0 1) (range n-elems))
+          mask (bb/make-typed-buffer :bit selected)
+          buf (bb/make-typed-buffer :int (range n-elems))
+          n-selected (long (reduce + selected))
+          result (int-array n-selected)]
+      (is (= n-selected (bb/compress! buf mask buf)))
+      (dtype/copy! buf 0 result 0 n-selected)
+      (is (= (remove #(zero? (mod % 3)) (range n-elems)) (vec result)))
+      (is (thrown? Exception (bb/compress! buf mask (dtype/->view-impl buf 1 (dec n-elems))))))))
+
+
+(deftest placement-test
+  (resource/with-resource-context
+    (let [n-elems (* 2 1024 1024)
+          buf (bb/make-typed-buffer :double n-elems {:placement :interleave})
+          result (double-array 4)]
+      (is (= 0.0 (bb/reduce-buffer buf :max)))
+      (dtype/copy! (double-array [1 2 3 4]) 0 buf (- n-elems 4) 4)
+      (dtype/copy! buf (- n-elems 4) result 0 4)
+      (is (= [1.0 2.0 3.0 4.0] (vec result)))
+      (is (thrown? Exception (bb/make-typed-buffer :float 16 {:placement :bind :node 4096})))
+      ;;An error raised inside a pool task reaches the caller and leaves the
+      ;;pool usable
+      (dtype/copy! (double-array [Double/NaN]) 0 buf (- n-elems 1) 1)
+      (is (thrown? Exception (bb/copy-with-nan-policy! buf 0 (bb/make-typed-buffer :int n-elems)
+                                                       0 n-elems :throw)))
+      (is (= 6.0 (bb/reduce-buffer buf :sum 0 (- n-elems 1)))))))
+
+
+(deftest map-file-test
+  (resource/with-resource-context
+    (let [file (doto (java.io.File/createTempFile "byte-buffer" ".bin") (.deleteOnExit))
+          buf (bb/map-file :double file :mode :read-write :elem-count 1000)
+          result (double-array 2)]
+      (dtype/copy! (double-array (range 1000)) 0 buf 0 1000)
+      (bb/flush-buffer! buf)
+      (bb/advise-buffer! buf :dont-need 1 998)
+      (dtype/copy! (bb/map-file :double file) 998 result 0 2)
+      (is (= [998.0 999.0] (vec result)))
+      (is (= 64000 (:size (bb/map-file :bit file))))
+      (is (thrown? Exception (bb/map-file :double file :offset 7996)))
+      (is (thrown? Exception (bb/advise-buffer! (bb/make-typed-buffer :double 10) :dont-need)))
+      (is (thrown? Exception (bb/advise-buffer! (bb/map-file :double file :mode :copy-on-write)
+                                                :dont-need))))))
+
+
+(deftest shared-buffer-test
+  (resource/with-resource-context
+    (let [buf (bb/make-shared-buffer :double 16)
+          fd (bb/shared-buffer-fd buf)
+          result (double-array 8)]
+      (dtype/copy! (double-array (range 16)) 0 buf 0 16)
+      (bb/set-shared-metadata! buf 4 8)
+      ;;Attaching by fd sees the published range as a view into the buffer.
+      (let [attached (bb/attach-shared-buffer fd)]
+        (is (= :double (dtype/get-datatype attached)))
+        (dtype/copy! attached 0 result 0 8)
+        (is (= (mapv double (range 4 12)) (vec result)))
+        ;;The view starts past the buffer so it has to resolve to its mapping.
+        (is (< 0 (bb/shared-buffer-fd attached)))
+        (bb/set-shared-metadata! attached 0 16)
+        (is (= 16 (m/ecount (bb/attach-shared-buffer fd)))))
+      (let [read-only (bb/attach-shared-buffer fd :read-only? true)]
+        (is (= 16 (m/ecount read-only)))
+        (is (thrown? Exception (bb/set-shared-metadata! read-only 0 1))))
+      (is (thrown? Exception (bb/set-shared-metadata! buf 8 9)))
+      (is (thrown? Exception (bb/shared-buffer-fd (bb/make-typed-buffer :double 4))))))
+  (resource/with-resource-context
+    (let [name (str "/think-byte-buffer-test-" (System/nanoTime))
+          buf (bb/make-shared-buffer :int 10 :name name)
+          result (int-array 3)]
+      (try
+        (dtype/copy! (int-array (range 10)) 0 buf 0 10)
+        (bb/set-shared-metadata! buf 2 3)
+        (let [attached (bb/attach-shared-buffer name)]
+          (dtype/copy! attached 0 result 0 3)
+          (is (= [2 3 4] (vec result))))
+        (finally
+          (bb/unlink-shared-buffer name)))
+      (is (thrown? Exception (bb/attach-shared-buffer name))))))